@@ -36,534 +36,3336 @@
 
 #include "fcgicc.h"
 
-#include <cstring> // bzero, memcpy
+#include <algorithm> // sort, unique, replace, lower_bound, clamp
+#include <cctype> // tolower
+#include <charconv> // from_chars
+#include <cmath> // sqrt
+#include <csignal> // sig_atomic_t, sigaction, kill, SIG*
+#include <cstdlib> // getenv, strtol, unsetenv
+#include <cstring> // bzero, memchr, memcpy
+#include <ctime> // nanosleep, timespec
+#include <new> // placement new
 #include <stdexcept>
+#include <unordered_set> // unordered_set
 
 #include <errno.h> // E*
-#include <unistd.h> // read, write, close, unlink
+#include <fcntl.h> // fcntl, F_*, O_NONBLOCK
+#include <unistd.h> // read, write, close, unlink, fork
 #include <arpa/inet.h> // hton*
+#include <netdb.h> // getaddrinfo
 #include <netinet/in.h> // sockaddr_in, INADDR_*
+#include <sys/mman.h> // mmap, munmap, PROT_*, MAP_*
 #include <sys/select.h> // select, fd_set, FD_*, timeval
-#include <sys/socket.h> // socket, bind, accept, listen, sockaddr, AF_*, SOCK_*
+#include <sys/stat.h> // fstat
+#include <sys/socket.h> // socket, bind, accept, listen, sendmsg, recvmsg, sockaddr, AF_*, SOCK_*, CMSG_*
+#include <sys/uio.h> // iovec
 #include <sys/un.h> // sockaddr_un
+#include <sys/wait.h> // waitpid, WNOHANG
 
 #include <fastcgi.h>
 
 
-void FastCGIServer::FileID_cleanup(int &id)
+// the write scheduler stops framing pending output once this much is queued
+static const std::string::size_type output_high_water = 65536;
+
+// the proxy stops reading from one side once this much waits for the other
+static const std::string::size_type relay_high_water = 4 * output_high_water;
+
+// the capture_id of a connection whose input no longer goes to the capture
+static const unsigned capture_gap = ~0u;
+
+// idle buffers keep no more capacity than this
+static const std::string::size_type idle_capacity = 4096;
+
+// rate limit buckets looked at for each key, two cache lines' worth
+static const std::size_t rate_probes = 8;
+
+// the scoreboard's waiting state and oldest request are worked out at most
+// this often
+static const std::chrono::milliseconds board_tick(10);
+
+// the stop_requested of the server in prefork mode, which is all a signal
+// handler can reach
+static volatile sig_atomic_t* stop_flag = nullptr;
+
+static void
+request_stop(int)
+{
+    if (stop_flag)
+        *stop_flag = 1;
+}
+
+static void
+set_signal_handler(int signum, void (* handler)(int))
+{
+    struct sigaction action;
+    bzero(&action, sizeof(action));
+    action.sa_handler = handler;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(signum, &action, NULL) == -1)
+        throw errno_error("sigaction() failed");
+}
+
+
+void FastCGIServerBase::FileID_cleanup(int &id)
 {
     ::close(id);
 }
 
-void FastCGIServer::FileID_cleanup(const std::string &id)
+void FastCGIServerBase::FileID_cleanup(const std::string &id)
 {
     ::unlink(id.c_str());
 }
 
-bool FastCGIServer::FileID_valid(int id)
+bool FastCGIServerBase::FileID_valid(int id)
 {
     return id != -1;
 }
 
-bool FastCGIServer::FileID_valid(const std::string &id)
+bool FastCGIServerBase::FileID_valid(const std::string &id)
 {
     return id.size() > 0;
 }
 
 
 
-FastCGIServer::RequestInfo::RequestInfo() :
-    params_closed(false),
-    in_closed(false),
-    status(0),
-    output_closed(false)
+FastCGIRequest::FastCGIRequest() :
+    role(FCGI_RESPONDER),
+    request_id(0),
+    cache_ttl(0),
+    out_sent(0),
+    out_ahead(0),
+    err_sent(0),
+    framed_sent(0),
+    open_record(std::string::npos),
+    reserved(0)
 {
 }
 
 
-
-FastCGIServer::Connection::Connection() :
-    close_responsibility(false),
-    close_socket(false)
+char*
+FastCGIRequest::out_reserve(std::string::size_type& size)
 {
-}
+    if (reserved != 0)
+        throw std::logic_error("out_reserve() called again before out_commit()");
 
+    std::string::size_type ahead = std::max(out_ahead, out_sent);
+    if (out.size() > ahead) {
+        if (framed.size() == framed_sent && open_record == std::string::npos) {
+            // sent as it is, ahead of the records
+            out_ahead = out.size();
+        } else {
+            // appended to out since records were written in place, so it
+            // goes after them
+            std::string pending = out.substr(ahead);
+            out.resize(ahead);
+            for (std::string::size_type n = 0; n < pending.size(); ) {
+                std::string::size_type length = pending.size() - n;
+                std::memcpy(out_reserve(length), pending.data() + n, length);
+                out_commit(length);
+                n += length;
+            }
+        }
+    }
 
-int
-FastCGIServer::HandlerBase::operator()(FastCGIRequest&)
-{
-    return 0;
+    if (open_record == std::string::npos) {
+        open_record = framed.size();
+        framed.append(FCGI_HEADER_LEN, 0);
+    }
+
+    std::string::size_type used = framed.size() - open_record - FCGI_HEADER_LEN;
+    size = std::min(size, std::string::size_type(FCGI_MAX_LENGTH) - used);
+    reserved = size;
+    framed.resize(framed.size() + size);
+    return &framed[framed.size() - size];
 }
 
 
-FastCGIServer::FastCGIServer() :
-    handle_request(new HandlerBase),
-    handle_data(new HandlerBase),
-    handle_complete(new HandlerBase)
+void
+FastCGIRequest::out_commit(std::string::size_type n)
 {
+    framed.resize(framed.size() - (reserved - std::min(n, reserved)));
+    reserved = 0;
+    if (framed.size() - open_record - FCGI_HEADER_LEN == FCGI_MAX_LENGTH)
+        close_record();
 }
 
 
+// Fills in the header and padding of the record being written in place.
 void
-FastCGIServer::request_handler(int (* function)(FastCGIRequest&))
+FastCGIRequest::close_record()
 {
-    handle_request.reset(new StaticHandler(function));
+    if (open_record == std::string::npos)
+        return;
+
+    // space reserved but never committed
+    framed.resize(framed.size() - reserved);
+    reserved = 0;
+
+    std::string::size_type length = framed.size() - open_record - FCGI_HEADER_LEN;
+    if (length == 0) {
+        // an empty record would end the stream
+        framed.resize(open_record);
+    } else {
+        FCGI_Header header;
+        bzero(&header, sizeof(header));
+        header.version = FCGI_VERSION_1;
+        header.type = FCGI_STDOUT;
+        header.requestIdB1 = (request_id >> 8) & 0xff;
+        header.requestIdB0 = request_id & 0xff;
+        header.contentLengthB1 = (unsigned char)(length >> 8);
+        header.contentLengthB0 = (unsigned char)(length & 0xff);
+        header.paddingLength = (8 - (length % 8)) % 8;
+        std::memcpy(&framed[open_record], &header, sizeof(header));
+        framed.append(header.paddingLength, 0);
+    }
+    open_record = std::string::npos;
 }
 
 
-void
-FastCGIServer::data_handler(int (* function)(FastCGIRequest&))
+std::optional<std::string_view>
+FastCGIRequest::param(std::string_view name) const
 {
-    handle_data.reset(new StaticHandler(function));
+    if (params_raw.empty()) {
+        Params::const_iterator it = params.find(std::string(name));
+        if (it == params.end())
+            return std::nullopt;
+        return it->second;
+    }
+
+    for (const ParamSpan& span : params_index)
+        if (span.name_length == name.size() && params_raw.compare(span.name, span.name_length, name) == 0)
+            return std::string_view(params_raw).substr(span.value, span.value_length);
+    return std::nullopt;
 }
 
 
-void
-FastCGIServer::complete_handler(int (* function)(FastCGIRequest&))
+std::optional<std::string_view>
+FastCGIRequest::query(std::string_view name)
 {
-    handle_complete.reset(new StaticHandler(function));
+    if (!query_fields.parsed)
+        parse_urlencoded(query_fields, param("QUERY_STRING").value_or(std::string_view()));
+    return find_field(query_fields, name);
 }
 
 
-void
-FastCGIServer::set_handler(std::unique_ptr<HandlerBase> &handler, HandlerBase* new_handler)
+std::optional<std::string_view>
+FastCGIRequest::cookie(std::string_view name)
 {
-    handler.reset(new_handler);
+    if (!cookie_fields.parsed)
+        parse_cookies(cookie_fields, param("HTTP_COOKIE").value_or(std::string_view()));
+    return find_field(cookie_fields, name);
 }
 
 
-void
-FastCGIServer::listen(unsigned tcp_port)
+static bool
+equal_nocase(std::string_view a, std::string_view b)
 {
-    FileID<int> listen_socket = socket(PF_INET, SOCK_STREAM, 0);
-    if (listen_socket == -1)
-        throw errno_error("socket() failed");
-
-    struct sockaddr_in sa;
-    bzero(&sa, sizeof(sa));
-    sa.sin_family = AF_INET;
-    sa.sin_port = htons(uint16_t(tcp_port));
-    sa.sin_addr.s_addr = htonl(INADDR_ANY);
-    if (bind(listen_socket, (struct sockaddr*)&sa, sizeof(sa)) == -1)
-        throw errno_error("bind() failed");
+    if (a.size() != b.size())
+        return false;
+    for (std::string_view::size_type n = 0; n < a.size(); n++)
+        if (std::tolower(static_cast<unsigned char>(a[n])) != std::tolower(static_cast<unsigned char>(b[n])))
+            return false;
+    return true;
+}
 
-    if (::listen(listen_socket, 100))
-        throw errno_error("listen() failed");
 
-    listen_sockets.push_back(std::move(listen_socket));
+static std::string_view
+trim_spaces(std::string_view s)
+{
+    while (!s.empty() && (s.front() == ' ' || s.front() == '\t'))
+        s.remove_prefix(1);
+    while (!s.empty() && (s.back() == ' ' || s.back() == '\t'))
+        s.remove_suffix(1);
+    return s;
 }
 
 
-void
-FastCGIServer::listen(const std::string& local_path)
+std::optional<std::string_view>
+FastCGIRequest::form(std::string_view name)
 {
-    FileID<int> listen_socket = socket(PF_UNIX, SOCK_STREAM, 0);
-    if (listen_socket == -1)
-        throw errno_error("socket() failed");
-
-    struct sockaddr_un sa;
-    bzero(&sa, sizeof(sa));
-    sa.sun_family = AF_LOCAL;
+    if (!form_fields.parsed) {
+        // the media type, without parameters such as charset
+        std::string_view type = param("CONTENT_TYPE").value_or(std::string_view());
+        if (equal_nocase(trim_spaces(type.substr(0, type.find(';'))), "application/x-www-form-urlencoded"))
+            parse_urlencoded(form_fields, in);
+        form_fields.parsed = true;
+    }
+    return find_field(form_fields, name);
+}
 
-    std::string::size_type size = local_path.size();
-    if (size >= sizeof(sa.sun_path))
-        throw std::runtime_error("path too long");
-    if (local_path.find_first_of('\0') != std::string::npos)
-        throw std::runtime_error("null character in path");
 
-    std::memcpy(sa.sun_path, local_path.data(), size);
+static int
+hex_digit(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
 
-    unlink(local_path.c_str());
-    listen_unlink.push_back(local_path);
 
-    socklen_t socklen = static_cast<socklen_t>(sizeof(sa) - (sizeof(sa.sun_path) - size - 1));
-    if (bind(listen_socket, (struct sockaddr*)&sa, socklen) == -1)
-        throw errno_error("bind() failed");
+// Percent-decodes s, with '+' for a space, into a new string in storage if
+// there is anything to decode.  The scans and copies between escapes go
+// through memchr() and memcpy(), which the C library vectorizes.
+static std::string_view
+url_decode(std::string_view s, std::list<std::string>& storage)
+{
+    if (s.empty() || (!std::memchr(s.data(), '%', s.size()) && !std::memchr(s.data(), '+', s.size())))
+        return s;
 
-    if (::listen(listen_socket, 100))
-        throw errno_error("listen() failed");
+    std::string& out = storage.emplace_back();
+    out.reserve(s.size());
+    for (std::string::size_type n = 0; n < s.size(); ) {
+        const char* escape = static_cast<const char*>(std::memchr(s.data() + n, '%', s.size() - n));
+        std::string::size_type end = escape ? static_cast<std::string::size_type>(escape - s.data()) : s.size();
+        std::string::size_type from = out.size();
+        out.append(s.data() + n, end - n);
+        std::replace(out.begin() + static_cast<std::string::difference_type>(from), out.end(), '+', ' ');
+        if (end == s.size())
+            break;
 
-    listen_sockets.push_back(std::move(listen_socket));
+        int high = end + 2 < s.size() ? hex_digit(s[end + 1]) : -1;
+        int low = high >= 0 ? hex_digit(s[end + 2]) : -1;
+        if (low >= 0) {
+            out.push_back(static_cast<char>(high * 16 + low));
+            n = end + 3;
+        } else {
+            out.push_back('%');
+            n = end + 1;
+        }
+    }
+    return out;
 }
 
 
 void
-FastCGIServer::abandon_files()
+FastCGIRequest::parse_urlencoded(Fields& fields, std::string_view s)
 {
-    for (auto &file : listen_unlink)
-        file.release();
-    listen_unlink.clear();
+    fields.parsed = true;
+    while (!s.empty()) {
+        std::string_view::size_type amp = s.find('&');
+        std::string_view part = s.substr(0, amp);
+        s = amp == std::string_view::npos ? std::string_view() : s.substr(amp + 1);
+        if (part.empty())
+            continue;
+
+        std::string_view::size_type equals = part.find('=');
+        std::string_view value = equals == std::string_view::npos ? std::string_view() : part.substr(equals + 1);
+        fields.pairs.emplace_back(url_decode(part.substr(0, equals), fields.decoded),
+                                  url_decode(value, fields.decoded));
+    }
 }
 
 
+// "name=value; name2=value2", with values possibly in double quotes
 void
-FastCGIServer::process(int timeout_ms)
+FastCGIRequest::parse_cookies(Fields& fields, std::string_view s)
 {
-    char buffer[4096];
-    fd_set fs_read;
-    fd_set fs_write;
-    int nfd = 0;
-    struct timeval tv = { timeout_ms / 1000, (timeout_ms % 1000) * 1000 };
-
-    FD_ZERO(&fs_read);
-    FD_ZERO(&fs_write);
+    fields.parsed = true;
+    while (!s.empty()) {
+        std::string_view::size_type semicolon = s.find(';');
+        std::string_view part = s.substr(0, semicolon);
+        s = semicolon == std::string_view::npos ? std::string_view() : s.substr(semicolon + 1);
 
-    for (auto &sock : listen_sockets) {
-        FD_SET(sock, &fs_read);
-        nfd = std::max(nfd, sock.get());
+        std::string_view::size_type equals = part.find('=');
+        if (equals == std::string_view::npos)
+            continue;
+        std::string_view value = trim_spaces(part.substr(equals + 1));
+        if (value.size() >= 2 && value.front() == '"' && value.back() == '"')
+            value = value.substr(1, value.size() - 2);
+        fields.pairs.emplace_back(trim_spaces(part.substr(0, equals)), value);
     }
+}
 
-    for (auto &[sock, conn_ptr] : read_sockets) {
-        FD_SET(sock, &fs_read);
-        if (!conn_ptr->output_buffer.empty())
-            FD_SET(sock, &fs_write);
-        nfd = std::max(nfd, sock.get());
-    }
 
-    int select_result = select(nfd + 1, &fs_read, &fs_write, NULL, timeout_ms < 0 ? NULL : &tv);
-    if (select_result == -1) {
-        if (errno == EINTR)
-            return;
-        else
-            throw errno_error("select() failed");
-    }
+std::optional<std::string_view>
+FastCGIRequest::find_field(const Fields& fields, std::string_view name)
+{
+    for (auto &[field, value] : fields.pairs)
+        if (field == name)
+            return value;
+    return std::nullopt;
+}
 
-    for (auto &sock : listen_sockets) {
-        if (FD_ISSET(sock, &fs_read)) {
-            FileID read_socket = accept(sock, NULL, NULL);
-            if (read_socket == -1)
-                throw errno_error("accept() failed");
-            ConnectionPtr connection( new Connection );
-            read_sockets.try_emplace(std::move(read_socket), std::move(connection));
-        }
-    }
 
-    for (auto it = read_sockets.begin(); it != read_sockets.end(); ) {
-        int read_socket = it->first;
 
-        if (FD_ISSET(read_socket, &fs_read)) {
-            ssize_t read_result = read(read_socket, buffer, sizeof(buffer));
-            if (read_result < 0) {
-                if (errno == ECONNRESET)
-                    goto close_socket;
-                else
-                    throw errno_error("read() on socket failed");
-            }
-            if (read_result == 0) {
-                it->second->close_socket = true;
-            } else {
-                it->second->input_buffer.append(buffer, static_cast<size_t>(read_result));
-                process_connection_read(*it->second);
-            }
-        }
+std::string
+FastCGIMultipart::boundary(std::string_view content_type)
+{
+    if (!equal_nocase(content_type.substr(0, 10), "multipart/"))
+        return std::string();
+    return std::string(header_param(content_type, "boundary"));
+}
 
-        if (!it->second->output_buffer.empty() && FD_ISSET(read_socket, &fs_write)) {
-            process_connection_write(*it->second);
-            ssize_t write_result = write(read_socket, it->second->output_buffer.data(),
-                                         it->second->output_buffer.size());
-            if (write_result == -1)
-                throw errno_error("write() failed");
-            it->second->output_buffer.erase(0, static_cast<size_t>(write_result));
-        }
 
-        if (it->second->close_socket && it->second->output_buffer.empty()) {
-        close_socket:
-            int close_result = close(it->first.release());
-            if (close_result == -1 && errno != ECONNRESET)
-                throw errno_error("close() failed");
-            it = read_sockets.erase(it);
-        } else
-            ++it;
+std::string_view
+FastCGIMultipart::header_param(std::string_view value, std::string_view name)
+{
+    std::string_view::size_type semicolon = value.find(';');
+    while (semicolon != std::string_view::npos) {
+        value.remove_prefix(semicolon + 1);
+        semicolon = value.find(';');
+        std::string_view part = value.substr(0, semicolon);
+        std::string_view::size_type equals = part.find('=');
+        if (equals == std::string_view::npos || !equal_nocase(trim_spaces(part.substr(0, equals)), name))
+            continue;
+        std::string_view found = trim_spaces(part.substr(equals + 1));
+        if (found.size() >= 2 && found.front() == '"' && found.back() == '"')
+            found = found.substr(1, found.size() - 2);
+        return found;
     }
+    return std::string_view();
 }
 
 
-void
-FastCGIServer::process_forever()
+FastCGIMultipart::FastCGIMultipart(std::string_view boundary) :
+    delimiter(std::string("\r\n--").append(boundary)),
+    state(preamble),
+    carry("\r\n")                           // so that the body may begin with a delimiter
 {
-    for (;;)
-        process();
 }
 
 
-void
-FastCGIServer::process_connection_read(Connection& connection)
+// The first position before limit where the delimiter begins in hay, or
+// where hay ends with the beginning of a delimiter.
+static std::string_view::size_type
+find_delimiter(std::string_view hay, std::string_view delimiter, std::string_view::size_type limit)
 {
-    std::string::size_type n = 0;
-    while (connection.input_buffer.size() - n >= FCGI_HEADER_LEN) {
-        const FCGI_Header& header = *reinterpret_cast<const FCGI_Header*>(connection.input_buffer.data() + n);
-        if (header.version != FCGI_VERSION_1) {
-            connection.close_socket = true;
+    for (std::string_view::size_type p = 0; p < limit; p++) {
+        const char* found = static_cast<const char*>(std::memchr(hay.data() + p, delimiter[0], limit - p));
+        if (!found)
             break;
-        }
+        p = static_cast<std::string_view::size_type>(found - hay.data());
+        if (std::memcmp(found, delimiter.data(), std::min(delimiter.size(), hay.size() - p)) == 0)
+            return p;
+    }
+    return std::string_view::npos;
+}
 
-        unsigned content_length = (static_cast<unsigned>(header.contentLengthB1) << 8) + header.contentLengthB0;
-        if (connection.input_buffer.size() - n < FCGI_HEADER_LEN + content_length + header.paddingLength)
-            break;
-        const char* content = connection.input_buffer.data() + n + FCGI_HEADER_LEN;
 
-        RequestID request_id = (static_cast<unsigned>(header.requestIdB1) << 8) + header.requestIdB0;
+int
+FastCGIMultipart::feed(std::string_view input, const Handlers& handlers)
+{
+    int status = 0;
+    while (status == 0 && !input.empty())
+        switch (state) {
+        case preamble:
+        case body:
+            status = search(input, handlers);
+            break;
 
-        switch (header.type)
-        {
-        case FCGI_GET_VALUES:
+        case delimiter_line:
+        case headers:
             {
-                Pairs pairs = parse_pairs(content, content_length);
-
-                std::string::size_type base = connection.output_buffer.size();
-                connection.output_buffer.push_back(FCGI_VERSION_1);
-                connection.output_buffer.push_back(FCGI_GET_VALUES_RESULT);
-                connection.output_buffer.append(FCGI_HEADER_LEN - 2, 0);
-
-                for (Pairs::iterator it = pairs.begin(); it != pairs.end(); ++it) {
-                    if (it->first == FCGI_MAX_CONNS)
-                        write_pair(connection.output_buffer, it->first, std::string("100"));
-                    else if (it->first == FCGI_MAX_REQS)
-                        write_pair(connection.output_buffer, it->first, std::string("1000"));
-                    else if (it->first == FCGI_MPXS_CONNS)
-                        write_pair(connection.output_buffer, it->first, std::string("1"));
-                }
-
-                std::string::size_type len = connection.output_buffer.size() - base;
-                connection.output_buffer[base + 4] = char((len >> 8) & 0xff);
-                connection.output_buffer[base + 5] = char(len & 0xff);
-                break;
-            }
+                // a delimiter line, usually empty, ends with CRLF, and the
+                // part headers with an empty line
+                std::string_view end = state == delimiter_line ? "\r\n" : "\r\n\r\n";
+                std::string::size_type limit = state == delimiter_line ? 1024 : 16384;
+                std::string::size_type before = head.size();
+                head.append(input.substr(0, limit + 1 - before));
 
-        case FCGI_BEGIN_REQUEST:
-            {
-                if (content_length < sizeof(FCGI_BeginRequestBody))
-                    break;
-                const FCGI_BeginRequestBody& body = *reinterpret_cast<const FCGI_BeginRequestBody*>(content);
-
-                if (!(body.flags & FCGI_KEEP_CONN))
-                    connection.close_responsibility = true;
-
-                unsigned role = (unsigned(body.roleB1) << 8) + body.roleB0;
-                if (role != FCGI_RESPONDER) {
-                    FCGI_EndRequestRecord unknown;
-                    bzero(&unknown, sizeof(unknown));
-                    unknown.header.version = FCGI_VERSION_1;
-                    unknown.header.type = FCGI_END_REQUEST;
-                    unknown.header.contentLengthB0 = sizeof(unknown.body);
-                    unknown.body.protocolStatus = FCGI_UNKNOWN_ROLE;
-                    connection.output_buffer.append(reinterpret_cast<const char*>(&unknown), sizeof(unknown));
-                    if (connection.close_responsibility)
-                        connection.close_socket = true;
+                if (state == delimiter_line && head.compare(0, 2, "--") == 0) {
+                    state = epilogue;
                     break;
                 }
-
-                {
-                    RequestList::iterator it = connection.requests.find(request_id);
-                    if (it != connection.requests.end()) {
-                        connection.requests.erase(it);
-                    }
+                std::string::size_type found = state == headers && head.compare(0, 2, "\r\n") == 0 ? 0 :
+                    head.find(end, before >= end.size() ? before - end.size() + 1 : 0);
+                if (found == std::string::npos) {
+                    if (head.size() > limit)
+                        state = malformed;
+                    input = std::string_view();
+                    break;
                 }
 
-                RequestInfoPtr new_request(new RequestInfo);
-                connection.requests.insert( {request_id, std::move(new_request)} );
+                std::string::size_type length = found + (found == 0 ? 2 : end.size());
+                input.remove_prefix(length - before);
+                head.resize(length);
+                if (state == delimiter_line) {
+                    head.clear();
+                    state = headers;
+                } else
+                    status = begin_part(handlers);
                 break;
             }
 
-        case FCGI_ABORT_REQUEST:
-            {
-                RequestList::iterator it = connection.requests.find(request_id);
-                if (it == connection.requests.end())
-                    break;
+        case epilogue:
+        case malformed:
+            input = std::string_view();
+            break;
+        }
+    return status;
+}
 
-                FCGI_EndRequestRecord aborted;
-                bzero(&aborted, sizeof(aborted));
-                aborted.header.version = FCGI_VERSION_1;
-                aborted.header.type = FCGI_END_REQUEST;
-                aborted.header.contentLengthB0 = sizeof(aborted.body);
-                aborted.body.appStatusB0 = 1;
-                aborted.body.protocolStatus = FCGI_REQUEST_COMPLETE;
-                connection.output_buffer.append(reinterpret_cast<const char*>(&aborted), sizeof(aborted));
-                if (connection.close_responsibility)
-                    connection.close_socket = true;
 
-                connection.requests.erase(it);
-                break;
-            }
+// Passes on the input up to the next delimiter, keeping back what may be
+// the beginning of one.  Once found, moves on to the delimiter line.
+int
+FastCGIMultipart::search(std::string_view& input, const Handlers& handlers)
+{
+    int status = 0;
+    std::string::size_type length = delimiter.size();
 
-        case FCGI_PARAMS:
-            {
-                RequestList::iterator it = connection.requests.find(request_id);
-                if (it == connection.requests.end())
-                    break;
+    if (!carry.empty()) {
+        // enough input to tell if the carry begins a delimiter
+        std::string::size_type kept = carry.size();
+        carry.append(input.substr(0, length));
+        std::string_view::size_type p = find_delimiter(carry, delimiter, kept);
+        if (p == std::string_view::npos) {
+            status = emit(std::string_view(carry).substr(0, kept), handlers);
+            carry.clear();
+        } else if (carry.size() - p < length) {
+            // still only the beginning, and all of the input
+            status = emit(std::string_view(carry).substr(0, p), handlers);
+            carry.erase(0, p);
+            input = std::string_view();
+            return status;
+        } else {
+            status = emit(std::string_view(carry).substr(0, p), handlers);
+            input.remove_prefix(p + length - kept);
+            carry.clear();
+            state = delimiter_line;
+            return status;
+        }
+        if (status != 0)
+            return status;
+    }
 
-                RequestInfo& request = *it->second;
-                if (!request.params_closed) {
-                    if (content_length != 0)
-                        request.params_buffer.append(content, content_length);
-                    else {
-                        request.params = parse_pairs(request.params_buffer.data(), request.params_buffer.size());
-                        request.params_buffer.clear();
-                        request.params_closed = true;
-
-                        request.status = (*handle_request)(request);
-                        if (request.status == 0 && !request.in.empty()) {
-                            request.status = (*handle_data)(request);
-                            if (request.status == 0 && request.in_closed)
-                                request.status = (*handle_complete)(request);
-                        }
-                        process_write_request(connection, request_id, request);
-                    }
-                }
-                break;
-            }
+    std::string_view::size_type p = find_delimiter(input, delimiter, input.size());
+    if (p == std::string_view::npos) {
+        status = emit(input, handlers);
+        input = std::string_view();
+    } else if (input.size() - p < length) {
+        status = emit(input.substr(0, p), handlers);
+        carry.assign(input.substr(p));
+        input = std::string_view();
+    } else {
+        status = emit(input.substr(0, p), handlers);
+        input.remove_prefix(p + length);
+        state = delimiter_line;
+    }
+    return status;
+}
 
-        case FCGI_STDIN:
-            {
-                RequestList::iterator it = connection.requests.find(request_id);
-                if (it == connection.requests.end())
-                    break;
 
-                RequestInfo& request = *it->second;
-                if (!request.in_closed) {
-                    if (content_length != 0) {
-                        request.in.append(content, content_length);
-                        if (request.params_closed && request.status == 0) {
-                            request.status = (*handle_data)(request);
-                            process_write_request(connection, request_id, request);
-                        }
-                    } else {
-                        request.in_closed = true;
-                        if (request.params_closed && request.status == 0) {
-                            request.status = (*handle_complete)(request);
-                            process_write_request(connection, request_id, request);
-                        }
-                    }
-                }
-                break;
-            }
+int
+FastCGIMultipart::emit(std::string_view data, const Handlers& handlers)
+{
+    if (state != body || data.empty() || !handlers.data)
+        return 0;
+    return handlers.data(data);
+}
 
-        case FCGI_DATA:
-            break;
 
-        default:
-            {
-                FCGI_UnknownTypeRecord unknown;
-                bzero(&unknown, sizeof(unknown));
-                unknown.header.version = FCGI_VERSION_1;
-                unknown.header.type = FCGI_UNKNOWN_TYPE;
-                unknown.header.contentLengthB0 = sizeof(unknown.body);
-                unknown.body.type = header.type;
-                connection.output_buffer.append(reinterpret_cast<const char*>(&unknown), sizeof(unknown));
-            }
-        }
+int
+FastCGIMultipart::begin_part(const Handlers& handlers)
+{
+    Headers fields;
+    std::string_view lines = head;
+    while (!lines.empty()) {
+        std::string_view::size_type crlf = lines.find("\r\n");
+        std::string_view line = lines.substr(0, crlf);
+        lines = crlf == std::string_view::npos ? std::string_view() : lines.substr(crlf + 2);
 
-        n += FCGI_HEADER_LEN + content_length + header.paddingLength;
+        std::string_view::size_type colon = line.find(':');
+        if (colon == std::string_view::npos)
+            continue;
+        std::string name(trim_spaces(line.substr(0, colon)));
+        for (char& c : name)
+            c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+        fields.emplace(name, trim_spaces(line.substr(colon + 1)));
     }
 
-    connection.input_buffer.erase(0, n);
+    head.clear();
+    state = body;
+    return handlers.part ? handlers.part(fields) : 0;
 }
 
 
-void
-FastCGIServer::process_write_request(Connection& connection, RequestID id, RequestInfo& request)
+
+// A plain text response with the given status and any other header lines.
+static void
+write_status(std::string& out, std::string_view status, std::string_view headers = std::string_view())
 {
-    if (!request.out.empty()) {
-        write_data(connection.output_buffer, id, request.out, FCGI_STDOUT);
-        request.out.clear();
-    }
-    if (!request.err.empty()) {
-        write_data(connection.output_buffer, id, request.err, FCGI_STDERR);
-        request.err.clear();
-    }
-    if ((request.in_closed || request.status != 0) &&
-            !request.output_closed) {
-        write_data(connection.output_buffer, id, request.out, FCGI_STDOUT);
-        write_data(connection.output_buffer, id, request.err, FCGI_STDERR);
+    out.append("Status: ").append(status).append("\r\n").append(headers)
+        .append("Content-Type: text/plain\r\n\r\n").append(status).append("\n");
+}
 
-        FCGI_EndRequestRecord complete;
-        bzero(&complete, sizeof(complete));
-        complete.header.version = FCGI_VERSION_1;
-        complete.header.type = FCGI_END_REQUEST;
-        complete.header.requestIdB1 = (id >> 8) & 0xff;
-        complete.header.requestIdB0 = id & 0xff;
-        complete.header.contentLengthB0 = sizeof(complete.body);
-        complete.body.appStatusB3 = static_cast<unsigned char>((request.status >> 24) & 0xff);
-        complete.body.appStatusB2 = static_cast<unsigned char>((request.status >> 16) & 0xff);
-        complete.body.appStatusB1 = static_cast<unsigned char>((request.status >> 8) & 0xff);
-        complete.body.appStatusB0 = static_cast<unsigned char>(request.status & 0xff);
-        complete.body.protocolStatus = FCGI_REQUEST_COMPLETE;
-        connection.output_buffer.append(reinterpret_cast<const char*>(&complete), sizeof(complete));
-        if (connection.close_responsibility)
-            connection.close_socket = true;
 
-        request.output_closed = true;
-    }
+std::optional<std::string_view>
+FastCGIRouter::Captures::get(std::string_view name) const
+{
+    for (unsigned i = 0; i < count; i++)
+        if (names[i] == name)
+            return values[i];
+    return std::nullopt;
 }
 
 
-void
-FastCGIServer::process_connection_write(Connection& connection)
+const FastCGIRouter::Handler*
+FastCGIRouter::Node::handler(std::string_view method) const
 {
-    for (auto it = connection.requests.begin(); it != connection.requests.end(); ) {
-        process_write_request(connection, it->first, *it->second);
-        if (it->second->params_closed && it->second->in_closed) {
-            it = connection.requests.erase(it);
-        } else
-            ++it;
-    }
+    for (const auto &[route_method, route_handler] : methods)
+        if (route_method.empty() || route_method == method)
+            return &route_handler;
+    return nullptr;
 }
 
 
-FastCGIServer::Pairs
-FastCGIServer::parse_pairs(const char* data, std::string::size_type n)
+void
+FastCGIRouter::add(std::string_view method, std::string_view pattern,
+                   int (* function)(FastCGIRequest&, const Captures&))
 {
-    Pairs pairs;
+    add_route(method, pattern, function);
+}
 
-    const unsigned char* u = reinterpret_cast<const unsigned char*>(data);
 
-    for (std::string::size_type m = 0; m < n;) {
-        std::string::size_type name_length, value_length;
+void
+FastCGIRouter::add_route(std::string_view method, std::string_view pattern, Handler handler)
+{
+    if (pattern.empty() || pattern[0] != '/')
+        throw std::invalid_argument("route pattern does not begin with /");
 
-        if (u[m] >> 7) {
-            if (n - m < 4)
-                break;
-            name_length =   ((uint32_t(u[m]) & 0x7f) << 24) +
-                            (uint32_t(u[m + 1]) << 16) +
-                            (uint32_t(u[m + 2]) << 8) +
-                            uint32_t(u[m + 3]);
-            m += 4;
-        } else
-            name_length = u[m++];
-        if (m >= n)
-            break;
+    bool literal = true;
+    for (std::string_view::size_type i = 0; i < pattern.size(); i++)
+        if (pattern[i] == '/' && i + 1 < pattern.size() && (pattern[i + 1] == ':' || pattern[i + 1] == '*'))
+            literal = false;
 
-        if (u[m] >> 7) {
-            if (n - m < 4)
-                break;
-            value_length =  ((uint32_t(u[m]) & 0x7f) << 24) +
-                            (uint32_t(u[m + 1]) << 16) +
-                            (uint32_t(u[m + 2]) << 8) +
-                            uint32_t(u[m + 3]);
-            m += 4;
-        } else
-            value_length = u[m++];
+    Node* node = &root;
+    if (literal) {
+        std::unordered_map<std::string_view, std::unique_ptr<Node>>::iterator it = exact.find(pattern);
+        if (it == exact.end()) {
+            std::unique_ptr<Node> path(new Node);
+            path->name = pattern;
+            std::string_view key = path->name;
+            it = exact.emplace(key, std::move(path)).first;
+        }
+        node = it->second.get();
+    } else {
+        unsigned captures = 0;
+        std::string_view rest = pattern;
+        while (!rest.empty()) {
+            rest.remove_prefix(1);
+            std::string_view::size_type slash = rest.find('/');
+            std::string_view segment = rest.substr(0, slash);
+            rest = slash == std::string_view::npos ? std::string_view() : rest.substr(slash);
 
-        if (n - m < name_length)
-            break;
-        std::string key(data + m, name_length);
-        m += name_length;
+            if (!segment.empty() && (segment[0] == ':' || segment[0] == '*')) {
+                if (segment.size() == 1)
+                    throw std::invalid_argument("route parameter has no name");
+                if (segment[0] == '*' && !rest.empty())
+                    throw std::invalid_argument("route * parameter is not last");
+                if (++captures > max_captures)
+                    throw std::invalid_argument("route has too many parameters");
+                node = &parameter_node(segment[0] == ':' ? node->parameter : node->rest, segment.substr(1));
+                continue;
+            }
 
-        if (n - m < value_length)
-            break;
-        pairs.insert( {key, std::string(data + m, value_length)} );
-        m += value_length;
+            std::vector<std::pair<std::string, std::unique_ptr<Node>>>::iterator child =
+                std::lower_bound(node->children.begin(), node->children.end(), segment,
+                    [](const std::pair<std::string, std::unique_ptr<Node>>& c, std::string_view s) {
+                        return c.first < s;
+                    });
+            if (child == node->children.end() || child->first != segment)
+                child = node->children.emplace(child, std::string(segment), std::unique_ptr<Node>(new Node));
+            node = child->second.get();
+        }
     }
 
-    return pairs;
+    for (const auto &route : node->methods)
+        if (route.first == method)
+            throw std::invalid_argument("route already added");
+    node->methods.emplace_back(std::string(method), std::move(handler));
 }
 
 
-void
-FastCGIServer::write_pair(std::string& buffer, const std::string& key, const std::string& value)
+FastCGIRouter::Node&
+FastCGIRouter::parameter_node(std::unique_ptr<Node>& node, std::string_view name)
 {
-    if (key.size() > 0x7f) {
-        buffer.push_back(char(0x80 + ((key.size() >> 24) & 0x7f)));
+    if (!node) {
+        node.reset(new Node);
+        node->name = name;
+    } else if (node->name != name)
+        throw std::invalid_argument("route parameter named differently at the same place");
+    return *node;
+}
+
+
+// Splits the first segment off a path that begins with '/', leaving the
+// rest, which is empty or begins with '/' too.
+static std::string_view
+next_segment(std::string_view& path)
+{
+    path.remove_prefix(1);
+    std::string_view::size_type slash = path.find('/');
+    std::string_view segment = path.substr(0, slash);
+    path = slash == std::string_view::npos ? std::string_view() : path.substr(slash);
+    return segment;
+}
+
+
+// The handler for a method of the route matching the rest of a path, which
+// is empty or begins with '/', below a node.  Literal segments are tried
+// first, backtracking to parameters also when a route matches the path but
+// not the method, which sets path_found.
+const FastCGIRouter::Handler*
+FastCGIRouter::find_node(const Node& node, std::string_view method, std::string_view path,
+                         Captures& captures, bool& path_found)
+{
+    if (path.empty()) {
+        const Handler* handler = node.handler(method);
+        if (!handler && !node.methods.empty())
+            path_found = true;
+        return handler;
+    }
+
+    std::string_view whole = path.substr(1);
+    std::string_view rest = path;
+    std::string_view segment = next_segment(rest);
+
+    std::vector<std::pair<std::string, std::unique_ptr<Node>>>::const_iterator child =
+        std::lower_bound(node.children.begin(), node.children.end(), segment,
+            [](const std::pair<std::string, std::unique_ptr<Node>>& c, std::string_view s) {
+                return c.first < s;
+            });
+    if (child != node.children.end() && child->first == segment)
+        if (const Handler* handler = find_node(*child->second, method, rest, captures, path_found))
+            return handler;
+
+    // patterns have at most max_captures parameters, so there is room
+    unsigned count = captures.count;
+    if (node.parameter && !segment.empty()) {
+        captures.names[count] = node.parameter->name;
+        captures.values[count] = segment;
+        captures.count = count + 1;
+        if (const Handler* handler = find_node(*node.parameter, method, rest, captures, path_found))
+            return handler;
+        captures.count = count;
+    }
+    if (node.rest) {
+        if (const Handler* handler = node.rest->handler(method)) {
+            captures.names[count] = node.rest->name;
+            captures.values[count] = whole;
+            captures.count = count + 1;
+            return handler;
+        }
+        path_found = true;
+    }
+    return nullptr;
+}
+
+
+// Adds the methods of every route matching the rest of a path below a node.
+void
+FastCGIRouter::add_methods(const Node& node, std::string_view path, std::vector<std::string_view>& methods)
+{
+    if (path.empty()) {
+        for (const auto &route : node.methods)
+            methods.push_back(route.first);
+        return;
+    }
+
+    std::string_view rest = path;
+    std::string_view segment = next_segment(rest);
+    for (const auto &child : node.children)
+        if (child.first == segment)
+            add_methods(*child.second, rest, methods);
+    if (node.parameter && !segment.empty())
+        add_methods(*node.parameter, rest, methods);
+    if (node.rest)
+        add_methods(*node.rest, std::string_view(), methods);
+}
+
+
+const FastCGIRouter::Handler*
+FastCGIRouter::find(std::string_view method, std::string_view path, Captures& captures, bool* path_found) const
+{
+    bool found = false;
+    std::unordered_map<std::string_view, std::unique_ptr<Node>>::const_iterator it = exact.find(path);
+    if (it != exact.end()) {
+        if (const Handler* handler = it->second->handler(method))
+            return handler;
+        found = true;
+    }
+
+    captures.count = 0;
+    if (!path.empty() && path[0] == '/')
+        if (const Handler* handler = find_node(root, method, path, captures, found))
+            return handler;
+
+    captures.count = 0;
+    if (path_found)
+        *path_found = found;
+    return nullptr;
+}
+
+
+std::string
+FastCGIRouter::allowed(std::string_view path) const
+{
+    std::vector<std::string_view> methods;
+    std::unordered_map<std::string_view, std::unique_ptr<Node>>::const_iterator it = exact.find(path);
+    if (it != exact.end())
+        add_methods(*it->second, std::string_view(), methods);
+    if (!path.empty() && path[0] == '/')
+        add_methods(root, path, methods);
+    std::sort(methods.begin(), methods.end());
+    methods.erase(std::unique(methods.begin(), methods.end()), methods.end());
+
+    std::string allow;
+    for (std::string_view method : methods)
+        allow.append(allow.empty() ? "" : ", ").append(method);
+    return allow;
+}
+
+
+int
+FastCGIRouter::handle(FastCGIRequest& request)
+{
+    std::optional<std::string_view> path = request.param("REQUEST_URI");
+    if (path)
+        path = path->substr(0, path->find('?'));
+    else
+        path = request.param("SCRIPT_NAME");
+    std::optional<std::string_view> method = request.param("REQUEST_METHOD");
+
+    Captures captures;
+    bool path_found = false;
+    const Handler* handler = find(method.value_or(std::string_view()), path.value_or(std::string_view()),
+                                  captures, &path_found);
+    if (handler)
+        return (*handler)(request, captures);
+
+    if (path_found)
+        write_status(request.out, "405 Method Not Allowed",
+                     "Allow: " + allowed(path.value_or(std::string_view())) + "\r\n");
+    else
+        write_status(request.out, "404 Not Found");
+    return 1;
+}
+
+
+FastCGIServerBase::RequestInfo::RequestInfo() :
+    params_size(0),
+    params_closed(false),
+    data_closed(true),
+    in_closed(false),
+    no_stdin(false),
+    status(0),
+    answered(false),
+    parked(false),
+    output_closed(false),
+    deficit(0),
+    capture(false),
+    start_us(0),
+    bytes_in(0),
+    bytes_out(0)
+{
+}
+
+
+
+FastCGIServerBase::Connection::Connection() :
+    close_responsibility(false),
+    close_socket(false),
+    next_turn(0),
+    parked(0),
+    wake(false),
+    paused(false),
+    counted(0),
+    reset(false),
+    capture_id(0)
+{
+}
+
+
+std::string::size_type
+FastCGIServerBase::Connection::buffered() const
+{
+    std::string::size_type size = input_buffer.size() + output_buffer.size();
+    for (auto &[id, request] : requests)
+        size += request->params_buffer.size() + request->params_raw.size() + request->data.size() +
+            request->in.size() + request->out.size() + request->err.size() + request->framed.size() + request->captured.size();
+    return size;
+}
+
+
+FastCGIServerBase::Overload::Overload() :
+    max_requests(-1),
+    max_busy(Clock::duration::max()),
+    target(Clock::duration::zero()),
+    interval(Clock::duration::zero()),
+    budget(0),
+    drop_count(0),
+    dropping(false)
+{
+}
+
+
+FastCGIServerBase::Stats::Stats() :
+    requests_active(0),
+    requests_shed(0),
+    bytes_buffered(0),
+    loop_busy_us(0),
+    cache_hits(0),
+    cache_misses(0),
+    requests_coalesced(0),
+    authorizations(0),
+    authorizations_cached(0),
+    requests_limited(0),
+    capture_dropped(0)
+{
+}
+
+
+template class BasicFastCGIServer<FastCGIHandlers>;
+
+
+FastCGIServerBase::FastCGIServerBase() :
+    handed_off(false),
+    group(nullptr),
+    group_index(0),
+    group_load(0),
+    steal_request(0),
+    asked(nullptr),
+    incoming(nullptr),
+    loop_busy(Clock::duration::zero()),
+    quantum(16384),
+    params_lazy(false),
+    max_params(0),
+    decision_ttl(0),
+    worker(nullptr),
+    stop_requested(0),
+    board(nullptr),
+    board_slot(nullptr),
+    board_stale(false),
+    log(nullptr),
+    log_ring(nullptr),
+    capture_ring_bytes(0),
+    capture_ids(nullptr)
+{
+}
+
+
+FastCGIServerBase::~FastCGIServerBase()
+{
+    if (board)
+        munmap(board, FastCGIScoreboard::bytes(board->size));
+    if (capture_ids)
+        munmap(capture_ids, sizeof(*capture_ids));
+    if (handoff_socket.is_valid())
+        unlink(handoff_path.c_str());
+    for (Handoff* handoff = incoming.exchange(nullptr); handoff; ) {
+        Handoff* next = handoff->next;
+        delete handoff;
+        handoff = next;
+    }
+}
+
+
+FastCGIServer::FastCGIServer()
+{
+}
+
+
+void
+FastCGIServer::request_handler(int (* function)(FastCGIRequest&))
+{
+    app.request.reset(new FastCGIHandlers::StaticHandler(function));
+}
+
+
+void
+FastCGIServer::data_handler(int (* function)(FastCGIRequest&))
+{
+    app.data.reset(new FastCGIHandlers::StaticHandler(function));
+}
+
+
+void
+FastCGIServer::chunk_handler(int (* function)(FastCGIRequest&, std::string_view))
+{
+    app.chunk.reset(new FastCGIHandlers::StaticChunkHandler(function));
+}
+
+
+void
+FastCGIServer::data_stream_handler(int (* function)(FastCGIRequest&, std::string_view))
+{
+    app.data_stream.reset(new FastCGIHandlers::StaticChunkHandler(function));
+}
+
+
+void
+FastCGIServer::part_handler(int (* function)(FastCGIRequest&, const FastCGIMultipart::Headers&))
+{
+    app.part.reset(new FastCGIHandlers::StaticPartHandler(function));
+}
+
+
+void
+FastCGIServer::part_data_handler(int (* function)(FastCGIRequest&, std::string_view))
+{
+    app.part_data.reset(new FastCGIHandlers::StaticChunkHandler(function));
+}
+
+
+void
+FastCGIServer::complete_handler(int (* function)(FastCGIRequest&))
+{
+    app.complete.reset(new FastCGIHandlers::StaticHandler(function));
+}
+
+
+void
+FastCGIServer::batch_handler(int (* function)(const std::vector<FastCGIRequest*>&))
+{
+    app.batch.reset(new FastCGIHandlers::StaticBatchHandler(function));
+}
+
+
+void
+FastCGIServer::set_handler(std::unique_ptr<HandlerBase> &handler, HandlerBase* new_handler)
+{
+    handler.reset(new_handler);
+}
+
+
+void
+FastCGIServerBase::overload_limits(int max_requests, int max_busy_ms)
+{
+    overload.max_requests = max_requests;
+    overload.max_busy = max_busy_ms < 0 ? Clock::duration::max() :
+        std::chrono::duration_cast<Clock::duration>(std::chrono::milliseconds(max_busy_ms));
+}
+
+
+void
+FastCGIServerBase::overload_adaptive(int target_ms, int interval_ms)
+{
+    overload.target = std::chrono::duration_cast<Clock::duration>(std::chrono::milliseconds(target_ms));
+    overload.interval = std::chrono::duration_cast<Clock::duration>(std::chrono::milliseconds(interval_ms));
+    overload.first_above = Clock::time_point();
+    overload.dropping = false;
+}
+
+
+// Decides whether a new request should be refused.  The adaptive mode
+// follows the CoDel control law: after the busy time has been above target
+// for a whole interval, refuse one request and schedule the next refusal
+// interval/sqrt(count) later for as long as it stays high.
+bool
+FastCGIServerBase::overloaded()
+{
+    if (overload.budget != 0 && statistics.bytes_buffered > overload.budget)
+        return true;
+    if (overload.max_requests >= 0 &&
+            statistics.requests_active >= static_cast<unsigned long>(overload.max_requests))
+        return true;
+    if (loop_busy > overload.max_busy)
+        return true;
+    if (overload.target == Clock::duration::zero())
+        return false;
+
+    if (loop_busy < overload.target) {
+        overload.first_above = Clock::time_point();
+        overload.dropping = false;
+        return false;
+    }
+
+    Clock::time_point now = Clock::now();
+    if (!overload.dropping) {
+        if (overload.first_above == Clock::time_point()) {
+            overload.first_above = now + overload.interval;
+            return false;
+        }
+        if (now < overload.first_above)
+            return false;
+        overload.dropping = true;
+        overload.drop_count = 1;
+        overload.drop_next = now + overload.interval;
+        return true;
+    }
+
+    if (now < overload.drop_next)
+        return false;
+    overload.drop_count++;
+    overload.drop_next += std::chrono::duration_cast<Clock::duration>(
+        overload.interval / std::sqrt(double(overload.drop_count)));
+    return true;
+}
+
+
+void
+FastCGIServerBase::memory_budget(std::string::size_type bytes)
+{
+    overload.budget = bytes;
+    statistics.bytes_buffered = 0;
+    for (auto &[sock, conn_ptr] : read_sockets) {
+        conn_ptr->counted = 0;
+        recount(*conn_ptr);
+    }
+}
+
+
+// Brings bytes_buffered up to date with a connection whose buffers may
+// have changed.  Only connections that had events are looked at again.
+void
+FastCGIServerBase::recount(Connection& connection)
+{
+    if (overload.budget == 0)
+        return;
+    std::string::size_type size = connection.buffered();
+    statistics.bytes_buffered = statistics.bytes_buffered - connection.counted + size;
+    connection.counted = size;
+}
+
+
+// While the buffered bytes exceed the budget, pauses reading from the
+// connections holding the most until the rest fits.
+void
+FastCGIServerBase::apply_budget()
+{
+    bool over = statistics.bytes_buffered > overload.budget;
+    std::vector<std::pair<std::string::size_type, Connection*>> usage;
+    for (auto &[sock, conn_ptr] : read_sockets) {
+        conn_ptr->paused = false;
+        if (over)
+            usage.emplace_back(conn_ptr->counted, conn_ptr.get());
+    }
+    if (!over)
+        return;
+
+    std::sort(usage.begin(), usage.end(), [](const auto& a, const auto& b) { return a.first > b.first; });
+    std::string::size_type excess = statistics.bytes_buffered - overload.budget;
+    for (auto &[size, connection] : usage) {
+        refuse_input(*connection);
+        recount(*connection);
+        if (!connection->close_socket)
+            connection->paused = true;
+        if (size >= excess)
+            break;
+        excess -= size;
+    }
+}
+
+
+// Ends the requests on a connection about to be paused that still wait for
+// input, which would never come: those whose response has not begun are
+// answered with 503 and the rest of their input dropped, and otherwise the
+// connection is closed.
+void
+FastCGIServerBase::refuse_input(Connection& connection)
+{
+    for (auto &[id, request] : connection.requests) {
+        if (!request->running() || (request->params_closed && request->in_closed && request->data_closed))
+            continue;
+        if (!replace_output(*request, "503 Service Unavailable")) {
+            connection.close_socket = true;
+            return;
+        }
+        std::string().swap(request->in);
+        std::string().swap(request->data);
+        if (!request->params_closed) {
+            request->params.clear();
+            std::string().swap(request->params_buffer);
+            std::string().swap(request->params_raw);
+            request->params_index.clear();
+        }
+        request->cache_key.clear();
+        request->params_closed = request->in_closed = request->data_closed = true;
+        connection.wake = true;
+    }
+}
+
+
+// Releases the capacity an empty buffer kept from its peak.
+void
+FastCGIServerBase::trim(std::string& buffer)
+{
+    if (buffer.empty() && buffer.capacity() > idle_capacity)
+        std::string().swap(buffer);
+}
+
+
+void
+FastCGIServerBase::output_quantum(std::string::size_type bytes)
+{
+    quantum = bytes;
+}
+
+
+void
+FastCGIServerBase::lazy_params(bool lazy)
+{
+    params_lazy = lazy;
+}
+
+
+void
+FastCGIServerBase::params_limit(std::string::size_type bytes)
+{
+    max_params = bytes;
+}
+
+
+void
+FastCGIServerBase::response_cache(const std::vector<std::string>& key_params, std::string::size_type memory_limit)
+{
+    cache.configure(key_params, memory_limit);
+}
+
+
+void
+FastCGIServerBase::authorizer_cache(const std::vector<std::string>& key_params, int ttl_seconds,
+                                    std::string::size_type memory_limit)
+{
+    decisions.configure(key_params, memory_limit);
+    decision_ttl = ttl_seconds;
+}
+
+
+void
+FastCGIServerBase::coalesce_requests(const std::vector<std::string>& key_params)
+{
+    coalesce_params = key_params;
+}
+
+
+void
+FastCGIServerBase::rate_limit(const std::string& key_param, double rate, double burst,
+                              std::size_t max_clients, bool refuse)
+{
+    limiter.configure(key_param, rate, burst, max_clients, refuse);
+}
+
+
+// Whether the response may depend on more than the params.
+bool
+FastCGIServerBase::has_body(const RequestInfo& request)
+{
+    if (request.role == FCGI_FILTER)
+        return true;
+    std::optional<std::string_view> length = request.param("CONTENT_LENGTH");
+    return length && !length->empty() && *length != "0";
+}
+
+
+// Answers the request with just an HTTP status, without calling handlers.
+void
+FastCGIServerBase::answer(RequestInfo& request, const char* status)
+{
+    write_status(request.out, status);
+    request.answered = true;
+}
+
+
+// Answers in place of the output the handlers have produced, unless some
+// of it has gone out already.  Returns whether it did.
+bool
+FastCGIServerBase::replace_output(RequestInfo& request, const char* status)
+{
+    if (request.bytes_out != 0)
+        return false;
+    request.out.clear();
+    request.out_ahead = 0;
+    request.err.clear();
+    request.framed.clear();
+    answer(request, status);
+    return true;
+}
+
+
+// Answers or refuses a request over the rate limit instead of dispatching
+// it.  Returns true if it did; a refused request is gone.
+bool
+FastCGIServerBase::rate_limited(Connection& connection, RequestInfo& request)
+{
+    if (!limiter.enabled())
+        return false;
+    std::optional<std::string_view> key = request.param(limiter.param);
+    if (!key || limiter.allow(*key, Clock::now()))
+        return false;
+
+    statistics.requests_limited++;
+    if (!limiter.refuse) {
+        answer(request, "429 Too Many Requests");
+        return true;
+    }
+
+    RequestID id = request.request_id;
+    write_end_request(connection.output_buffer, id, 0, FCGI_OVERLOADED);
+    if (connection.close_responsibility)
+        connection.close_socket = true;
+    forget_request(request);
+    connection.requests.erase(id);
+    statistics.requests_active--;
+    return true;
+}
+
+
+// Answers the request from the response or decision cache if possible.
+bool
+FastCGIServerBase::answer_from_cache(RequestInfo& request)
+{
+    if (request.role != FCGI_AUTHORIZER)
+        return answer_from(cache, request, statistics.cache_hits, statistics.cache_misses);
+
+    unsigned long misses = 0;
+    if (answer_from(decisions, request, statistics.authorizations_cached, misses))
+        return true;
+    statistics.authorizations++;
+    if (misses != 0)
+        request.cache_ttl = decision_ttl;
+    return false;
+}
+
+
+// Looks the request up in a cache.  On a miss the request's stdout is
+// captured, so that it can be stored when it ends.
+bool
+FastCGIServerBase::answer_from(ResponseCache& responses, RequestInfo& request,
+                               unsigned long& hits, unsigned long& misses)
+{
+    if (!responses.enabled() || has_body(request))
+        return false;
+
+    std::string key = responses.key(request);
+    const std::string* records = responses.find(key, Clock::now());
+    if (!records) {
+        misses++;
+        request.cache_key.swap(key);
+        request.capture = true;
+        return false;
+    }
+
+    hits++;
+    request.framed = *records;
+    set_request_id(request.framed, request.request_id);
+    request.answered = true;
+    return true;
+}
+
+
+// Adds a part to a key made of several, prefixed with its length so that
+// no two lists of parts make the same key.
+void
+FastCGIServerBase::append_key(std::string& key, std::string_view part)
+{
+    key.append(std::to_string(part.size())).append(1, ':').append(part);
+}
+
+
+// Parks the request behind an identical one already in flight, or else
+// makes it the one the others will wait for.  Returns true if parked.
+bool
+FastCGIServerBase::join_flight(Connection& connection, RequestInfo& request)
+{
+    if (coalesce_params.empty() || has_body(request))
+        return false;
+
+    std::string key;
+    for (const std::string& name : coalesce_params)
+        append_key(key, request.param(name).value_or(std::string_view()));
+
+    std::unordered_map<std::string, Flight>::iterator flight = flights.find(key);
+    if (flight != flights.end()) {
+        flight->second.followers.emplace_back(&connection, &request);
+        request.parked = true;
+        connection.parked++;
+    } else {
+        flights.emplace(key, Flight{&request, {}});
+        request.capture = true;
+    }
+    request.flight_key.swap(key);
+    return request.parked;
+}
+
+
+// Copies the response of a request that has ended to the requests parked
+// behind it.
+void
+FastCGIServerBase::land_flight(RequestInfo& request)
+{
+    std::unordered_map<std::string, Flight>::iterator flight = flights.find(request.flight_key);
+    request.flight_key.clear();
+    if (flight == flights.end())
+        return;
+
+    for (auto &[connection, follower] : flight->second.followers) {
+        follower->framed = request.captured;
+        set_request_id(follower->framed, follower->request_id);
+        follower->err = request.captured_err;
+        follower->status = request.status;
+        follower->answered = true;
+        follower->parked = false;
+        follower->flight_key.clear();
+        connection->parked--;
+        connection->wake = true;
+        statistics.requests_coalesced++;
+    }
+    flights.erase(flight);
+}
+
+
+// Called before a request is destroyed.  A parked request leaves its flight;
+// if the request was leading one, the first request parked behind it takes
+// its place, and is dispatched by run_promoted() once no connection is being
+// swept.  A leader may itself be parked, held for the batch or just
+// promoted, until it is dispatched.
+void
+FastCGIServerBase::forget_request(RequestInfo& request)
+{
+    bool held = false;                      // parked, but not as a follower
+    if (request.parked) {
+        for (auto it = batch.begin(); it != batch.end(); ++it)
+            if (it->second == &request) {
+                it->first->parked--;
+                batch.erase(it);
+                held = true;
+                break;
+            }
+        for (auto it = promoted.begin(); it != promoted.end(); ++it)
+            if (it->second == &request) {
+                it->first->parked--;
+                promoted.erase(it);
+                held = true;
+                break;
+            }
+    }
+
+    if (request.flight_key.empty())
+        return;
+    std::unordered_map<std::string, Flight>::iterator flight = flights.find(request.flight_key);
+    if (flight == flights.end())
+        return;
+    std::vector<std::pair<Connection*, RequestInfo*>>& followers = flight->second.followers;
+
+    if (request.parked && !held) {
+        for (auto it = followers.begin(); it != followers.end(); ++it)
+            if (it->second == &request) {
+                it->first->parked--;
+                followers.erase(it);
+                break;
+            }
+        return;
+    }
+
+    if (flight->second.leader != &request)
+        return;
+    if (followers.empty()) {
+        flights.erase(flight);
+        return;
+    }
+
+    // stays parked until dispatched
+    flight->second.leader = followers.front().second;
+    followers.front().second->capture = true;
+    promoted.push_back(followers.front());
+    followers.erase(followers.begin());
+}
+
+
+// Dispatches the requests that took the lead of a flight from one that was
+// forgotten.
+void
+FastCGIServerBase::run_promoted()
+{
+    std::vector<std::pair<Connection*, RequestInfo*>> leaders;
+    leaders.swap(promoted);
+    for (auto &[connection, leader] : leaders) {
+        leader->parked = false;
+        connection->parked--;
+        connection->wake = true;
+        dispatch(*leader);
+    }
+}
+
+
+// Parks a request whose params are complete until the input of this
+// iteration has been read, so that it is dispatched with the others that
+// became ready alongside it.
+void
+FastCGIServerBase::hold(Connection& connection, RequestInfo& request)
+{
+    request.parked = true;
+    connection.parked++;
+    batch.emplace_back(&connection, &request);
+}
+
+
+// Dispatches the held requests together and frames their output, so that
+// the next select() waits to write it.
+void
+FastCGIServerBase::run_batch()
+{
+    std::vector<std::pair<Connection*, RequestInfo*>> held;
+    held.swap(batch);
+
+    std::vector<RequestInfo*> requests;
+    std::vector<Connection*> connections;
+    requests.reserve(held.size());
+    connections.reserve(held.size());
+    for (auto &[connection, request] : held) {
+        request->parked = false;
+        connection->parked--;
+        requests.push_back(request);
+        connections.push_back(connection);
+    }
+    dispatch_batch(requests);
+
+    std::sort(connections.begin(), connections.end());
+    connections.erase(std::unique(connections.begin(), connections.end()), connections.end());
+    for (Connection* connection : connections) {
+        process_connection_write(*connection);
+        recount(*connection);
+    }
+}
+
+
+// Whether an authorizer's stdout records grant access: their headers have
+// no Status, or Status 200.
+static bool
+granted(const std::string& records)
+{
+    std::string out;
+    for (std::string::size_type n = 0; n + FCGI_HEADER_LEN <= records.size(); ) {
+        const FCGI_Header& header = *reinterpret_cast<const FCGI_Header*>(&records[n]);
+        std::string::size_type length = (static_cast<std::string::size_type>(header.contentLengthB1) << 8) +
+            header.contentLengthB0;
+        if (header.type == FCGI_STDOUT)
+            out.append(records, n + FCGI_HEADER_LEN, length);
+        n += FCGI_HEADER_LEN + length + header.paddingLength;
+    }
+
+    for (std::string_view rest(out); !rest.empty(); ) {
+        std::string_view line = rest.substr(0, rest.find('\n'));
+        rest.remove_prefix(std::min(line.size() + 1, rest.size()));
+        if (!line.empty() && line.back() == '\r')
+            line.remove_suffix(1);
+        if (line.empty())
+            break;
+        if (equal_nocase(line.substr(0, 7), "Status:")) {
+            line.remove_prefix(7);
+            line.remove_prefix(std::min(line.find_first_not_of(' '), line.size()));
+            return line.substr(0, 3) == "200" && (line.size() == 3 || line[3] == ' ');
+        }
+    }
+    return true;
+}
+
+
+// Sets the request id of each record in a buffer of framed records, from
+// the record at offset from on.
+void
+FastCGIServerBase::set_request_id(std::string& records, RequestID id, std::string::size_type from)
+{
+    for (std::string::size_type n = from; n < records.size(); ) {
+        FCGI_Header& header = *reinterpret_cast<FCGI_Header*>(&records[n]);
+        header.requestIdB1 = (id >> 8) & 0xff;
+        header.requestIdB0 = id & 0xff;
+        n += FCGI_HEADER_LEN + (static_cast<unsigned>(header.contentLengthB1) << 8) +
+            header.contentLengthB0 + header.paddingLength;
+    }
+}
+
+
+// Queues framed records, with any request id, as output of the request.
+void
+FastCGIServerBase::append_records(RequestInfo& request, std::string_view records)
+{
+    std::string::size_type from = request.framed.size();
+    request.framed.append(records.data(), records.size());
+    set_request_id(request.framed, request.request_id, from);
+}
+
+
+FastCGIServerBase::ResponseCache::ResponseCache() :
+    limit(0),
+    used(0)
+{
+}
+
+
+void
+FastCGIServerBase::ResponseCache::configure(const std::vector<std::string>& key_params,
+                                            std::string::size_type memory_limit)
+{
+    params.clear();
+    for (const std::string& spec : key_params) {
+        std::string::size_type colon = spec.find(':');
+        if (colon == std::string::npos) {
+            params.emplace_back(spec, std::string::npos);
+            continue;
+        }
+        std::string::size_type prefix = 0;
+        const char* first = spec.data() + colon + 1;
+        const char* last = spec.data() + spec.size();
+        std::from_chars_result result = std::from_chars(first, last, prefix);
+        if (first == last || result.ec != std::errc() || result.ptr != last)
+            throw std::invalid_argument("cache key param \"" + spec + "\" is not NAME or NAME:N");
+        params.emplace_back(spec.substr(0, colon), prefix);
+    }
+    limit = memory_limit;
+    while (!entries.empty())
+        erase(std::prev(entries.end()));
+}
+
+
+// Joins the key params; a missing param counts as empty.
+std::string
+FastCGIServerBase::ResponseCache::key(const FastCGIRequest& request) const
+{
+    std::string key;
+    for (auto &[name, prefix] : params)
+        append_key(key, request.param(name).value_or(std::string_view()).substr(0, prefix));
+    return key;
+}
+
+
+const std::string*
+FastCGIServerBase::ResponseCache::find(const std::string& key, Clock::time_point now)
+{
+    std::unordered_map<std::string, Entries::iterator>::iterator it = index.find(key);
+    if (it == index.end())
+        return nullptr;
+
+    Entries::iterator entry = it->second;
+    if (entry->expires <= now) {
+        erase(entry);
+        return nullptr;
+    }
+    entries.splice(entries.begin(), entries, entry);
+    return &entry->records;
+}
+
+
+void
+FastCGIServerBase::ResponseCache::store(const std::string& key, const std::string& records,
+                                        Clock::time_point expires)
+{
+    std::unordered_map<std::string, Entries::iterator>::iterator it = index.find(key);
+    if (it != index.end())
+        erase(it->second);
+
+    std::string::size_type size = 2 * key.size() + records.size() + sizeof(Entry);
+    if (size > limit)
+        return;
+    while (used + size > limit)
+        erase(std::prev(entries.end()));
+
+    entries.push_front(Entry{key, records, expires});
+    index.emplace(key, entries.begin());
+    used += size;
+}
+
+
+void
+FastCGIServerBase::ResponseCache::erase(Entries::iterator entry)
+{
+    used -= 2 * entry->key.size() + entry->records.size() + sizeof(Entry);
+    index.erase(entry->key);
+    entries.erase(entry);
+}
+
+
+FastCGIServerBase::RateLimiter::RateLimiter() :
+    refuse(false),
+    interval(Clock::duration::zero()),
+    tolerance(Clock::duration::zero())
+{
+}
+
+
+void
+FastCGIServerBase::RateLimiter::configure(const std::string& key_param, double rate, double burst,
+                                          std::size_t max_clients, bool p_refuse)
+{
+    if (!key_param.empty() && !(rate > 0))
+        throw std::invalid_argument("rate limit is not positive");
+    // keeps the durations, and the times they are added to, in range
+    if (!key_param.empty() && !(std::max(burst, 1.0) / rate <= 365 * 24 * 3600.0))
+        throw std::invalid_argument("rate limit is too low for its burst");
+
+    param = key_param;
+    refuse = p_refuse;
+    std::size_t size = rate_probes;
+    while (size < max_clients)
+        size *= 2;
+    buckets.assign(param.empty() ? 0 : size, Bucket{0, Clock::time_point()});
+    keys.assign(buckets.size(), std::string());
+    if (param.empty())
+        return;
+    interval = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(1 / rate));
+    tolerance = std::chrono::duration_cast<Clock::duration>(
+        std::chrono::duration<double>((std::max(burst, 1.0) - 1) / rate));
+}
+
+
+// Takes a token from the key's bucket if it has one.  A key not in the
+// table replaces the least recently used bucket of its probe window, which
+// is usually an unused or idle one.
+bool
+FastCGIServerBase::RateLimiter::allow(std::string_view key, Clock::time_point now)
+{
+    std::size_t hash = std::hash<std::string_view>()(key);
+    if (hash == 0)
+        hash = 1;
+
+    std::size_t mask = buckets.size() - 1;
+    std::size_t found = buckets.size();
+    std::size_t oldest = 0;
+    for (std::size_t i = 0; i < rate_probes; i++) {
+        std::size_t n = (hash + i) & mask;
+        if (buckets[n].hash == hash && keys[n] == key) {
+            found = n;
+            break;
+        }
+        if (i == 0 || buckets[n].full < buckets[oldest].full)
+            oldest = n;
+    }
+    if (found == buckets.size()) {
+        found = oldest;
+        buckets[found].hash = hash;
+        buckets[found].full = now;
+        keys[found].assign(key);
+    }
+    Bucket* bucket = &buckets[found];
+
+    Clock::time_point full = std::max(bucket->full, now);
+    if (full - now > tolerance)
+        return false;
+    bucket->full = full + interval;
+    return true;
+}
+
+
+static struct sockaddr_un
+local_address(const std::string& local_path, socklen_t& socklen)
+{
+    struct sockaddr_un sa;
+    bzero(&sa, sizeof(sa));
+    sa.sun_family = AF_LOCAL;
+
+    std::string::size_type size = local_path.size();
+    if (size >= sizeof(sa.sun_path))
+        throw std::runtime_error("path too long");
+    if (local_path.find_first_of('\0') != std::string::npos)
+        throw std::runtime_error("null character in path");
+
+    std::memcpy(sa.sun_path, local_path.data(), size);
+    socklen = static_cast<socklen_t>(sizeof(sa) - (sizeof(sa.sun_path) - size - 1));
+    return sa;
+}
+
+
+void
+FastCGIServerBase::listen(unsigned tcp_port)
+{
+    FileID<int> listen_socket = socket(PF_INET, SOCK_STREAM, 0);
+    if (listen_socket == -1)
+        throw errno_error("socket() failed");
+
+    struct sockaddr_in sa;
+    bzero(&sa, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(uint16_t(tcp_port));
+    sa.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(listen_socket, (struct sockaddr*)&sa, sizeof(sa)) == -1)
+        throw errno_error("bind() failed");
+
+    if (::listen(listen_socket, 100))
+        throw errno_error("listen() failed");
+
+    listen_sockets.push_back(std::move(listen_socket));
+}
+
+
+void
+FastCGIServerBase::listen(const std::string& local_path)
+{
+    FileID<int> listen_socket = socket(PF_UNIX, SOCK_STREAM, 0);
+    if (listen_socket == -1)
+        throw errno_error("socket() failed");
+
+    socklen_t socklen;
+    struct sockaddr_un sa = local_address(local_path, socklen);
+
+    unlink(local_path.c_str());
+    listen_unlink.push_back(local_path);
+
+    if (bind(listen_socket, (struct sockaddr*)&sa, socklen) == -1)
+        throw errno_error("bind() failed");
+
+    if (::listen(listen_socket, 100))
+        throw errno_error("listen() failed");
+
+    listen_sockets.push_back(std::move(listen_socket));
+}
+
+
+void
+FastCGIServerBase::abandon_files()
+{
+    for (auto &file : listen_unlink)
+        file.release();
+    listen_unlink.clear();
+}
+
+
+// Whether the descriptor is a stream socket that is listening.
+static bool
+listening_stream(int fd)
+{
+    int type = 0;
+    socklen_t size = sizeof(type);
+    if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &size) == -1 || type != SOCK_STREAM)
+        return false;
+#ifdef SO_ACCEPTCONN
+    int accepting = 0;
+    size = sizeof(accepting);
+    if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &accepting, &size) == -1 || !accepting)
+        return false;
+#endif
+    return true;
+}
+
+
+static void
+set_cloexec(int fd)
+{
+    if (fcntl(fd, F_SETFD, FD_CLOEXEC) == -1)
+        throw errno_error("fcntl() failed");
+}
+
+
+void
+FastCGIServerBase::adopt(int listen_fd)
+{
+    if (!listening_stream(listen_fd))
+        throw std::runtime_error("adopted descriptor is not a listening stream socket");
+    listen_sockets.push_back(listen_fd);
+}
+
+
+unsigned
+FastCGIServerBase::listen_inherited()
+{
+    const char* pid = getenv("LISTEN_PID");
+    const char* fds = getenv("LISTEN_FDS");
+    if (!pid || !fds || std::strtol(pid, NULL, 10) != getpid())
+        return 0;
+
+    unsigned passed = static_cast<unsigned>(std::strtoul(fds, NULL, 10));
+    unsigned count = 0;
+    for (unsigned i = 0; i < passed; i++) {
+        int fd = 3 + static_cast<int>(i);      // SD_LISTEN_FDS_START
+        if (!listening_stream(fd))
+            continue;
+        set_cloexec(fd);
+        adopt(fd);
+        count++;
+    }
+
+    // not for our children
+    unsetenv("LISTEN_PID");
+    unsetenv("LISTEN_FDS");
+    unsetenv("LISTEN_FDNAMES");
+    return count;
+}
+
+
+void
+FastCGIServerBase::offer_handoff(const std::string& local_path)
+{
+    FileID<int> sock = socket(PF_UNIX, SOCK_STREAM, 0);
+    if (sock == -1)
+        throw errno_error("socket() failed");
+
+    socklen_t socklen;
+    struct sockaddr_un sa = local_address(local_path, socklen);
+    unlink(local_path.c_str());
+    if (bind(sock, (struct sockaddr*)&sa, socklen) == -1)
+        throw errno_error("bind() failed");
+    if (::listen(sock, 1))
+        throw errno_error("listen() failed");
+    // a successor that gives up between select() and accept() blocks nothing
+    if (fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK) == -1)
+        throw errno_error("fcntl() failed");
+
+    if (handoff_socket.is_valid())
+        unlink(handoff_path.c_str());
+    handoff_socket = std::move(sock);
+    handoff_path = local_path;
+}
+
+
+// Sends the listening sockets to the successor that connected to the
+// handoff socket, along with the paths to unlink when it is done with them,
+// and starts draining.  The message is the length of the paths as 4 bytes
+// in network order and then the paths, each ended by a null character; the
+// sockets come with its first byte.
+void
+FastCGIServerBase::hand_off()
+{
+    FileID<int> successor = accept(handoff_socket, NULL, NULL);
+    if (successor == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNABORTED)
+            return;
+        throw errno_error("accept() failed");
+    }
+    // the successor may offer a handoff at the same path next
+    unlink(handoff_path.c_str());
+    handoff_socket = FileID<int>();
+
+    std::string message(4, '\0');
+    for (auto &file : listen_unlink)
+        message.append(file.get()).push_back('\0');
+    uint32_t length = htonl(static_cast<uint32_t>(message.size() - 4));
+    std::memcpy(&message[0], &length, 4);
+
+    std::vector<int> fds;
+    for (auto &sock : listen_sockets)
+        fds.push_back(sock);
+
+    struct iovec iov = { &message[0], message.size() };
+    struct msghdr msg;
+    bzero(&msg, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    std::vector<char> control(CMSG_SPACE(sizeof(int) * fds.size()));
+    if (!fds.empty()) {
+        msg.msg_control = control.data();
+        msg.msg_controllen = control.size();
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+        std::memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * fds.size());
+    }
+    ssize_t sent;
+    while ((sent = sendmsg(successor, &msg, 0)) == -1 && errno == EINTR) {}
+    if (sent == -1)
+        throw errno_error("sendmsg() failed");
+    for (std::string::size_type n = static_cast<std::string::size_type>(sent); n < message.size(); ) {
+        ssize_t result = write(successor, message.data() + n, message.size() - n);
+        if (result == -1 && errno == EINTR)
+            continue;
+        if (result == -1)
+            throw errno_error("write() failed");
+        n += static_cast<std::string::size_type>(result);
+    }
+
+    abandon_files();
+    listen_sockets.clear();
+    handed_off = true;
+}
+
+
+unsigned
+FastCGIServerBase::take_over(const std::string& local_path)
+{
+    FileID<int> sock = socket(PF_UNIX, SOCK_STREAM, 0);
+    if (sock == -1)
+        throw errno_error("socket() failed");
+
+    socklen_t socklen;
+    struct sockaddr_un sa = local_address(local_path, socklen);
+    if (connect(sock, (struct sockaddr*)&sa, socklen) == -1)
+        throw errno_error("connect() failed");
+
+    // the length of the paths, with the sockets
+    static const unsigned max_fds = 64;
+    uint32_t length;
+    struct iovec iov = { &length, sizeof(length) };
+    struct msghdr msg;
+    bzero(&msg, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    std::vector<char> control(CMSG_SPACE(sizeof(int) * max_fds));
+    msg.msg_control = control.data();
+    msg.msg_controllen = control.size();
+
+    ssize_t received;
+    while ((received = recvmsg(sock, &msg, MSG_WAITALL)) == -1 && errno == EINTR) {}
+    if (received == -1)
+        throw errno_error("recvmsg() failed");
+
+    std::vector<FileID<int>> fds;
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            std::size_t n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            for (std::size_t i = 0; i < n; i++) {
+                int fd;
+                std::memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+                fds.push_back(fd);
+            }
+        }
+    if (received != sizeof(length) || (msg.msg_flags & MSG_CTRUNC))
+        throw std::runtime_error("handoff message cut short");
+
+    std::string::size_type size = ntohl(length);
+    if (size > max_fds * sizeof(sa.sun_path))
+        throw std::runtime_error("handoff message too long");
+    std::string paths(size, '\0');
+    for (std::string::size_type n = 0; n < paths.size(); ) {
+        ssize_t result = read(sock, &paths[n], paths.size() - n);
+        if (result == -1 && errno == EINTR)
+            continue;
+        if (result <= 0)
+            throw std::runtime_error("handoff message cut short");
+        n += static_cast<std::string::size_type>(result);
+    }
+
+    for (FileID<int>& fd : fds) {
+        set_cloexec(fd);
+        adopt(fd);
+        fd.release();
+    }
+
+    // the socket files are ours to unlink now
+    for (std::string::size_type n = 0; n < paths.size(); ) {
+        std::string::size_type end = paths.find('\0', n);
+        if (end == std::string::npos)
+            end = paths.size();
+        listen_unlink.push_back(paths.substr(n, end - n));
+        n = end + 1;
+    }
+    return static_cast<unsigned>(fds.size());
+}
+
+
+void
+FastCGIServerBase::process(int timeout_ms)
+{
+    char buffer[4096];
+    fd_set fs_read;
+    fd_set fs_write;
+    int nfd = 0;
+    struct timeval tv = { timeout_ms / 1000, (timeout_ms % 1000) * 1000 };
+    struct timeval* wait = timeout_ms < 0 ? NULL : &tv;
+
+    FD_ZERO(&fs_read);
+    FD_ZERO(&fs_write);
+
+    for (auto &[sock, conn_ptr] : read_sockets)
+        if (conn_ptr->wake) {
+            conn_ptr->wake = false;
+            process_connection_write(*conn_ptr);
+            recount(*conn_ptr);
+        }
+    if (overload.budget != 0)
+        apply_budget();
+
+    for (auto &sock : listen_sockets) {
+        FD_SET(sock, &fs_read);
+        nfd = std::max(nfd, sock.get());
+    }
+    if (handoff_socket.is_valid()) {
+        FD_SET(handoff_socket, &fs_read);
+        nfd = std::max(nfd, handoff_socket.get());
+    }
+    if (group) {
+        FD_SET(wake_read, &fs_read);
+        nfd = std::max(nfd, wake_read.get());
+    }
+
+    for (auto &[sock, conn_ptr] : read_sockets) {
+        if (!conn_ptr->close_socket && !conn_ptr->paused)
+            FD_SET(sock, &fs_read);
+        if (!conn_ptr->output_buffer.empty())
+            FD_SET(sock, &fs_write);
+        nfd = std::max(nfd, sock.get());
+    }
+    nfd = std::max(nfd, add_descriptors(fs_read, fs_write));
+
+    // a stale scoreboard slot is brought up to date within a tick
+    if (board_slot && board_stale) {
+        long long left = std::chrono::duration_cast<std::chrono::microseconds>(
+            board_updated + board_tick - Clock::now()).count();
+        left = std::max(left, 0LL);
+        if (!wait || left < tv.tv_sec * 1000000LL + tv.tv_usec) {
+            tv.tv_sec = static_cast<time_t>(left / 1000000);
+            tv.tv_usec = static_cast<suseconds_t>(left % 1000000);
+            wait = &tv;
+        }
+    }
+
+    int select_result = select(nfd + 1, &fs_read, &fs_write, NULL, wait);
+    if (select_result == -1) {
+        if (errno == EINTR) {
+            update_worker();
+            return;
+        } else
+            throw errno_error("select() failed");
+    }
+
+    Clock::time_point busy_start = Clock::now();
+    if (worker)
+        worker->busy.store(true, std::memory_order_relaxed);
+
+    for (auto &sock : listen_sockets) {
+        if (FD_ISSET(sock, &fs_read)) {
+            FileID read_socket = accept(sock, NULL, NULL);
+            if (read_socket == -1) {
+                // another prefork worker took the connection
+                if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNABORTED)
+                    continue;
+                throw errno_error("accept() failed");
+            }
+            ConnectionPtr connection( new Connection );
+            read_sockets.try_emplace(std::move(read_socket), std::move(connection));
+        }
+    }
+
+    if (handoff_socket.is_valid() && FD_ISSET(handoff_socket, &fs_read))
+        hand_off();
+    if (group && FD_ISSET(wake_read, &fs_read))
+        receive_connections();
+    process_descriptors(fs_read, fs_write);
+
+    for (auto it = read_sockets.begin(); it != read_sockets.end(); ) {
+        int read_socket = it->first;
+
+        if (FD_ISSET(read_socket, &fs_read)) {
+            ssize_t read_result = read(read_socket, buffer, sizeof(buffer));
+            if (read_result < 0) {
+                if (errno != ECONNRESET)
+                    throw errno_error("read() on socket failed");
+                it->second->close_socket = true;
+                it->second->reset = true;
+                if (capture_file.is_valid())
+                    capture_input(*it->second, buffer, 0);
+            } else {
+                if (capture_file.is_valid())
+                    capture_input(*it->second, buffer, static_cast<size_t>(read_result));
+                if (read_result == 0) {
+                    it->second->close_socket = true;
+                } else {
+                    it->second->input_buffer.append(buffer, static_cast<size_t>(read_result));
+                    if (board_slot) {
+                        add(board_slot->bytes_in, static_cast<unsigned long long>(read_result));
+                        set_state(FastCGIScoreboard::reading_request);
+                    }
+                    process_connection_read(*it->second);
+                }
+            }
+        }
+
+        // nothing more reaches a peer that has reset the connection
+        if (it->second->reset)
+            it->second->output_buffer.clear();
+
+        if (!it->second->output_buffer.empty() && FD_ISSET(read_socket, &fs_write)) {
+            set_state(FastCGIScoreboard::writing);
+            ssize_t write_result = write(read_socket, it->second->output_buffer.data(),
+                                         it->second->output_buffer.size());
+            if (write_result == -1)
+                throw errno_error("write() failed");
+            if (board_slot)
+                add(board_slot->bytes_out, static_cast<unsigned long long>(write_result));
+            it->second->output_buffer.erase(0, static_cast<size_t>(write_result));
+            process_connection_write(*it->second);
+            trim(it->second->output_buffer);
+        }
+        if (FD_ISSET(read_socket, &fs_read) || FD_ISSET(read_socket, &fs_write))
+            recount(*it->second);
+
+        // once handed off or stopped, idle connections are closed so that
+        // the web server reconnects to the successor or another worker
+        if (handed_off && it->second->requests.empty())
+            it->second->close_socket = true;
+
+        if (it->second->close_socket && it->second->output_buffer.empty() && it->second->parked == 0) {
+            int close_result = close(it->first.release());
+            if (close_result == -1 && errno != ECONNRESET)
+                throw errno_error("close() failed");
+            for (auto &request : it->second->requests)
+                forget_request(*request.second);
+            statistics.requests_active -= it->second->requests.size();
+            statistics.bytes_buffered -= it->second->counted;
+            it = read_sockets.erase(it);
+        } else
+            ++it;
+    }
+    if (!promoted.empty())
+        run_promoted();
+    if (!batch.empty())
+        run_batch();
+
+    loop_busy = Clock::now() - busy_start;
+    statistics.loop_busy_us = static_cast<long>(
+        std::chrono::duration_cast<std::chrono::microseconds>(loop_busy).count());
+    if (board_slot) {
+        // an iteration that found nothing to do changed nothing
+        if (select_result > 0)
+            board_stale = true;
+        Clock::time_point now = Clock::now();
+        if (board_stale && now - board_updated >= board_tick) {
+            update_board();
+            board_stale = false;
+            board_updated = now;
+        }
+    }
+    if (group)
+        balance();
+    update_worker();
+}
+
+
+void
+FastCGIServerBase::join_group(FastCGILoopGroup& loop_group)
+{
+    int fds[2];
+    if (pipe(fds) == -1)
+        throw errno_error("pipe() failed");
+    wake_read = fds[0];
+    wake_write = fds[1];
+    for (int fd : fds)
+        if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == -1)
+            throw errno_error("fcntl() failed");
+
+    group = &loop_group;
+    group_index = static_cast<unsigned>(group->loops.size());
+    group->loops.push_back(this);
+}
+
+
+// Runs between requests: hands an idle connection to a loop that asked for
+// one, and asks the busiest loop for one when this loop has nothing to do.
+void
+FastCGIServerBase::balance()
+{
+    std::size_t load = read_sockets.size();
+    if (load > group_load.exchange(load, std::memory_order_relaxed)) {
+        // let the least loaded loop know, in case it is waiting in select()
+        FastCGIServerBase* idlest = nullptr;
+        std::size_t least = load - 1;
+        for (FastCGIServerBase* loop : group->loops) {
+            std::size_t other = loop->group_load.load(std::memory_order_relaxed);
+            if (loop != this && other < least) {
+                idlest = loop;
+                least = other;
+            }
+        }
+        if (idlest)
+            idlest->wake_loop();
+    }
+
+    // a request stays pending until there is an idle connection to give
+    unsigned thief = steal_request.load(std::memory_order_acquire);
+    if (thief != 0) {
+        for (auto it = read_sockets.begin(); it != read_sockets.end(); ++it) {
+            Connection& connection = *it->second;
+            if (!connection.requests.empty() || !connection.input_buffer.empty() ||
+                    !connection.output_buffer.empty() || connection.close_socket || connection.parked != 0)
+                continue;
+
+            // unless withdrawn by a loop that has become busy meanwhile
+            if (!steal_request.compare_exchange_strong(thief, 0, std::memory_order_acquire))
+                break;
+            statistics.bytes_buffered -= connection.counted;
+            connection.counted = 0;
+            FastCGIServerBase& loop = *group->loops[thief - 1];
+            Handoff* handoff = new Handoff{read_sockets.extract(it), nullptr};
+            handoff->next = loop.incoming.load(std::memory_order_relaxed);
+            while (!loop.incoming.compare_exchange_weak(handoff->next, handoff,
+                                                        std::memory_order_release, std::memory_order_relaxed)) {}
+            loop.wake_loop();
+            group_load.store(--load, std::memory_order_relaxed);
+            break;
+        }
+    }
+
+    if (statistics.requests_active != 0) {
+        // a connection given now would only add to the work here
+        if (asked) {
+            unsigned mine = group_index + 1;
+            asked->steal_request.compare_exchange_strong(mine, 0, std::memory_order_relaxed);
+            asked = nullptr;
+        }
+        return;
+    }
+    FastCGIServerBase* busiest = nullptr;
+    std::size_t most = load + 1;            // worth moving only if it evens out
+    for (FastCGIServerBase* loop : group->loops) {
+        std::size_t other = loop->group_load.load(std::memory_order_relaxed);
+        if (loop != this && other > most) {
+            busiest = loop;
+            most = other;
+        }
+    }
+    unsigned expected = 0;
+    if (busiest && busiest->steal_request.compare_exchange_strong(expected, group_index + 1,
+                                                                  std::memory_order_release)) {
+        asked = busiest;
+        busiest->wake_loop();
+    }
+}
+
+
+// Takes the connections that other loops have handed to this one.
+void
+FastCGIServerBase::receive_connections()
+{
+    char buffer[64];
+    while (read(wake_read, buffer, sizeof(buffer)) > 0) {}
+
+    for (Handoff* handoff = incoming.exchange(nullptr, std::memory_order_acquire); handoff; ) {
+        Handoff* next = handoff->next;
+        recount(*handoff->node.mapped());
+        read_sockets.insert(std::move(handoff->node));
+        delete handoff;
+        handoff = next;
+    }
+}
+
+
+void
+FastCGIServerBase::wake_loop()
+{
+    char byte = 0;
+    // a full pipe means a wakeup is pending already
+    if (write(wake_write, &byte, 1) == -1 && errno != EAGAIN)
+        throw errno_error("write() failed");
+}
+
+
+void
+FastCGIServerBase::access_log(FastCGIAccessLog& access)
+{
+    if (access.owner != getpid())
+        throw std::logic_error("access log made before fork()");
+    log = &access;
+    log_ring = &access.add_ring();
+}
+
+
+// the power of two at least bytes, as a ring buffer's size
+static std::size_t
+ring_size(std::size_t bytes)
+{
+    std::size_t size = 1;
+    while (size < bytes)
+        size <<= 1;
+    return size;
+}
+
+
+void
+FastCGIServerBase::capture(const std::string& path, std::size_t ring_bytes)
+{
+    capture_writer.reset();
+    capture_file = open(path.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_TRUNC, 0644);
+    if (capture_file == -1)
+        throw errno_error("open() failed");
+    capture_start = Clock::now();
+    capture_ring_bytes = ring_bytes;
+
+    if (!capture_ids) {
+        void* shared = mmap(NULL, sizeof(*capture_ids), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (shared == MAP_FAILED)
+            throw errno_error("mmap() failed");
+        capture_ids = new (shared) std::atomic<unsigned>(0);
+    } else
+        capture_ids->store(0, std::memory_order_relaxed);
+
+    // written now, so that prefork workers sharing the file do not each
+    // write one
+    FastCGICapture header;
+    bzero(&header, sizeof(header));
+    std::memcpy(header.magic, "FCGICCCP", 8);
+    header.version = 1;
+    if (write(capture_file, &header, sizeof(header)) != static_cast<ssize_t>(sizeof(header)))
+        throw errno_error("write() failed");
+}
+
+
+void
+FastCGIServerBase::capture_input(Connection& connection, const char* data, std::string::size_type size)
+{
+    if (connection.capture_id == capture_gap)
+        return;
+    if (!capture_writer)
+        capture_writer.reset(new CaptureWriter(capture_file, capture_ring_bytes));
+    if (connection.capture_id == 0)
+        connection.capture_id = capture_ids->fetch_add(1, std::memory_order_relaxed) + 1;
+
+    FastCGICapture::Chunk chunk;
+    chunk.time_us = static_cast<unsigned long long>(
+        std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - capture_start).count());
+    chunk.connection = connection.capture_id;
+    chunk.length = static_cast<unsigned>(size);
+    capture_chunk.assign(reinterpret_cast<const char*>(&chunk), sizeof(chunk));
+    capture_chunk.append(data, size);
+    if (!capture_writer->ring.push(capture_chunk)) {
+        // the rest of the connection's input would not replay without it
+        connection.capture_id = capture_gap;
+        statistics.capture_dropped++;
+    }
+}
+
+
+FastCGIServerBase::CaptureWriter::CaptureWriter(int p_file, std::size_t ring_bytes) :
+    file(p_file),
+    ring(ring_size(ring_bytes)),
+    stop(false),
+    thread(&CaptureWriter::run, this)
+{
+}
+
+
+FastCGIServerBase::CaptureWriter::~CaptureWriter()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+    }
+    wakeup.notify_one();
+    thread.join();
+}
+
+
+// Every 50ms, or when stopping, writes out what the ring holds.
+void
+FastCGIServerBase::CaptureWriter::run()
+{
+    std::string batch;
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+        bool last = stop;
+        lock.unlock();
+        ring.drain(batch);
+        for (std::string::size_type n = 0; n < batch.size(); ) {
+            ssize_t result = write(file, batch.data() + n, batch.size() - n);
+            if (result == -1) {
+                if (errno == EINTR)
+                    continue;
+                break;                      // nowhere to report it
+            }
+            n += static_cast<std::string::size_type>(result);
+        }
+        batch.clear();
+        lock.lock();
+
+        if (last)
+            return;
+        wakeup.wait_for(lock, std::chrono::milliseconds(50), [this] { return stop; });
+    }
+}
+
+
+void
+FastCGIServerBase::log_request(const RequestInfo& request)
+{
+    std::string line;
+    for (const FastCGIAccessLog::Field& field : log->fields)
+        switch (field.kind) {
+        case FastCGIAccessLog::Field::text:
+            line.append(field.value);
+            break;
+        case FastCGIAccessLog::Field::time:
+            {
+                char buffer[32];
+                time_t now = time(NULL);
+                struct tm local;
+                localtime_r(&now, &local);
+                line.append(buffer, strftime(buffer, sizeof(buffer), "%Y-%m-%dT%H:%M:%S%z", &local));
+                break;
+            }
+        case FastCGIAccessLog::Field::status:
+            line.append(std::to_string(request.status));
+            break;
+        case FastCGIAccessLog::Field::bytes_in:
+            line.append(std::to_string(request.bytes_in));
+            break;
+        case FastCGIAccessLog::Field::bytes_out:
+            line.append(std::to_string(request.bytes_out));
+            break;
+        case FastCGIAccessLog::Field::duration:
+            line.append(std::to_string(
+                std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - request.begun).count()));
+            break;
+        case FastCGIAccessLog::Field::param:
+            {
+                std::optional<std::string_view> value = request.param(field.value);
+                line.append(value ? *value : std::string_view("-"));
+                break;
+            }
+        }
+    line.push_back('\n');
+    log_ring->push(line);
+}
+
+
+FastCGIAccessLog::FastCGIAccessLog(const std::string& path, const std::string& format,
+                                   std::size_t bytes) :
+    file(open(path.c_str(), O_WRONLY | O_APPEND | O_CREAT, 0644)),
+    owner(getpid()),
+    ring_bytes(ring_size(bytes)),
+    stop(false)
+{
+    if (file == -1)
+        throw errno_error("open() failed");
+
+    static const struct { const char* name; Field::Kind kind; } builtins[] = {
+        { "time", Field::time }, { "status", Field::status }, { "bytes_in", Field::bytes_in },
+        { "bytes_out", Field::bytes_out }, { "duration_us", Field::duration } };
+
+    std::string::size_type n = 0;
+    while (n < format.size()) {
+        std::string::size_type dollar = format.find('$', n);
+        std::string::size_type end = dollar == std::string::npos ? dollar :
+            format.find_first_not_of("ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789_",
+                                     dollar + 1);
+        if (end == std::string::npos)
+            end = format.size();
+        if (dollar != n || end == dollar + 1) {
+            std::string::size_type text_end = dollar == n ? end : std::min(dollar, format.size());
+            fields.push_back(Field{Field::text, format.substr(n, text_end - n)});
+            n = text_end;
+            continue;
+        }
+
+        std::string name = format.substr(dollar + 1, end - dollar - 1);
+        Field field{Field::param, name};
+        for (auto &builtin : builtins)
+            if (name == builtin.name)
+                field.kind = builtin.kind;
+        fields.push_back(field);
+        n = end;
+    }
+
+    writer = std::thread(&FastCGIAccessLog::run, this);
+}
+
+
+FastCGIAccessLog::~FastCGIAccessLog()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+    }
+    wakeup.notify_one();
+    writer.join();
+    close(file);
+}
+
+
+unsigned long
+FastCGIAccessLog::dropped() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    unsigned long count = 0;
+    for (const Ring& ring : rings)
+        count += ring.dropped.load(std::memory_order_relaxed);
+    return count;
+}
+
+
+FastCGIAccessLog::Ring&
+FastCGIAccessLog::add_ring()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    rings.emplace_back(ring_bytes);
+    return rings.back();
+}
+
+
+// Every 50ms, or when stopping, writes out what the rings hold.
+void
+FastCGIAccessLog::run()
+{
+    std::string batch;
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+        bool last = stop;
+        for (Ring& ring : rings)
+            ring.drain(batch);
+
+        lock.unlock();
+        for (std::string::size_type n = 0; n < batch.size(); ) {
+            ssize_t result = write(file, batch.data() + n, batch.size() - n);
+            if (result == -1) {
+                if (errno == EINTR)
+                    continue;
+                break;                      // nowhere to report it
+            }
+            n += static_cast<std::string::size_type>(result);
+        }
+        batch.clear();
+        lock.lock();
+
+        if (last)
+            return;
+        wakeup.wait_for(lock, std::chrono::milliseconds(50), [this] { return stop; });
+    }
+}
+
+
+FastCGIAccessLog::Ring::Ring(std::size_t bytes) :
+    buffer(bytes),
+    mask(bytes - 1),
+    head(0),
+    tail(0),
+    dropped(0)
+{
+}
+
+
+bool
+FastCGIAccessLog::Ring::push(const std::string& line)
+{
+    std::size_t h = head.load(std::memory_order_relaxed);
+    std::size_t t = tail.load(std::memory_order_acquire);
+    if (line.size() > buffer.size() - (h - t)) {
+        dropped.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    std::size_t start = h & mask;
+    std::size_t first = std::min(line.size(), buffer.size() - start);
+    std::memcpy(&buffer[start], line.data(), first);
+    std::memcpy(&buffer[0], line.data() + first, line.size() - first);
+    head.store(h + line.size(), std::memory_order_release);
+    return true;
+}
+
+
+void
+FastCGIAccessLog::Ring::drain(std::string& out)
+{
+    std::size_t t = tail.load(std::memory_order_relaxed);
+    std::size_t h = head.load(std::memory_order_acquire);
+    std::size_t size = h - t;
+    std::size_t start = t & mask;
+    std::size_t first = std::min(size, buffer.size() - start);
+    out.append(&buffer[start], first);
+    out.append(&buffer[0], size - first);
+    tail.store(h, std::memory_order_release);
+}
+
+
+void
+FastCGIServerBase::process_forever()
+{
+    while (!drained())
+        process();
+}
+
+
+bool
+FastCGIServerBase::prefork(unsigned min_workers, unsigned max_workers)
+{
+    if (min_workers == 0 || max_workers < min_workers)
+        throw std::runtime_error("invalid number of workers");
+    if (log)
+        throw std::logic_error("access log set before prefork()");
+    if (capture_writer)
+        throw std::logic_error("input captured before prefork()");
+
+    // workers race to accept from the same listeners
+    for (auto &sock : listen_sockets)
+        if (fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK) == -1)
+            throw errno_error("fcntl() failed");
+
+    void* shared = mmap(NULL, max_workers * sizeof(WorkerSlot), PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED)
+        throw errno_error("mmap() failed");
+    WorkerSlot* slots = static_cast<WorkerSlot*>(shared);
+    for (unsigned i = 0; i < max_workers; i++)
+        new (&slots[i]) WorkerSlot;
+    std::vector<pid_t> pids(max_workers, 0);
+
+    // the supervisor handles no requests itself
+    board_slot = nullptr;
+
+    stop_requested = 0;
+    stop_flag = &stop_requested;
+    set_signal_handler(SIGTERM, request_stop);
+    set_signal_handler(SIGINT, request_stop);
+
+    unsigned surplus = 0;                   // ticks with more than one idle worker
+    int fork_errno = 0;                     // stops the workers already started
+    while (!stop_requested && fork_errno == 0) {
+        pid_t pid;
+        int status;
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+            for (unsigned i = 0; i < max_workers; i++)
+                if (pids[i] == pid) {
+                    pids[i] = 0;
+                    if (board && i < board->size)
+                        board->slots()[i].state.store(FastCGIScoreboard::unused, std::memory_order_relaxed);
+                }
+
+        unsigned running = 0;
+        unsigned idle = 0;
+        for (unsigned i = 0; i < max_workers; i++)
+            if (pids[i] != 0) {
+                running++;
+                if (!slots[i].busy.load(std::memory_order_relaxed))
+                    idle++;
+            }
+
+        // keep min_workers alive, and one more while none are idle
+        for (unsigned i = 0; i < max_workers; i++) {
+            if (pids[i] != 0 || (running >= min_workers && idle > 0))
+                continue;
+            slots[i].busy.store(false, std::memory_order_relaxed);
+            pid = fork();
+            if (pid == -1) {
+                fork_errno = errno;
+                break;
+            }
+            if (pid == 0) {
+                start_worker(slots[i], i);
+                return true;
+            }
+            pids[i] = pid;
+            running++;
+            idle++;
+        }
+        if (fork_errno != 0)
+            break;
+
+        surplus = idle > 1 && running > min_workers ? surplus + 1 : 0;
+        if (surplus >= 10) {
+            for (unsigned i = 0; i < max_workers; i++)
+                if (pids[i] != 0 && !slots[i].busy.load(std::memory_order_relaxed)) {
+                    kill(pids[i], SIGTERM);
+                    break;
+                }
+            surplus = 0;
+        }
+
+        struct timespec tick = { 0, 100000000 };
+        nanosleep(&tick, NULL);
+    }
+
+    for (pid_t p : pids)
+        if (p != 0)
+            kill(p, SIGTERM);
+    for (pid_t p : pids)
+        if (p != 0)
+            while (waitpid(p, NULL, 0) == -1 && errno == EINTR) {}
+
+    set_signal_handler(SIGTERM, SIG_DFL);
+    set_signal_handler(SIGINT, SIG_DFL);
+    stop_flag = nullptr;
+    munmap(shared, max_workers * sizeof(WorkerSlot));
+    if (fork_errno != 0) {
+        errno = fork_errno;
+        throw errno_error("fork() failed");
+    }
+    return false;
+}
+
+
+void
+FastCGIServerBase::start_worker(WorkerSlot& slot, unsigned index)
+{
+    // the supervisor unlinks the socket files
+    abandon_files();
+    worker = &slot;
+    if (board && index < board->size)
+        claim_slot(index);
+}
+
+
+void
+FastCGIServerBase::scoreboard(const std::string& path, unsigned slots, unsigned slot)
+{
+    if (slot >= slots)
+        throw std::runtime_error("scoreboard slot out of range");
+    if (board)
+        throw std::runtime_error("scoreboard already set");
+
+    FileID<int> file = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (file == -1)
+        throw errno_error("open() failed");
+    struct stat st;
+    if (fstat(file, &st) == -1)
+        throw errno_error("fstat() failed");
+    std::size_t size = FastCGIScoreboard::bytes(slots);
+    if (static_cast<std::size_t>(st.st_size) < size && ftruncate(file, static_cast<off_t>(size)) == -1)
+        throw errno_error("ftruncate() failed");
+
+    void* shared = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+    if (shared == MAP_FAILED)
+        throw errno_error("mmap() failed");
+    board = static_cast<FastCGIScoreboard*>(shared);
+    if (std::memcmp(board->magic, "FCGICCSB", 8) != 0 || board->size != slots) {
+        std::memcpy(board->magic, "FCGICCSB", 8);
+        board->version = 1;
+        board->size = slots;
+    }
+    claim_slot(slot);
+}
+
+
+void
+FastCGIServerBase::claim_slot(unsigned index)
+{
+    board_slot = &board->slots()[index];
+    board_slot->pid.store(getpid(), std::memory_order_relaxed);
+    board_slot->request_start_us.store(0, std::memory_order_relaxed);
+    board_slot->requests.store(0, std::memory_order_relaxed);
+    board_slot->bytes_in.store(0, std::memory_order_relaxed);
+    board_slot->bytes_out.store(0, std::memory_order_relaxed);
+    board_slot->state.store(FastCGIScoreboard::idle, std::memory_order_relaxed);
+}
+
+
+// Publishes whether this prefork worker is busy, and once it has been asked
+// to stop, drains it as if it had handed off its listeners.
+void
+FastCGIServerBase::update_worker()
+{
+    if (!worker)
+        return;
+    worker->busy.store(statistics.requests_active != 0, std::memory_order_relaxed);
+
+    if (stop_requested && !handed_off) {
+        listen_sockets.clear();
+        handed_off = true;
+
+        // the others are closed by process() once their requests finish
+        for (auto it = read_sockets.begin(); it != read_sockets.end(); )
+            if (it->second->requests.empty() && it->second->output_buffer.empty()) {
+                statistics.bytes_buffered -= it->second->counted;
+                it = read_sockets.erase(it);
+            } else
+                ++it;
+    }
+}
+
+
+// Publishes what this server is waiting for between iterations: to write
+// output, to read the rest of a request, or for a response to come from
+// elsewhere, and when the oldest of its requests began.
+void
+FastCGIServerBase::update_board()
+{
+    bool writing = false;
+    bool reading = false;
+    long long start_us = 0;
+    for (auto &[sock, conn_ptr] : read_sockets) {
+        if (!conn_ptr->output_buffer.empty())
+            writing = true;
+        for (auto &[id, request] : conn_ptr->requests) {
+            if (output_pending(*request))
+                writing = true;
+            if (!request->params_closed || !request->in_closed || !request->data_closed)
+                reading = true;
+            if (request->start_us != 0 && (start_us == 0 || request->start_us < start_us))
+                start_us = request->start_us;
+        }
+    }
+
+    if (writing)
+        set_state(FastCGIScoreboard::writing);
+    else if (reading)
+        set_state(FastCGIScoreboard::reading_request);
+    else if (statistics.requests_active != 0)
+        set_state(FastCGIScoreboard::in_handler);
+    else
+        set_state(FastCGIScoreboard::idle);
+    board_slot->request_start_us.store(start_us, std::memory_order_relaxed);
+}
+
+
+// Finds the record starting at offset in the connection's input, and moves
+// offset past it.  Returns false if the record is not complete yet.
+bool
+FastCGIServerBase::next_record(Connection& connection, std::string::size_type& offset, Record& record)
+{
+    if (connection.input_buffer.size() - offset < FCGI_HEADER_LEN)
+        return false;
+
+    const FCGI_Header& header = *reinterpret_cast<const FCGI_Header*>(connection.input_buffer.data() + offset);
+    if (header.version != FCGI_VERSION_1) {
+        connection.close_socket = true;
+        return false;
+    }
+
+    unsigned content_length = (static_cast<unsigned>(header.contentLengthB1) << 8) + header.contentLengthB0;
+    if (connection.input_buffer.size() - offset < FCGI_HEADER_LEN + content_length + header.paddingLength)
+        return false;
+
+    record.type = header.type;
+    record.kind = header.type == FCGI_PARAMS ? Record::params_record :
+        header.type == FCGI_STDIN ? Record::stdin_record :
+        header.type == FCGI_DATA ? Record::data_record : Record::other_record;
+    record.request_id = (static_cast<unsigned>(header.requestIdB1) << 8) + header.requestIdB0;
+    record.content = connection.input_buffer.data() + offset + FCGI_HEADER_LEN;
+    record.length = content_length;
+
+    offset += FCGI_HEADER_LEN + content_length + header.paddingLength;
+    return true;
+}
+
+
+// Handles the records that do not involve the application's handlers.
+void
+FastCGIServerBase::process_record(Connection& connection, const Record& record)
+{
+    switch (record.type)
+    {
+    case FCGI_GET_VALUES:
+        {
+            Pairs pairs = parse_pairs(record.content, record.length);
+
+            // FCGI_MAX_REQS is taken per connection by clients that
+            // multiplex, so a limit on all requests is shared out
+            int max_conns = 100;
+            int max_reqs = 1000;
+            if (overload.max_requests >= 0) {
+                max_conns = std::clamp(overload.max_requests, 1, max_conns);
+                max_reqs = std::max(overload.max_requests / max_conns, 1);
+            }
+
+            std::string::size_type base = connection.output_buffer.size();
+            connection.output_buffer.push_back(FCGI_VERSION_1);
+            connection.output_buffer.push_back(FCGI_GET_VALUES_RESULT);
+            connection.output_buffer.append(FCGI_HEADER_LEN - 2, 0);
+
+            for (Pairs::iterator it = pairs.begin(); it != pairs.end(); ++it) {
+                if (it->first == FCGI_MAX_CONNS)
+                    write_pair(connection.output_buffer, it->first, std::to_string(max_conns));
+                else if (it->first == FCGI_MAX_REQS)
+                    write_pair(connection.output_buffer, it->first, std::to_string(max_reqs));
+                else if (it->first == FCGI_MPXS_CONNS)
+                    write_pair(connection.output_buffer, it->first, std::string("1"));
+            }
+
+            std::string::size_type len = connection.output_buffer.size() - base - FCGI_HEADER_LEN;
+            connection.output_buffer[base + 4] = char((len >> 8) & 0xff);
+            connection.output_buffer[base + 5] = char(len & 0xff);
+            connection.output_buffer[base + 6] = char((8 - len % 8) % 8);
+            connection.output_buffer.append((8 - len % 8) % 8, 0);
+            break;
+        }
+
+    case FCGI_BEGIN_REQUEST:
+        {
+            if (record.length < sizeof(FCGI_BeginRequestBody))
+                break;
+            const FCGI_BeginRequestBody& body = *reinterpret_cast<const FCGI_BeginRequestBody*>(record.content);
+
+            if (!(body.flags & FCGI_KEEP_CONN))
+                connection.close_responsibility = true;
+
+            unsigned role = (unsigned(body.roleB1) << 8) + body.roleB0;
+            if (role != FCGI_RESPONDER && role != FCGI_AUTHORIZER && role != FCGI_FILTER) {
+                write_end_request(connection.output_buffer, record.request_id, 0, FCGI_UNKNOWN_ROLE);
+                if (connection.close_responsibility)
+                    connection.close_socket = true;
+                break;
+            }
+
+            {
+                RequestList::iterator it = connection.requests.find(record.request_id);
+                if (it != connection.requests.end()) {
+                    forget_request(*it->second);
+                    connection.requests.erase(it);
+                    statistics.requests_active--;
+                }
+            }
+
+            if (overloaded()) {
+                statistics.requests_shed++;
+                write_end_request(connection.output_buffer, record.request_id, 0, FCGI_OVERLOADED);
+                if (connection.close_responsibility)
+                    connection.close_socket = true;
+                break;
+            }
+
+            statistics.requests_active++;
+            RequestInfoPtr new_request(new RequestInfo);
+            new_request->request_id = record.request_id;
+            new_request->role = role;
+            new_request->data_closed = role != FCGI_FILTER;
+            new_request->in_closed = new_request->no_stdin = role == FCGI_AUTHORIZER;
+            if (log_ring)
+                new_request->begun = Clock::now();
+            connection.requests.insert( {record.request_id, std::move(new_request)} );
+            break;
+        }
+
+    case FCGI_ABORT_REQUEST:
+        {
+            RequestList::iterator it = connection.requests.find(record.request_id);
+            if (it == connection.requests.end())
+                break;
+
+            write_end_request(connection.output_buffer, record.request_id, 1, FCGI_REQUEST_COMPLETE);
+            if (connection.close_responsibility)
+                connection.close_socket = true;
+
+            forget_request(*it->second);
+            connection.requests.erase(it);
+            statistics.requests_active--;
+            break;
+        }
+
+    default:
+        {
+            FCGI_UnknownTypeRecord unknown;
+            bzero(&unknown, sizeof(unknown));
+            unknown.header.version = FCGI_VERSION_1;
+            unknown.header.type = FCGI_UNKNOWN_TYPE;
+            unknown.header.contentLengthB0 = sizeof(unknown.body);
+            unknown.body.type = record.type;
+            connection.output_buffer.append(reinterpret_cast<const char*>(&unknown), sizeof(unknown));
+        }
+    }
+}
+
+
+// Collects params for a request, decoding them as each record arrives.
+// Returns the request once its params are complete and it is ready for the
+// request handler.
+FastCGIServerBase::RequestInfo*
+FastCGIServerBase::read_params(Connection& connection, const Record& record)
+{
+    RequestInfo* request = find_request(connection, record.request_id);
+    if (!request || request->params_closed)
+        return nullptr;
+
+    if (record.length != 0) {
+        request->params_size += record.length;
+        if (max_params != 0 && request->params_size > max_params) {
+            // answer it now; it stays on the connection until its response
+            // is sent, and its closed flags drop the rest of its records
+            request->params.clear();
+            std::string().swap(request->params_buffer);
+            std::string().swap(request->params_raw);
+            request->params_index.clear();
+            answer(*request, "431 Request Header Fields Too Large");
+            request->params_closed = request->in_closed = request->data_closed = true;
+            return nullptr;
+        }
+        read_pairs(*request, record.content, record.length);
+        return nullptr;
+    }
+
+    // a pair cut short is dropped
+    std::string().swap(request->params_buffer);
+    request->params_closed = true;
+    if (board_slot)
+        request->start_us = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+    return request;
+}
+
+
+FastCGIServerBase::RequestInfo*
+FastCGIServerBase::find_request(Connection& connection, RequestID id)
+{
+    RequestList::iterator it = connection.requests.find(id);
+    return it == connection.requests.end() ? nullptr : it->second.get();
+}
+
+
+// Frames up to budget bytes of the request's pending output.  Once all of it
+// has been sent and the request is finished, closes the streams and ends the
+// request.  Returns the number of stream bytes framed.
+std::string::size_type
+FastCGIServerBase::process_write_request(Connection& connection, RequestID id, RequestInfo& request,
+                                     std::string::size_type budget)
+{
+    std::string::size_type framed = 0;
+
+    // output appended to out before records were written in place
+    if (request.out_ahead > request.out_sent) {
+        framed = frame_out(connection, id, request, std::min(budget, request.out_ahead - request.out_sent));
+        if (framed >= budget)
+            return framed;
+    }
+
+    request.close_record();
+    if (request.framed.size() > request.framed_sent) {
+        // records written in place go out whole
+        std::string::size_type end = request.framed_sent;
+        while (end < request.framed.size() &&
+                (end == request.framed_sent || end - request.framed_sent < budget - framed)) {
+            const FCGI_Header& header = *reinterpret_cast<const FCGI_Header*>(request.framed.data() + end);
+            std::string::size_type length = (static_cast<unsigned>(header.contentLengthB1) << 8) +
+                header.contentLengthB0;
+            request.bytes_out += length;
+            end += FCGI_HEADER_LEN + length + header.paddingLength;
+        }
+
+        std::string::size_type n = end - request.framed_sent;
+        if (request.capture)
+            request.captured.append(request.framed, request.framed_sent, n);
+        if (request.framed_sent == 0 && end == request.framed.size() && connection.output_buffer.empty())
+            connection.output_buffer.swap(request.framed);
+        else
+            connection.output_buffer.append(request.framed, request.framed_sent, n);
+        request.framed_sent = end;
+        if (request.framed_sent >= request.framed.size()) {
+            request.framed.clear();
+            request.framed_sent = 0;
+        }
+        framed += n;
+        if (framed >= budget)
+            return framed;
+    }
+
+    framed += frame_out(connection, id, request, std::min(budget - framed, request.out.size() - request.out_sent));
+
+    std::string::size_type n = std::min(budget - framed, request.err.size() - request.err_sent);
+    if (n > 0) {
+        write_data(connection.output_buffer, id, request.err.data() + request.err_sent, n, FCGI_STDERR);
+        if (request.capture)
+            request.captured_err.append(request.err, request.err_sent, n);
+        request.err_sent += n;
+        request.bytes_out += n;
+        framed += n;
+        if (request.err_sent == request.err.size()) {
+            request.err.clear();
+            request.err_sent = 0;
+        }
+    }
+
+    if (request.done() && !request.output_closed &&
+            request.framed.empty() && request.out.empty() && request.err.empty()) {
+        if (!request.cache_key.empty() && request.cache_ttl > 0 && request.status == 0 &&
+                (request.role != FCGI_AUTHORIZER || granted(request.captured))) {
+            ResponseCache& responses = request.role == FCGI_AUTHORIZER ? decisions : cache;
+            responses.store(request.cache_key, request.captured,
+                            Clock::now() + std::chrono::seconds(request.cache_ttl));
+        }
+        if (!request.flight_key.empty())
+            land_flight(request);
+        request.captured.clear();
+        request.captured_err.clear();
+
+        write_data(connection.output_buffer, id, request.out, FCGI_STDOUT);
+        write_data(connection.output_buffer, id, request.err, FCGI_STDERR);
+        write_end_request(connection.output_buffer, id, request.status, FCGI_REQUEST_COMPLETE);
+        if (connection.close_responsibility)
+            connection.close_socket = true;
+        if (board_slot)
+            add(board_slot->requests, 1);
+        if (log_ring)
+            log_request(request);
+
+        request.output_closed = true;
+    }
+
+    return framed;
+}
+
+
+// Frames the next n bytes of the request's out.
+std::string::size_type
+FastCGIServerBase::frame_out(Connection& connection, RequestID id, RequestInfo& request, std::string::size_type n)
+{
+    if (n == 0)
+        return 0;
+    write_data(connection.output_buffer, id, request.out.data() + request.out_sent, n, FCGI_STDOUT);
+    if (request.capture)
+        write_data(request.captured, 0, request.out.data() + request.out_sent, n, FCGI_STDOUT);
+    request.out_sent += n;
+    request.bytes_out += n;
+    if (request.out_sent == request.out.size()) {
+        request.out.clear();
+        request.out_sent = 0;
+        request.out_ahead = 0;
+    }
+    return n;
+}
+
+
+bool
+FastCGIServerBase::output_pending(const RequestInfo& request)
+{
+    return request.framed.size() > request.framed_sent || request.open_record != std::string::npos ||
+        request.out.size() > request.out_sent || request.err.size() > request.err_sent ||
+        (request.done() && !request.output_closed);
+}
+
+
+// Drops output that has already been sent, so that handlers only see what
+// is still pending in out and err.
+void
+FastCGIServerBase::compact_output(RequestInfo& request)
+{
+    request.out.erase(0, request.out_sent);
+    request.out_ahead -= std::min(request.out_ahead, request.out_sent);
+    request.out_sent = 0;
+    request.err.erase(0, request.err_sent);
+    request.err_sent = 0;
+}
+
+
+// Moves pending output from the connection's requests into its output buffer
+// by deficit round robin: each request may frame up to one quantum per round,
+// so a large response cannot hold up small ones multiplexed behind it.  Rounds
+// continue until the buffer holds enough to keep the socket busy, and the next
+// call resumes with the request after the last one served.
+void
+FastCGIServerBase::process_connection_write(Connection& connection)
+{
+    bool progress = true;
+    while (progress && connection.output_buffer.size() < output_high_water) {
+        progress = false;
+
+        RequestList::iterator it = connection.requests.lower_bound(connection.next_turn);
+        for (RequestList::size_type i = connection.requests.size();
+                i > 0 && connection.output_buffer.size() < output_high_water; i--, ++it) {
+            if (it == connection.requests.end())
+                it = connection.requests.begin();
+            RequestInfo& request = *it->second;
+            connection.next_turn = it->first + 1;
+
+            if (!output_pending(request)) {
+                request.deficit = 0;
+                continue;
+            }
+
+            std::string::size_type before = connection.output_buffer.size();
+            if (quantum == 0)
+                request.deficit = std::string::npos;
+            else
+                request.deficit += quantum;
+            std::string::size_type framed = process_write_request(connection, it->first, request, request.deficit);
+            if (!output_pending(request))
+                request.deficit = 0;
+            else if (quantum != 0)
+                request.deficit -= std::min(framed, request.deficit);
+            if (connection.output_buffer.size() != before)
+                progress = true;
+        }
+    }
+
+    for (auto it = connection.requests.begin(); it != connection.requests.end(); ) {
+        if (it->second->params_closed && it->second->in_closed && it->second->data_closed &&
+                it->second->output_closed) {
+            forget_request(*it->second);
+            it = connection.requests.erase(it);
+            statistics.requests_active--;
+        } else
+            ++it;
+    }
+}
+
+
+// Reads the lengths of the pair at offset m and advances m to its name.
+// Returns false at the end of the pairs or if the pair is incomplete.
+bool
+FastCGIServerBase::next_pair(const char* data, std::string::size_type n, std::string::size_type& m,
+                             std::string::size_type& name_length, std::string::size_type& value_length)
+{
+    const unsigned char* u = reinterpret_cast<const unsigned char*>(data);
+
+    if (m >= n)
+        return false;
+    if (u[m] >> 7) {
+        if (n - m < 4)
+            return false;
+        name_length =   ((uint32_t(u[m]) & 0x7f) << 24) +
+                        (uint32_t(u[m + 1]) << 16) +
+                        (uint32_t(u[m + 2]) << 8) +
+                        uint32_t(u[m + 3]);
+        m += 4;
+    } else
+        name_length = u[m++];
+    if (m >= n)
+        return false;
+
+    if (u[m] >> 7) {
+        if (n - m < 4)
+            return false;
+        value_length =  ((uint32_t(u[m]) & 0x7f) << 24) +
+                        (uint32_t(u[m + 1]) << 16) +
+                        (uint32_t(u[m + 2]) << 8) +
+                        uint32_t(u[m + 3]);
+        m += 4;
+    } else
+        value_length = u[m++];
+
+    return n - m >= name_length && n - m - name_length >= value_length;
+}
+
+
+FastCGIServerBase::Pairs
+FastCGIServerBase::parse_pairs(const char* data, std::string::size_type n)
+{
+    Pairs pairs;
+
+    std::string::size_type m = 0, name_length, value_length;
+    while (next_pair(data, n, m, name_length, value_length)) {
+        pairs.insert( {std::string(data + m, name_length), std::string(data + m + name_length, value_length)} );
+        m += name_length + value_length;
+    }
+
+    return pairs;
+}
+
+
+// Decodes the pairs completed by the next part of a request's params.  What
+// is left of an incomplete pair waits in params_buffer for the next part;
+// in lazy mode, the raw params are kept and indexed instead.
+void
+FastCGIServerBase::read_pairs(RequestInfo& request, const char* data, std::string::size_type n)
+{
+    if (params_lazy) {
+        request.params_raw.append(data, n);
+        index_pairs(request);
+        return;
+    }
+
+    if (!request.params_buffer.empty()) {
+        request.params_buffer.append(data, n);
+        data = request.params_buffer.data();
+        n = request.params_buffer.size();
+    }
+
+    std::string::size_type m = 0, done = 0, name_length, value_length;
+    while (next_pair(data, n, m, name_length, value_length)) {
+        request.params.insert( {std::string(data + m, name_length),
+                                std::string(data + m + name_length, value_length)} );
+        m += name_length + value_length;
+        done = m;
+    }
+
+    // the lengths of an incomplete pair are read again with its rest
+    if (request.params_buffer.empty())
+        request.params_buffer.assign(data + done, n - done);
+    else
+        request.params_buffer.erase(0, done);
+}
+
+
+// Notes where each new pair of the raw params lies, without copying any.
+void
+FastCGIServerBase::index_pairs(RequestInfo& request)
+{
+    const std::string& raw = request.params_raw;
+    std::string::size_type m = 0, name_length, value_length;
+    if (!request.params_index.empty())
+        m = request.params_index.back().value + request.params_index.back().value_length;
+    while (next_pair(raw.data(), raw.size(), m, name_length, value_length)) {
+        request.params_index.push_back(RequestInfo::ParamSpan{static_cast<unsigned>(m),
+            static_cast<unsigned>(name_length), static_cast<unsigned>(m + name_length),
+            static_cast<unsigned>(value_length)});
+        m += name_length + value_length;
+    }
+}
+
+
+void
+FastCGIServerBase::write_pair(std::string& buffer, const std::string& key, const std::string& value)
+{
+    if (key.size() > 0x7f) {
+        buffer.push_back(char(0x80 + ((key.size() >> 24) & 0x7f)));
         buffer.push_back(char((key.size() >> 16) & 0xff));
         buffer.push_back(char((key.size() >> 8) & 0xff));
         buffer.push_back(char(key.size() & 0xff));
@@ -584,7 +3386,15 @@ FastCGIServer::write_pair(std::string& buffer, const std::string& key, const std
 
 
 void
-FastCGIServer::write_data(std::string& buffer, RequestID id, const std::string& input, unsigned char type)
+FastCGIServerBase::write_data(std::string& buffer, RequestID id, const std::string& input, unsigned char type)
+{
+    write_data(buffer, id, input.data(), input.size(), type);
+}
+
+
+void
+FastCGIServerBase::write_data(std::string& buffer, RequestID id, const char* input, std::string::size_type size,
+                          unsigned char type)
 {
     FCGI_Header header;
     bzero(&header, sizeof(header));
@@ -594,18 +3404,736 @@ FastCGIServer::write_data(std::string& buffer, RequestID id, const std::string&
     header.requestIdB0 = id & 0xff;
 
     for (std::string::size_type n = 0;;) {
-        std::string::size_type written = std::min(input.size() - n, (std::string::size_type)0xffffu);
+        std::string::size_type written = std::min(size - n, (std::string::size_type)0xffffu);
 
         header.contentLengthB1 = (unsigned char)(written >> 8);
         header.contentLengthB0 = (unsigned char)(written & 0xff);
         header.paddingLength = (8 - (written % 8)) % 8;
         buffer.append(reinterpret_cast<const char*>(&header), sizeof(header));
-        buffer.append(input.data() + n, written);
+        buffer.append(input + n, written);
         buffer.append(header.paddingLength, 0);
 
         n += written;
-        if (n == input.size())
+        if (n == size)
+            break;
+    }
+}
+
+
+
+void
+FastCGIServerBase::write_end_request(std::string& buffer, RequestID id, int status, unsigned char protocol_status)
+{
+    FCGI_EndRequestRecord complete;
+    bzero(&complete, sizeof(complete));
+    complete.header.version = FCGI_VERSION_1;
+    complete.header.type = FCGI_END_REQUEST;
+    complete.header.requestIdB1 = (id >> 8) & 0xff;
+    complete.header.requestIdB0 = id & 0xff;
+    complete.header.contentLengthB0 = sizeof(complete.body);
+    complete.body.appStatusB3 = static_cast<unsigned char>((status >> 24) & 0xff);
+    complete.body.appStatusB2 = static_cast<unsigned char>((status >> 16) & 0xff);
+    complete.body.appStatusB1 = static_cast<unsigned char>((status >> 8) & 0xff);
+    complete.body.appStatusB0 = static_cast<unsigned char>(status & 0xff);
+    complete.body.protocolStatus = protocol_status;
+    buffer.append(reinterpret_cast<const char*>(&complete), sizeof(complete));
+}
+
+
+
+FastCGIClient::FastCGIClient(const std::string& p_address, unsigned p_max_connections) :
+    address(p_address),
+    max_connections(std::max(p_max_connections, 1u)),
+    next_call(1)
+{
+}
+
+
+FastCGIClient::~FastCGIClient()
+{
+    for (Connection& connection : connections)
+        close(connection.fd);
+}
+
+
+FastCGIClient::CallID
+FastCGIClient::call(const Params& params, Handlers handlers, std::string_view in, bool stdin_complete)
+{
+    std::string pairs;
+    for (auto &[name, value] : params)
+        FastCGIServerBase::write_pair(pairs, name, value);
+
+    std::string records;
+    if (!pairs.empty())
+        FastCGIServerBase::write_data(records, 0, pairs, FCGI_PARAMS);
+    FastCGIServerBase::write_data(records, 0, NULL, 0, FCGI_PARAMS);
+    if (!in.empty())
+        FastCGIServerBase::write_data(records, 0, in.data(), in.size(), FCGI_STDIN);
+    if (stdin_complete)
+        FastCGIServerBase::write_data(records, 0, NULL, 0, FCGI_STDIN);
+    return start(std::move(handlers), FCGI_RESPONDER, records, stdin_complete);
+}
+
+
+FastCGIClient::CallID
+FastCGIClient::begin(Handlers handlers, unsigned role)
+{
+    return start(std::move(handlers), role, std::string(), true);
+}
+
+
+FastCGIClient::CallID
+FastCGIClient::start(Handlers handlers, unsigned role, const std::string& records, bool in_closed)
+{
+    FCGI_BeginRequestRecord begin;
+    bzero(&begin, sizeof(begin));
+    begin.header.version = FCGI_VERSION_1;
+    begin.header.type = FCGI_BEGIN_REQUEST;
+    begin.header.contentLengthB0 = sizeof(begin.body);
+    begin.body.roleB1 = (role >> 8) & 0xff;
+    begin.body.roleB0 = role & 0xff;
+    begin.body.flags = FCGI_KEEP_CONN;
+
+    CallID id = next_call++;
+    Call& call = calls[id];
+    call.handlers = std::move(handlers);
+    call.records.assign(reinterpret_cast<const char*>(&begin), sizeof(begin));
+    call.records.append(records);
+    call.in_closed = in_closed;
+    call.aborted = false;
+    call.paused = false;
+    call.connection = nullptr;
+    call.request_id = 0;
+
+    try {
+        if (!assign(id, call))
+            waiting.push_back(id);
+    } catch (...) {
+        calls.erase(id);
+        throw;
+    }
+    return id;
+}
+
+
+void
+FastCGIClient::send_records(CallID id, std::string_view records)
+{
+    std::map<CallID, Call>::iterator it = calls.find(id);
+    if (it == calls.end())
+        return;
+    Call& call = it->second;
+    std::string& buffer = call.connection ? call.connection->output : call.records;
+    std::string::size_type from = buffer.size();
+    buffer.append(records.data(), records.size());
+    FastCGIServerBase::set_request_id(buffer, call.request_id, from);
+}
+
+
+void
+FastCGIClient::send_stdin(CallID id, std::string_view data)
+{
+    std::map<CallID, Call>::iterator it = calls.find(id);
+    if (it == calls.end() || it->second.in_closed || data.empty())
+        return;
+    Call& call = it->second;
+    if (call.connection)
+        FastCGIServerBase::write_data(call.connection->output, call.request_id, data.data(), data.size(),
+                                      FCGI_STDIN);
+    else
+        FastCGIServerBase::write_data(call.records, 0, data.data(), data.size(), FCGI_STDIN);
+}
+
+
+void
+FastCGIClient::close_stdin(CallID id)
+{
+    std::map<CallID, Call>::iterator it = calls.find(id);
+    if (it == calls.end() || it->second.in_closed)
+        return;
+    Call& call = it->second;
+    call.in_closed = true;
+    FastCGIServerBase::write_data(call.connection ? call.connection->output : call.records,
+                                  call.request_id, NULL, 0, FCGI_STDIN);
+}
+
+
+void
+FastCGIClient::abort(CallID id)
+{
+    std::map<CallID, Call>::iterator it = calls.find(id);
+    if (it == calls.end())
+        return;
+    Call& call = it->second;
+    if (!call.connection) {
+        waiting.remove(id);
+        calls.erase(it);
+        return;
+    }
+
+    // the backend still answers with END_REQUEST, which frees the id; the
+    // handlers are kept until then, as this may be called from one of them
+    if (call.aborted)
+        return;
+    pause(id, false);
+    call.aborted = true;
+    FCGI_Header header;
+    bzero(&header, sizeof(header));
+    header.version = FCGI_VERSION_1;
+    header.type = FCGI_ABORT_REQUEST;
+    header.requestIdB1 = (call.request_id >> 8) & 0xff;
+    header.requestIdB0 = call.request_id & 0xff;
+    call.connection->output.append(reinterpret_cast<const char*>(&header), sizeof(header));
+}
+
+
+std::size_t
+FastCGIClient::unsent(CallID id) const
+{
+    std::map<CallID, Call>::const_iterator it = calls.find(id);
+    if (it == calls.end())
+        return 0;
+    const Call& call = it->second;
+    return call.connection ? call.connection->output.size() : call.records.size();
+}
+
+
+// Reading a connection shared by other calls holds them back too, as
+// nothing else tells its records apart.
+void
+FastCGIClient::pause(CallID id, bool paused)
+{
+    std::map<CallID, Call>::iterator it = calls.find(id);
+    if (it == calls.end() || it->second.paused == paused)
+        return;
+    Call& call = it->second;
+    call.paused = paused;
+    if (!call.connection)
+        return;
+    if (paused)
+        call.connection->paused++;
+    else
+        call.connection->paused--;
+}
+
+
+// Opens a connection and asks the backend for its limits.  A connect()
+// that fails at once is reported as dispatch() reports one that fails
+// later, ending the calls on the connection.
+void
+FastCGIClient::open_connection()
+{
+    std::vector<std::string> addresses;
+    if (address.find('/') != std::string::npos) {
+        socklen_t socklen;
+        struct sockaddr_un sa = local_address(address, socklen);
+        addresses.emplace_back(reinterpret_cast<const char*>(&sa), socklen);
+    } else {
+        std::string::size_type colon = address.rfind(':');
+        if (colon == std::string::npos)
+            throw std::runtime_error("backend address needs a port");
+        struct addrinfo hints;
+        bzero(&hints, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        struct addrinfo* found;
+        if (getaddrinfo(address.substr(0, colon).c_str(), address.c_str() + colon + 1, &hints, &found) != 0)
+            throw std::runtime_error("cannot resolve " + address);
+        for (struct addrinfo* ai = found; ai; ai = ai->ai_next)
+            addresses.emplace_back(reinterpret_cast<const char*>(ai->ai_addr), ai->ai_addrlen);
+        freeaddrinfo(found);
+    }
+
+    connections.push_back(Connection{-1, true, 0, std::move(addresses), std::string(), std::string(), {}, 1, 0});
+    Connection& connection = connections.back();
+    connect_next(connection);
+    if (connection.fd == -1) {
+        errno = connection.error;
+        connections.pop_back();
+        throw errno_error("socket() failed");
+    }
+
+    std::string pairs;
+    FastCGIServerBase::write_pair(pairs, FCGI_MAX_CONNS, std::string());
+    FastCGIServerBase::write_pair(pairs, FCGI_MAX_REQS, std::string());
+    FastCGIServerBase::write_pair(pairs, FCGI_MPXS_CONNS, std::string());
+    FastCGIServerBase::write_data(connection.output, 0, pairs, FCGI_GET_VALUES);
+}
+
+
+// Starts connecting to the next of the connection's addresses, leaving
+// error set if connect() failed at once for all that are left, and fd -1
+// if no socket could be made.
+void
+FastCGIClient::connect_next(Connection& connection)
+{
+    while (!connection.addresses.empty()) {
+        std::string sa = std::move(connection.addresses.front());
+        connection.addresses.erase(connection.addresses.begin());
+        const struct sockaddr* addr = reinterpret_cast<const struct sockaddr*>(sa.data());
+
+        int fd = socket(addr->sa_family, SOCK_STREAM, 0);
+        if (fd == -1 || fcntl(fd, F_SETFD, FD_CLOEXEC) == -1 ||
+                fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == -1) {
+            if (connection.fd == -1)
+                connection.error = errno;
+            if (fd != -1)
+                close(fd);
+            continue;
+        }
+        if (connection.fd != -1)
+            close(connection.fd);
+        connection.fd = fd;
+
+        // for a local socket, EAGAIN is a full backlog, not a connect()
+        // under way
+        if (connect(fd, addr, static_cast<socklen_t>(sa.size())) == 0 || errno == EINPROGRESS) {
+            connection.error = 0;
+            return;
+        }
+        connection.error = errno;
+    }
+}
+
+
+// Sends the call on the connection with the fewest calls that has room
+// for one more, opening a connection if none has.  Returns false if the
+// call has to wait.
+bool
+FastCGIClient::assign(CallID id, Call& call)
+{
+    Connection* best = nullptr;
+    for (Connection& connection : connections)
+        if (connection.requests.size() < connection.max_requests &&
+                (!best || connection.requests.size() < best->requests.size()))
+            best = &connection;
+    if (!best) {
+        if (connections.size() >= max_connections)
+            return false;
+        open_connection();
+        best = &connections.back();
+    }
+
+    unsigned request_id = 1;
+    while (best->requests.count(request_id))
+        request_id++;
+    best->requests[request_id] = id;
+    call.connection = best;
+    call.request_id = request_id;
+    if (call.paused)
+        best->paused++;
+
+    std::string::size_type from = best->output.size();
+    best->output.append(call.records);
+    FastCGIServerBase::set_request_id(best->output, request_id, from);
+    std::string().swap(call.records);
+    return true;
+}
+
+
+void
+FastCGIClient::assign_waiting()
+{
+    while (!waiting.empty()) {
+        std::map<CallID, Call>::iterator it = calls.find(waiting.front());
+        if (it != calls.end() && !assign(it->first, it->second))
+            break;
+        waiting.pop_front();
+    }
+}
+
+
+// Handles the complete records at the front of the connection's input.
+void
+FastCGIClient::read_records(Connection& connection)
+{
+    std::string::size_type n = 0;
+    while (connection.input.size() - n >= FCGI_HEADER_LEN) {
+        const FCGI_Header& header = *reinterpret_cast<const FCGI_Header*>(connection.input.data() + n);
+        unsigned length = (static_cast<unsigned>(header.contentLengthB1) << 8) + header.contentLengthB0;
+        if (connection.input.size() - n < FCGI_HEADER_LEN + length + header.paddingLength)
             break;
+        unsigned request_id = (static_cast<unsigned>(header.requestIdB1) << 8) + header.requestIdB0;
+        std::string_view whole(connection.input.data() + n, FCGI_HEADER_LEN + length + header.paddingLength);
+        const char* content = whole.data() + FCGI_HEADER_LEN;
+        n += whole.size();
+
+        if (header.type == FCGI_GET_VALUES_RESULT) {
+            FastCGIServerBase::Pairs pairs = FastCGIServerBase::parse_pairs(content, length);
+            FastCGIServerBase::Pairs::iterator it = pairs.find(FCGI_MPXS_CONNS);
+            if (it != pairs.end() && it->second == "1") {
+                it = pairs.find(FCGI_MAX_REQS);
+                unsigned long limit = it != pairs.end() ? std::strtoul(it->second.c_str(), NULL, 10) : 1;
+                connection.max_requests = static_cast<unsigned>(std::min(std::max(limit, 1ul), 0xfffful));
+            }
+            it = pairs.find(FCGI_MAX_CONNS);
+            if (it != pairs.end()) {
+                unsigned long limit = std::strtoul(it->second.c_str(), NULL, 10);
+                if (limit > 0 && limit < max_connections)
+                    max_connections = static_cast<unsigned>(limit);
+            }
+            continue;
+        }
+
+        std::map<unsigned, CallID>::iterator found = connection.requests.find(request_id);
+        if (found == connection.requests.end())
+            continue;
+        CallID id = found->second;
+        Call& call = calls[id];
+
+        if (call.aborted && header.type != FCGI_END_REQUEST)
+            continue;
+        if ((header.type == FCGI_STDOUT || header.type == FCGI_STDERR) && call.handlers.records) {
+            if (length != 0)
+                call.handlers.records(whole);
+        } else if (header.type == FCGI_STDOUT && length != 0) {
+            if (call.handlers.out)
+                call.handlers.out(std::string_view(content, length));
+        } else if (header.type == FCGI_STDERR && length != 0) {
+            if (call.handlers.err)
+                call.handlers.err(std::string_view(content, length));
+        } else if (header.type == FCGI_END_REQUEST && length >= sizeof(FCGI_EndRequestBody)) {
+            const FCGI_EndRequestBody& body = *reinterpret_cast<const FCGI_EndRequestBody*>(content);
+            int status = static_cast<int>((static_cast<unsigned>(body.appStatusB3) << 24) +
+                (static_cast<unsigned>(body.appStatusB2) << 16) +
+                (static_cast<unsigned>(body.appStatusB1) << 8) + body.appStatusB0);
+            Handlers handlers = std::move(call.handlers);
+            bool aborted = call.aborted;
+            if (call.paused)
+                connection.paused--;
+            connection.requests.erase(found);
+            calls.erase(id);
+            if (handlers.end && !aborted)
+                handlers.end(status, body.protocolStatus);
+        }
+    }
+    connection.input.erase(0, n);
+}
+
+
+// Closes a connection that failed, ending its calls.
+void
+FastCGIClient::fail(std::list<Connection>::iterator connection)
+{
+    if (connection->fd != -1)
+        close(connection->fd);
+    std::map<unsigned, CallID> requests;
+    requests.swap(connection->requests);
+    connections.erase(connection);
+
+    for (auto &[request_id, id] : requests) {
+        std::map<CallID, Call>::iterator it = calls.find(id);
+        if (it == calls.end())
+            continue;
+        Handlers handlers = std::move(it->second.handlers);
+        bool aborted = it->second.aborted;
+        calls.erase(it);
+        if (handlers.end && !aborted)
+            handlers.end(0, -1);
+    }
+}
+
+
+int
+FastCGIClient::prepare(fd_set& read, fd_set& write) const
+{
+    int nfd = -1;
+    for (const Connection& connection : connections) {
+        if (connection.paused == 0)
+            FD_SET(connection.fd, &read);
+        if (connection.connecting || !connection.output.empty())
+            FD_SET(connection.fd, &write);
+        nfd = std::max(nfd, connection.fd);
+    }
+    return nfd;
+}
+
+
+void
+FastCGIClient::dispatch(const fd_set& read, const fd_set& write)
+{
+    for (auto it = connections.begin(); it != connections.end(); ) {
+        Connection& connection = *it;
+        bool failed = false;
+
+        if (FD_ISSET(connection.fd, &write)) {
+            if (connection.connecting) {
+                int error = connection.error;
+                socklen_t size = sizeof(error);
+                if (error == 0)
+                    getsockopt(connection.fd, SOL_SOCKET, SO_ERROR, &error, &size);
+                if (error != 0 && !connection.addresses.empty()) {
+                    // nothing was sent yet; try the next address
+                    connect_next(connection);
+                    if (connection.fd != -1) {
+                        ++it;
+                        continue;
+                    }
+                }
+                failed = error != 0;
+                connection.connecting = false;
+            }
+            if (!failed && !connection.output.empty()) {
+#ifdef MSG_NOSIGNAL
+                ssize_t result = send(connection.fd, connection.output.data(), connection.output.size(),
+                                      MSG_NOSIGNAL);
+#else
+                ssize_t result = ::write(connection.fd, connection.output.data(), connection.output.size());
+#endif
+                if (result >= 0)
+                    connection.output.erase(0, static_cast<std::string::size_type>(result));
+                else
+                    failed = errno != EAGAIN && errno != EINTR;
+            }
+        }
+
+        if (!failed && FD_ISSET(connection.fd, &read)) {
+            char buffer[16384];
+            ssize_t result = ::read(connection.fd, buffer, sizeof(buffer));
+            if (result > 0) {
+                connection.input.append(buffer, static_cast<std::string::size_type>(result));
+                read_records(connection);
+            } else
+                failed = result == 0 || (errno != EAGAIN && errno != EINTR);
+        }
+
+        if (failed)
+            fail(it++);
+        else
+            ++it;
+    }
+    assign_waiting();
+}
+
+
+void
+FastCGIClient::process(int timeout_ms)
+{
+    fd_set fs_read;
+    fd_set fs_write;
+    FD_ZERO(&fs_read);
+    FD_ZERO(&fs_write);
+    int nfd = prepare(fs_read, fs_write);
+    struct timeval tv = { timeout_ms / 1000, (timeout_ms % 1000) * 1000 };
+
+    int select_result = select(nfd + 1, &fs_read, &fs_write, NULL, timeout_ms < 0 ? NULL : &tv);
+    if (select_result == -1) {
+        if (errno == EINTR)
+            return;
+        else
+            throw errno_error("select() failed");
+    }
+    dispatch(fs_read, fs_write);
+}
+
+
+
+FastCGIProxy::Backend::Backend(const std::string& address, unsigned max_connections) :
+    client(address, max_connections),
+    failures(0),
+    retry()
+{
+}
+
+
+FastCGIProxy::FastCGIProxy() :
+    max_failures(3),
+    retry_after(std::chrono::seconds(10))
+{
+}
+
+
+void
+FastCGIProxy::backend(const std::string& address, unsigned max_connections)
+{
+    backends.emplace_back(address, max_connections);
+}
+
+
+void
+FastCGIProxy::health_checks(unsigned p_max_failures, int retry_ms)
+{
+    max_failures = std::max(p_max_failures, 1u);
+    retry_after = std::chrono::milliseconds(retry_ms);
+}
+
+
+void
+FastCGIProxy::process_connection_read(Connection& connection)
+{
+    std::string::size_type n = 0;
+    Record record;
+    while (next_record(connection, n, record)) {
+        if (record.kind == Record::other_record) {
+            process_record(connection, record);
+            RequestInfo* request = find_request(connection, record.request_id);
+            if (record.type == FCGI_BEGIN_REQUEST && request)
+                forward(connection, *request);
+            continue;
+        }
+
+        RequestInfo* request = find_request(connection, record.request_id);
+        if (!request)
+            continue;
+        bool& closed = record.kind == Record::params_record ? request->params_closed :
+            record.kind == Record::stdin_record ? request->in_closed : request->data_closed;
+        if (closed)
+            continue;
+        if (record.kind == Record::stdin_record)
+            request->bytes_in += record.length;
+        if (record.length == 0)
+            closed = true;
+
+        std::unordered_map<RequestInfo*, Forward>::iterator it = forwards.find(request);
+        if (it != forwards.end()) {
+            const char* whole = record.content - FCGI_HEADER_LEN;
+            const FCGI_Header& header = *reinterpret_cast<const FCGI_Header*>(whole);
+            it->second.backend->client.send_records(it->second.call,
+                std::string_view(whole, FCGI_HEADER_LEN + record.length + header.paddingLength));
+        }
+    }
+
+    connection.input_buffer.erase(0, n);
+    trim(connection.input_buffer);
+    process_connection_write(connection);
+}
+
+
+// The backend with the fewest outstanding requests, of those not left out.
+// One that has been left out long enough is tried with a single request.
+FastCGIProxy::Backend*
+FastCGIProxy::pick_backend()
+{
+    Clock::time_point now = Clock::now();
+    Backend* best = nullptr;
+    for (Backend& backend : backends)
+        if ((backend.failures < max_failures || backend.retry <= now) &&
+                (!best || backend.client.outstanding() < best->client.outstanding()))
+            best = &backend;
+    if (best && best->failures >= max_failures)
+        best->retry = now + retry_after;
+    return best;
+}
+
+
+// Starts relaying a request that has just begun.  The request stays parked
+// until the backend ends it, which holds back its FCGI_END_REQUEST.
+void
+FastCGIProxy::forward(Connection& connection, RequestInfo& request)
+{
+    if (forwards.count(&request))
+        return;
+
+    Backend* backend = pick_backend();
+    if (!backend) {
+        answer(request, "502 Bad Gateway");
+        return;
+    }
+
+    RequestInfo* target = &request;
+    FastCGIClient::Handlers handlers;
+    handlers.records = [this, target](std::string_view record) { relay(*target, record); };
+    handlers.end = [this, target](int status, int protocol_status) { finish(*target, status, protocol_status); };
+    FastCGIClient::CallID call;
+    try {
+        call = backend->client.begin(std::move(handlers), request.role);
+    } catch (const std::exception&) {
+        failed(*backend);
+        answer(request, "502 Bad Gateway");
+        return;
+    }
+
+    forwards[&request] = Forward{&connection, backend, call, false};
+    request.parked = true;
+    connection.parked++;
+}
+
+
+void
+FastCGIProxy::relay(RequestInfo& request, std::string_view record)
+{
+    Forward& forward = forwards.at(&request);
+    forward.relayed = true;
+    append_records(request, record);
+    forward.connection->wake = true;
+}
+
+
+void
+FastCGIProxy::finish(RequestInfo& request, int status, int protocol_status)
+{
+    std::unordered_map<RequestInfo*, Forward>::iterator it = forwards.find(&request);
+    Forward forward = it->second;
+    forwards.erase(it);
+
+    if (protocol_status < 0)
+        failed(*forward.backend);
+    else
+        forward.backend->failures = 0;
+
+    if (protocol_status == FCGI_REQUEST_COMPLETE)
+        request.status = status;
+    else if (!forward.relayed)
+        answer(request, protocol_status < 0 ? "502 Bad Gateway" : "503 Service Unavailable");
+    else
+        // part of the response has gone out; its end tells it is cut short
+        request.status = 1;
+
+    request.answered = true;
+    request.parked = false;
+    forward.connection->parked--;
+    forward.connection->wake = true;
+}
+
+
+void
+FastCGIProxy::failed(Backend& backend)
+{
+    if (++backend.failures >= max_failures)
+        backend.retry = Clock::now() + retry_after;
+}
+
+
+void
+FastCGIProxy::forget_request(RequestInfo& request)
+{
+    std::unordered_map<RequestInfo*, Forward>::iterator it = forwards.find(&request);
+    if (it != forwards.end()) {
+        it->second.backend->client.abort(it->second.call);
+        it->second.connection->parked--;
+        forwards.erase(it);
+    }
+    FastCGIServerBase::forget_request(request);
+}
+
+
+// Applies the flow control both ways before adding the backends'
+// descriptors: a backend connection is not read while a response waits for
+// its client, nor a client connection while its requests wait for a backend.
+int
+FastCGIProxy::add_descriptors(fd_set& read, fd_set& write)
+{
+    std::unordered_set<Connection*> held;
+    for (auto &[request, forward] : forwards) {
+        forward.backend->client.pause(forward.call, forward.connection->buffered() >= relay_high_water);
+        if (forward.backend->client.unsent(forward.call) >= relay_high_water)
+            held.insert(forward.connection);
     }
+    if (!held.empty())
+        for (auto &[sock, conn_ptr] : read_sockets)
+            if (held.count(conn_ptr.get()))
+                FD_CLR(sock, &read);
+
+    int nfd = -1;
+    for (Backend& backend : backends)
+        nfd = std::max(nfd, backend.client.prepare(read, write));
+    return nfd;
 }
 
+
+void
+FastCGIProxy::process_descriptors(const fd_set& read, const fd_set& write)
+{
+    for (Backend& backend : backends)
+        backend.client.dispatch(read, write);
+}
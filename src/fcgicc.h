@@ -37,11 +37,26 @@
 #ifndef FCGICC_H
 #define FCGICC_H
 
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <condition_variable>
+#include <functional>
+#include <list>
 #include <map>
+#include <mutex>
+#include <optional>
 #include <string>
+#include <string_view>
+#include <thread>
 #include <vector>
 #include <memory>
 #include <system_error>
+#include <unordered_map>
+#include <utility>
+
+#include <sys/select.h> // fd_set
+#include <sys/types.h> // pid_t
 
 
 class errno_error : public std::system_error {
@@ -54,44 +69,493 @@ class FastCGIRequest {
 public:
     typedef std::map<std::string, std::string> Params;
 
+    FastCGIRequest();
+
+    unsigned role;                          // FCGI_RESPONDER, _AUTHORIZER or _FILTER
     Params params;
     std::string in;
     std::string out;
     std::string err;
+
+    // Writes stdout in place, straight into its FastCGI record, instead of
+    // appending to out:  out_reserve() returns space for up to size bytes and
+    // sets size to what was granted, which is less once the current record
+    // nears its 65535 byte limit;  out_commit() keeps the first n bytes
+    // written there.  Only one reservation may be outstanding; out_reserve()
+    // throws std::logic_error if called again before out_commit().  Output
+    // appended to out keeps its place before or after the records.
+    //
+    // The records are written to a buffer of the request's own rather than
+    // the connection's, since the write scheduler interleaves the output of
+    // requests on one connection.  They become the connection's buffer
+    // without a copy when it is empty, and are copied once otherwise.
+    char* out_reserve(std::string::size_type& size);
+    void out_commit(std::string::size_type n);
+
+    // Lets the response cache, if one is configured, keep this response and
+    // answer identical requests with it for the given number of seconds.
+    void cache_for(int seconds) { cache_ttl = seconds; }
+
+    // The value of a param.  Unlike params, this also works when the server
+    // reads params lazily (FastCGIServerBase::lazy_params()): params then
+    // stays empty, and values are looked up in the raw params stream.
+    std::optional<std::string_view> param(std::string_view name) const;
+
+    // Fields of the query string, the Cookie header and an urlencoded body,
+    // each parsed on first use.  Query and form fields are percent-decoded;
+    // values without escapes, and all cookies, are views into the params or
+    // into in.  form() parses in as it is at the first call, so it belongs
+    // in the complete handler, and in must not change while its views are
+    // in use.
+    std::optional<std::string_view> query(std::string_view name);
+    std::optional<std::string_view> cookie(std::string_view name);
+    std::optional<std::string_view> form(std::string_view name);
+
+protected:
+    // where a pair lies in params_raw
+    struct ParamSpan {
+        unsigned name;
+        unsigned name_length;
+        unsigned value;
+        unsigned value_length;
+    };
+
+    // name-value pairs parsed on demand
+    struct Fields {
+        Fields() : parsed(false) {}
+
+        bool parsed;
+        std::vector<std::pair<std::string_view, std::string_view>> pairs;
+        std::list<std::string> decoded;     // holds those that had escapes
+    };
+
+    void close_record();
+    static void parse_urlencoded(Fields&, std::string_view);
+    static void parse_cookies(Fields&, std::string_view);
+    static std::optional<std::string_view> find_field(const Fields&, std::string_view name);
+
+    unsigned request_id;
+    int cache_ttl;
+    std::string::size_type out_sent;        // offsets of unsent output
+    std::string::size_type out_ahead;       // end of out to send before framed
+    std::string::size_type err_sent;
+    std::string framed;                     // stdout records written in place
+    std::string::size_type framed_sent;
+    std::string::size_type open_record;     // offset of the unfinished record
+    std::string::size_type reserved;
+    std::string params_raw;                 // kept when params are lazy
+    std::vector<ParamSpan> params_index;
+    Fields query_fields;
+    Fields cookie_fields;
+    Fields form_fields;
+
+    friend class FastCGIServerBase;
 };
 
 
-class FastCGIServer {
+// Incremental parser of multipart/form-data bodies.  feed() takes the body
+// in pieces of any size, split anywhere, and calls the part handler with
+// the headers of each part as it begins and the data handler with its
+// contents.  Data points into the input, or into a carry-over of less than
+// a boundary's length, and is valid only for the call; nothing else is
+// buffered but the part headers.
+class FastCGIMultipart {
 public:
-    FastCGIServer();
+    typedef FastCGIRequest::Params Headers; // names in lower case
 
-    // called when the parameters and standard input have been receieved
-    void request_handler(int (* function)(FastCGIRequest&));
-    template<class C>
-    void request_handler(C& object, int (C::* function)(FastCGIRequest&)) {
-        set_handler(handle_request, new Handler<C>(object, function));
-    }
+    struct Handlers {
+        std::function<int(const Headers&)> part;
+        std::function<int(std::string_view)> data;
+    };
 
-    // called when new data appears on stdin
-    void data_handler(int (* function)(FastCGIRequest&));
-    template<class C>
-    void data_handler(C& object, int (C::* function)(FastCGIRequest&)) {
-        set_handler(handle_data, new Handler<C>(object, function));
-    }
+    // The boundary of a content type like "multipart/form-data; boundary=x",
+    // or empty if it is not multipart.
+    static std::string boundary(std::string_view content_type);
+    // A parameter of a header value, such as name or filename in
+    // "form-data; name=\"field\"; filename=\"a.txt\"", or empty.
+    static std::string_view header_param(std::string_view value, std::string_view name);
 
-    // called when the complete request has been received
-    void complete_handler(int (* function)(FastCGIRequest&));
+    explicit FastCGIMultipart(std::string_view boundary);
+
+    // Returns the first non-zero value a handler returns, which stops the
+    // parser, or 0.
+    int feed(std::string_view input, const Handlers&);
+    bool done() const { return state == epilogue; }
+    bool failed() const { return state == malformed; }
+
+private:
+    enum State { preamble, delimiter_line, headers, body, epilogue, malformed };
+
+    int search(std::string_view& input, const Handlers&);
+    int emit(std::string_view data, const Handlers&);
+    int begin_part(const Handlers&);
+
+    std::string delimiter;                  // CRLF "--" boundary
+    State state;
+    std::string carry;                      // input that may begin a delimiter
+    std::string head;                       // delimiter line or part headers
+};
+
+
+// Dispatches requests to handlers by method and path.  A pattern is a path
+// whose segments may be ":name", which matches any one segment, or, as the
+// last segment, "*name", which matches the rest of the path:
+//
+//     router.add("GET", "/users/:id/posts/*rest", &handle_posts);
+//
+// Patterns without parameters go into a hash table and the others into a
+// trie of segments, where a literal segment is tried before a parameter;
+// both are built as routes are added.  Matching takes the path from
+// REQUEST_URI, without the query string, or else SCRIPT_NAME.  It does not
+// allocate, and captured values are views into the params, not decoded.
+// A path is usually matched in one walk down the trie, but a segment that
+// matches both a literal and a parameter is tried both ways if the first
+// finds no route for the method, so overlapping patterns may cost more.
+//
+// The router is itself a handler for a server:
+//
+//     server.request_handler(router, &FastCGIRouter::handle);
+//
+// handle() answers 404 if no route matches the path, or 405 with an Allow
+// header if none matches the method, and stops the request.
+class FastCGIRouter {
+public:
+    static const unsigned max_captures = 8;
+
+    // the parameters captured from a path
+    class Captures {
+    public:
+        Captures() : count(0) {}
+
+        std::optional<std::string_view> get(std::string_view name) const;
+        unsigned size() const { return count; }
+        std::string_view name(unsigned i) const { return names[i]; }
+        std::string_view value(unsigned i) const { return values[i]; }
+
+    private:
+        std::string_view names[max_captures];
+        std::string_view values[max_captures];
+        unsigned count;
+
+        friend class FastCGIRouter;
+    };
+
+    typedef std::function<int(FastCGIRequest&, const Captures&)> Handler;
+
+    // An empty method matches any.  Throws std::invalid_argument if the
+    // pattern is malformed or the route has already been added.
+    void add(std::string_view method, std::string_view pattern,
+             int (* function)(FastCGIRequest&, const Captures&));
     template<class C>
-    void complete_handler(C& object, int (C::* function)(FastCGIRequest&)) {
-        set_handler(handle_complete, new Handler<C>(object, function));
+    void add(std::string_view method, std::string_view pattern,
+             C& object, int (C::* function)(FastCGIRequest&, const Captures&)) {
+        add_route(method, pattern, [&object, function](FastCGIRequest& request, const Captures& captures) {
+            return (object.*function)(request, captures);
+        });
     }
 
+    // The handler of the route for a method and path, or null; path_found
+    // is then set if the path matched a route for another method.
+    const Handler* find(std::string_view method, std::string_view path, Captures&,
+                        bool* path_found = nullptr) const;
+    // the methods of the routes for a path, as for an Allow header
+    std::string allowed(std::string_view path) const;
+    int handle(FastCGIRequest&);
+
+private:
+    struct Node {
+        std::string name;                   // of a parameter, or an exact path
+        std::vector<std::pair<std::string, std::unique_ptr<Node>>> children; // sorted
+        std::unique_ptr<Node> parameter;    // ":name"
+        std::unique_ptr<Node> rest;         // "*name"
+        std::vector<std::pair<std::string, Handler>> methods;
+
+        const Handler* handler(std::string_view method) const;
+    };
+
+    void add_route(std::string_view method, std::string_view pattern, Handler);
+    static Node& parameter_node(std::unique_ptr<Node>&, std::string_view name);
+    static const Handler* find_node(const Node&, std::string_view method, std::string_view path,
+                                    Captures&, bool& path_found);
+    static void add_methods(const Node&, std::string_view path, std::vector<std::string_view>& methods);
+
+    std::unordered_map<std::string_view, std::unique_ptr<Node>> exact; // keyed by name
+    Node root;
+};
+
+
+// Layout of the file behind FastCGIServerBase::scoreboard(): this header
+// followed by one slot per server or prefork worker.  Each slot has a single
+// writer, which updates it with relaxed stores; readers may look at it any
+// time without locking.
+struct FastCGIScoreboard {
+    enum State : unsigned { unused, idle, reading_request, in_handler, writing };
+
+    struct Slot {
+        std::atomic<unsigned> state;
+        std::atomic<long> pid;
+        std::atomic<long long> request_start_us; // oldest active, system clock, 0 when idle
+        std::atomic<unsigned long long> requests; // completed
+        std::atomic<unsigned long long> bytes_in;
+        std::atomic<unsigned long long> bytes_out;
+    };
+
+    char magic[8];                          // "FCGICCSB"
+    unsigned version;
+    unsigned size;                          // number of slots
+
+    Slot* slots() { return reinterpret_cast<Slot*>(this + 1); }
+    static std::size_t bytes(unsigned size) { return sizeof(FastCGIScoreboard) + size * sizeof(Slot); }
+};
+
+
+// Layout of the file written by FastCGIServerBase::capture(): this header
+// followed by chunks, each a Chunk and then the length bytes that were read
+// from a connection.  A chunk of length 0 marks the end of a connection's
+// input.
+struct FastCGICapture {
+    struct Chunk {
+        unsigned long long time_us;         // since the capture started
+        unsigned connection;                // numbered from 1 as first read
+        unsigned length;
+    };
+
+    char magic[8];                          // "FCGICCCP"
+    unsigned version;
+    unsigned reserved;
+};
+
+
+class FastCGIServerBase;
+class FastCGIClient;
+
+// Access log appended to by a background thread.  Each server logging to it
+// formats a line per completed request into a ring buffer of its own, which
+// the thread drains in batches; lines that do not fit are dropped and
+// counted rather than making the event loop wait.
+//
+// In the format, $time, $status (the application's), $bytes_in (stdin),
+// $bytes_out (stdout and stderr) and $duration_us are replaced by those
+// values, and any other $NAME by the request param NAME, or "-".
+//
+// The thread does not survive fork(), so in prefork mode each worker makes
+// its own log once prefork() has returned.
+class FastCGIAccessLog {
+public:
+    explicit FastCGIAccessLog(const std::string& path,
+        const std::string& format = "$time $REMOTE_ADDR \"$REQUEST_METHOD $REQUEST_URI\" "
+                                    "$status $bytes_out $duration_us",
+        std::size_t ring_bytes = 1 << 20);
+    ~FastCGIAccessLog();                    // writes what is left
+
+    FastCGIAccessLog(const FastCGIAccessLog&) = delete;
+    FastCGIAccessLog& operator=(const FastCGIAccessLog&) = delete;
+
+    unsigned long dropped() const;
+
+private:
+    // single producer, single consumer; holds whole lines
+    struct Ring {
+        explicit Ring(std::size_t bytes);
+
+        bool push(const std::string& line);
+        void drain(std::string& out);
+
+        std::vector<char> buffer;
+        std::size_t mask;
+        std::atomic<std::size_t> head;      // written by the server
+        std::atomic<std::size_t> tail;      // written by the log thread
+        std::atomic<unsigned long> dropped;
+    };
+
+    struct Field {
+        enum Kind { text, time, status, bytes_in, bytes_out, duration, param };
+        Kind kind;
+        std::string value;
+    };
+
+    Ring& add_ring();
+    void run();
+
+    int file;
+    pid_t owner;                            // the process running the thread
+    std::vector<Field> fields;
+    std::size_t ring_bytes;
+    mutable std::mutex mutex;               // guards rings and stop
+    std::condition_variable wakeup;
+    std::list<Ring> rings;
+    bool stop;
+    std::thread writer;
+
+    friend class FastCGIServerBase;
+};
+
+
+// Servers whose event loops run in separate threads and even out their load
+// by passing idle keep-alive connections from busy loops to idle ones.
+// Servers join with FastCGIServerBase::join_group() before their threads
+// start, and the group must outlive them.
+class FastCGILoopGroup {
+public:
+    FastCGILoopGroup() = default;
+    FastCGILoopGroup(const FastCGILoopGroup&) = delete;
+    FastCGILoopGroup& operator=(const FastCGILoopGroup&) = delete;
+
+private:
+    std::vector<FastCGIServerBase*> loops;
+
+    friend class FastCGIServerBase;
+};
+
+
+// The protocol engine shared by all servers: sockets, connections, record
+// parsing and the write scheduler.  Handlers are dispatched by the derived
+// BasicFastCGIServer.
+class FastCGIServerBase {
+public:
+    FastCGIServerBase();
+    virtual ~FastCGIServerBase();
+
+    // Load shedding: new requests are refused with FCGI_OVERLOADED while
+    // max_requests or more are in flight, or after an iteration of the
+    // event loop that was busy handling events for more than max_busy_ms.
+    // That busy time is as long as input arriving during the iteration had
+    // to wait for it.  A negative value disables that check.
+    void overload_limits(int max_requests, int max_busy_ms = -1);
+    // Adaptive alternative to max_busy_ms in the manner of CoDel: once the
+    // busy time has stayed above target_ms for interval_ms, requests are
+    // refused at a rate that grows until it drops below target again.
+    void overload_adaptive(int target_ms, int interval_ms = 100);
+    // Limit on the bytes buffered for all connections together.  Over it,
+    // new requests are refused and the connections holding the most stop
+    // being read from until enough has drained; 0 means no limit.  Requests
+    // on those connections still waiting for input are answered with 503
+    // instead, or their connection closed if their response has begun.
+    void memory_budget(std::string::size_type bytes);
+
+    // Output of requests multiplexed on one connection is interleaved in
+    // chunks of up to this many bytes, so that small responses need not wait
+    // behind large ones; 0 sends each request's pending output in one go.
+    void output_quantum(std::string::size_type bytes);
+
+    // Lazy params: instead of decoding every pair into params, only note
+    // where each lies in the raw stream.  Handlers then read them with
+    // FastCGIRequest::param().
+    void lazy_params(bool lazy = true);
+
+    // Requests whose params add up to more than this many bytes are
+    // answered with 431 as soon as they exceed it; 0 means no limit.
+    void params_limit(std::string::size_type bytes);
+
+    // Response cache in front of the request handler.  Requests without a
+    // body are looked up by the values of key_params; responses are kept
+    // only if their handler calls FastCGIRequest::cache_for(), and the least
+    // recently used are evicted to stay within memory_limit bytes.  A key
+    // param written as "NAME:N" uses only the first N bytes of the value;
+    // anything else after the colon throws std::invalid_argument.
+    void response_cache(const std::vector<std::string>& key_params, std::string::size_type memory_limit);
+
+    // Decision cache for the Authorizer role, keyed like response_cache(),
+    // e.g. {"HTTP_COOKIE", "REQUEST_URI:16"}.  Decisions that grant access
+    // (no Status, or Status 200) are kept for ttl_seconds unless the handler
+    // calls cache_for() to change that; denials are always asked again.
+    void authorizer_cache(const std::vector<std::string>& key_params, int ttl_seconds,
+                          std::string::size_type memory_limit);
+
+    // Single-flight coalescing: a request without a body whose key_params
+    // match one already being handled is parked instead of dispatched, and
+    // receives a copy of that request's output and status when it ends.
+    void coalesce_requests(const std::vector<std::string>& key_params);
+
+    // Rate limiting by the value of key_param, e.g. REMOTE_ADDR: each value
+    // may make burst requests at once and rate more per second after that.
+    // Requests over the limit are answered with 429 as soon as their params
+    // are complete, or refused with FCGI_OVERLOADED if refuse is set, and
+    // reach no handler.  Requests without key_param are not limited.  The
+    // table holds max_clients values, rounded up to a power of two, but a
+    // value may only go in one of 8 places, so a new one can push out the
+    // least recently limited of those before the table is full.  Throws
+    // std::invalid_argument unless a burst takes at most a year to refill.
+    // An empty key_param turns the limit off.
+    void rate_limit(const std::string& key_param, double rate, double burst,
+                    std::size_t max_clients = 65536, bool refuse = false);
+
+    struct Stats {
+        Stats();
+
+        unsigned long requests_active;  // begun but not yet finished
+        unsigned long requests_shed;    // refused with FCGI_OVERLOADED
+        std::string::size_type bytes_buffered; // by connections and requests
+        long loop_busy_us;              // handling events in the last iteration
+        unsigned long cache_hits;       // answered by the response cache
+        unsigned long cache_misses;
+        unsigned long requests_coalesced; // answered by another's handlers
+        unsigned long authorizations;   // decided by the handler
+        unsigned long authorizations_cached; // answered by the decision cache
+        unsigned long requests_limited; // over the rate limit
+        unsigned long capture_dropped;  // reads left out of the capture
+    };
+    const Stats& stats() const { return statistics; }
+
     void listen(unsigned tcp_port);
     void listen(const std::string& local_path);
     void abandon_files();
 
+    // Listens on a socket that is already bound and listening.  Throws if
+    // it is not a listening stream socket, which the caller still owns then.
+    void adopt(int listen_fd);
+    // Adopts the sockets passed by systemd-style socket activation
+    // (LISTEN_PID and LISTEN_FDS), skipping any that are not listening
+    // stream sockets.  Returns how many were adopted.
+    unsigned listen_inherited();
+
+    // Zero-downtime restart.  offer_handoff() waits on a local socket for a
+    // successor process, which calls take_over() with the same path to
+    // receive the listening sockets over SCM_RIGHTS.  This server then stops
+    // accepting, finishes the requests in flight, and closes its idle
+    // connections; drained() tells when it is done.  take_over() returns the
+    // number of sockets received, and throws if no server is offering them.
+    void offer_handoff(const std::string& local_path);
+    unsigned take_over(const std::string& local_path);
+    bool drained() const { return handed_off && read_sockets.empty(); }
+
     void process(int timeout_ms = -1); // timeout_ms<0 blocks forever
-    void process_forever();
+    void process_forever();                 // returns once drained()
+
+    // Prefork mode, for handlers that are not thread-safe: forks between
+    // min_workers and max_workers processes that share the listeners,
+    // respawns any that die, and adds or retires workers by how many are
+    // busy.  Returns true in each worker, which should go on to call
+    // process_forever(), and false in the supervisor once SIGTERM or SIGINT
+    // has stopped it and its workers.  Throws std::logic_error if an access
+    // log is set, which workers must make their own.  A worker stops
+    // accepting on SIGTERM, and its process_forever() returns once its
+    // requests are finished and its connections closed, as after
+    // offer_handoff().
+    bool prefork(unsigned min_workers, unsigned max_workers);
+
+    // Publishes the state of this server in the given slot of a scoreboard
+    // file, which is created with the given number of slots if needed.  In
+    // prefork mode, worker i uses slot i instead.  The state the server waits
+    // in and the start of its oldest request lag by up to 10 ms, as working
+    // them out takes a walk over its connections.  See tools/.
+    void scoreboard(const std::string& path, unsigned slots, unsigned slot = 0);
+
+    // Joins a group of event loops that rebalance connections.  An idle
+    // loop asks the one with the most connections for an idle connection,
+    // which that loop hands over between requests through a lock-free queue.
+    void join_group(FastCGILoopGroup& group);
+
+    // Logs each completed request to log, which must outlive this server.
+    void access_log(FastCGIAccessLog& log);
+
+    // Records all input read from connections to a new file at path, with
+    // timestamps, for replaying with tools/fcgicc_replay.  A background
+    // thread writes the file from a ring of ring_bytes; a read that does not
+    // fit is dropped and counted in capture_dropped, and so is the rest of
+    // its connection's input.  In prefork mode, call this before prefork():
+    // the workers then share the file and number their connections apart.
+    void capture(const std::string& path, std::size_t ring_bytes = 1 << 22);
 
 protected:
     static void FileID_cleanup(int &id);
@@ -150,13 +614,37 @@ protected:
     struct RequestInfo : FastCGIRequest {
         RequestInfo();
 
-        std::string params_buffer;
+        std::string params_buffer;          // an incomplete pair
+        std::string::size_type params_size;
         bool params_closed;
+        std::string data;                   // filter data ahead of the params
+        bool data_closed;
         bool in_closed;
+        bool no_stdin;                      // an authorizer's stdin is closed
         int status;
+        bool answered;                      // response known without handlers
+        bool parked;                        // waiting for a coalesced request, a backend or a batch
         bool output_closed;
+        std::string::size_type deficit;     // for the write scheduler
+        std::string cache_key;
+        std::string flight_key;             // set while leading or parked
+        bool capture;                       // keep a copy of the response
+        std::string captured;               // as framed stdout records
+        std::string captured_err;
+        std::chrono::steady_clock::time_point begun; // set when logging
+        long long start_us;                 // system clock, set with a scoreboard
+        std::unique_ptr<FastCGIMultipart> multipart; // parsing stdin into parts
+        std::string::size_type bytes_in;
+        std::string::size_type bytes_out;
 
-        friend class FastCGIServer;
+        // whether handlers are still to be called
+        bool running() const { return status == 0 && !answered && !parked; }
+        // whether all of the response is known
+        bool done() const {
+            return params_closed && !parked && ((in_closed && data_closed) || !running());
+        }
+
+        friend class FastCGIServerBase;
     };
 
     typedef unsigned RequestID;
@@ -171,27 +659,608 @@ protected:
         std::string output_buffer;
         bool close_responsibility;
         bool close_socket;
+        RequestID next_turn;                // where the write scheduler resumes
+        unsigned parked;                    // requests waiting for others
+        bool wake;                          // output arrived from elsewhere
+        bool paused;                        // not read while over budget
+        std::string::size_type counted;     // in bytes_buffered, with a budget
+        bool reset;                         // by the peer; output is dropped
+        unsigned capture_id;                // 0 until input is captured, ~0u
+                                            // once some was dropped
+
+        std::string::size_type buffered() const;
+    };
+
+    // A complete record at the front of a connection's input.  The records
+    // that reach handlers are told apart here, so that dispatch code does
+    // not need the protocol constants.
+    struct Record {
+        enum Kind { params_record, stdin_record, data_record, other_record };
+
+        Kind kind;
+        unsigned char type;
+        RequestID request_id;
+        const char* content;
+        std::string::size_type length;
     };
 
     typedef std::map<std::string, std::string> Pairs;
     typedef std::unique_ptr<Connection> ConnectionPtr;
+    typedef std::chrono::steady_clock Clock;
+
+    // Framed stdout records of complete responses, with the request id of
+    // the request that made them, which is rewritten for each request they
+    // answer, under a key made of selected params.  Least recently used entries are
+    // evicted first once the memory limit is reached.
+    class ResponseCache {
+    public:
+        ResponseCache();
+
+        void configure(const std::vector<std::string>& key_params, std::string::size_type memory_limit);
+        bool enabled() const { return !params.empty(); }
+        std::string key(const FastCGIRequest&) const;
+
+        const std::string* find(const std::string& key, Clock::time_point now);
+        void store(const std::string& key, const std::string& records, Clock::time_point expires);
+
+    private:
+        struct Entry {
+            std::string key;
+            std::string records;
+            Clock::time_point expires;
+        };
+        typedef std::list<Entry> Entries;
+
+        void erase(Entries::iterator);
+
+        std::vector<std::pair<std::string, std::string::size_type>> params; // name, prefix
+        std::string::size_type limit;
+        std::string::size_type used;
+        Entries entries;                    // most recently used first
+        std::unordered_map<std::string, Entries::iterator> index;
+    };
+
+    // Token buckets in the form of the generic cell rate algorithm: a
+    // bucket is only the time at which it will be full again, refilled
+    // lazily by comparing that with the current time, and a bucket whose
+    // time has passed is idle and may be reused.  Buckets live in a fixed
+    // table, found by hash within a short probe window, so a check touches
+    // a couple of cache lines and the key of the bucket whose hash matches,
+    // and allocates at most when a long key takes over a bucket.
+    class RateLimiter {
+    public:
+        RateLimiter();
+
+        void configure(const std::string& key_param, double rate, double burst,
+                       std::size_t max_clients, bool refuse);
+        bool enabled() const { return !param.empty(); }
+        bool allow(std::string_view key, Clock::time_point now);
+
+        std::string param;
+        bool refuse;                        // with FCGI_OVERLOADED, not 429
+
+    private:
+        struct Bucket {
+            std::size_t hash;               // 0 if unused
+            Clock::time_point full;         // when the bucket is full again
+        };
+
+        std::vector<Bucket> buckets;        // a power of two of them
+        std::vector<std::string> keys;      // of the buckets, checked on a hash match
+        Clock::duration interval;           // per token
+        Clock::duration tolerance;          // burst - 1 tokens
+    };
 
     std::vector<FileID<int>> listen_sockets;
     std::vector<FileID<std::string>> listen_unlink;
+    FileID<int> handoff_socket;
+    std::string handoff_path;
+    bool handed_off;
 
     std::map<FileID<int>, ConnectionPtr, FileID_less<int>> read_sockets;
 
-    void process_connection_read(Connection&);
-    static void process_write_request(Connection&, RequestID, RequestInfo&);
-    static void process_connection_write(Connection&);
+    // a connection on its way from another loop of the group
+    struct Handoff {
+        decltype(read_sockets)::node_type node;
+        Handoff* next;
+    };
+
+    FastCGILoopGroup* group;
+    unsigned group_index;
+    std::atomic<std::size_t> group_load;    // connections, published for the group
+    std::atomic<unsigned> steal_request;    // index + 1 of the loop asking
+    FastCGIServerBase* asked;               // the loop this one asked last
+    std::atomic<Handoff*> incoming;         // pushed by other loops
+    FileID<int> wake_read;                  // pipe to interrupt select()
+    FileID<int> wake_write;
+
+    struct Overload {
+        Overload();
+
+        int max_requests;
+        Clock::duration max_busy;
+        Clock::duration target;         // adaptive mode when non-zero
+        Clock::duration interval;
+        std::string::size_type budget;  // 0 when unlimited
+
+        Clock::time_point first_above;  // when busy time must stay above target
+        Clock::time_point drop_next;
+        unsigned long drop_count;
+        bool dropping;
+    };
+
+    // shared between a prefork worker and its supervisor
+    struct WorkerSlot {
+        WorkerSlot() : busy(false) {}
+
+        std::atomic<bool> busy;
+    };
+
+    // a request being handled on behalf of identical ones
+    struct Flight {
+        RequestInfo* leader;
+        std::vector<std::pair<Connection*, RequestInfo*>> followers;
+    };
+
+    Overload overload;
+    Stats statistics;
+    Clock::duration loop_busy;
+    std::string::size_type quantum;
+    bool params_lazy;
+    std::string::size_type max_params;
+    ResponseCache cache;
+    ResponseCache decisions;
+    RateLimiter limiter;
+    int decision_ttl;
+    std::vector<std::string> coalesce_params;
+    std::unordered_map<std::string, Flight> flights;
+    std::vector<std::pair<Connection*, RequestInfo*>> batch; // ready this iteration
+    std::vector<std::pair<Connection*, RequestInfo*>> promoted; // new flight leaders
+    WorkerSlot* worker;                     // set in prefork workers
+    volatile sig_atomic_t stop_requested;   // by SIGTERM or SIGINT in prefork mode
+    FastCGIScoreboard* board;
+    FastCGIScoreboard::Slot* board_slot;    // written by this server
+    bool board_stale;                       // something happened since update_board()
+    Clock::time_point board_updated;
+    FastCGIAccessLog* log;
+    FastCGIAccessLog::Ring* log_ring;
+
+    // Writes captured input in a thread of its own, which the first input
+    // starts in the process that reads it.
+    struct CaptureWriter {
+        CaptureWriter(int file, std::size_t ring_bytes);
+        ~CaptureWriter();                   // writes what is left
+
+        void run();
+
+        int file;
+        FastCGIAccessLog::Ring ring;
+        std::mutex mutex;                   // guards stop
+        std::condition_variable wakeup;
+        bool stop;
+        std::thread thread;
+    };
+
+    FileID<int> capture_file;
+    Clock::time_point capture_start;
+    std::size_t capture_ring_bytes;
+    std::atomic<unsigned>* capture_ids;     // the last given, shared with workers
+    std::unique_ptr<CaptureWriter> capture_writer;
+    std::string capture_chunk;              // being pushed to the ring
+
+    bool overloaded();
+    void hand_off();
+    void log_request(const RequestInfo&);
+    void capture_input(Connection&, const char* data, std::string::size_type size);
+    void apply_budget();
+    void recount(Connection&);
+    void refuse_input(Connection&);
+    static void trim(std::string&);
+    void balance();
+    void receive_connections();
+    void wake_loop();
+    void start_worker(WorkerSlot&, unsigned index);
+    void update_worker();
+    void claim_slot(unsigned index);
+    void update_board();
+    void set_state(FastCGIScoreboard::State state) {
+        if (board_slot)
+            board_slot->state.store(state, std::memory_order_relaxed);
+    }
+    static void add(std::atomic<unsigned long long>& counter, unsigned long long n) {
+        // single writer, so no read-modify-write is needed
+        counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+    static bool has_body(const RequestInfo&);
+    static void answer(RequestInfo&, const char* status);
+    static bool replace_output(RequestInfo&, const char* status);
+    bool answer_from_cache(RequestInfo&);
+    bool rate_limited(Connection&, RequestInfo&);
+    static bool answer_from(ResponseCache&, RequestInfo&, unsigned long& hits, unsigned long& misses);
+    bool join_flight(Connection&, RequestInfo&);
+    void land_flight(RequestInfo&);
+    virtual void forget_request(RequestInfo&);
+    static void set_request_id(std::string& records, RequestID, std::string::size_type from = 0);
+    static void append_key(std::string& key, std::string_view part);
+    static void append_records(RequestInfo&, std::string_view records);
+
+    // other descriptors for the event loop to wait on, e.g. connections to
+    // backends; add_descriptors() returns the highest or -1
+    virtual int add_descriptors(fd_set&, fd_set&) { return -1; }
+    virtual void process_descriptors(const fd_set&, const fd_set&) {}
+
+    // consumes input records and runs the application's handlers
+    virtual void process_connection_read(Connection&) = 0;
+    // runs the handlers for a request whose params are complete
+    virtual void dispatch(RequestInfo&) = 0;
+    // the same for the requests held by hold() during one iteration
+    virtual void dispatch_batch(const std::vector<RequestInfo*>&) {}
+    void hold(Connection&, RequestInfo&);
+    void run_batch();
+    void run_promoted();
+    bool next_record(Connection&, std::string::size_type& offset, Record&);
+    void process_record(Connection&, const Record&);
+    RequestInfo* read_params(Connection&, const Record&);
+    static RequestInfo* find_request(Connection&, RequestID);
+
+    std::string::size_type process_write_request(Connection&, RequestID, RequestInfo&,
+                                                 std::string::size_type budget);
+    static bool output_pending(const RequestInfo&);
+    static void compact_output(RequestInfo&);
+    std::string::size_type frame_out(Connection&, RequestID, RequestInfo&, std::string::size_type n);
+    void process_connection_write(Connection&);
+    static bool next_pair(const char*, std::string::size_type size, std::string::size_type& offset,
+                          std::string::size_type& name_length, std::string::size_type& value_length);
     static Pairs parse_pairs(const char*, std::string::size_type);
+    void read_pairs(RequestInfo&, const char*, std::string::size_type);
+    static void index_pairs(RequestInfo&);
     static void write_pair(std::string& buffer, const std::string& key, const std::string&);
     static void write_data(std::string& buffer, RequestID id, const std::string& input, unsigned char type);
+    static void write_data(std::string& buffer, RequestID id, const char* input, std::string::size_type size,
+                           unsigned char type);
+    static void write_end_request(std::string& buffer, RequestID id, int status, unsigned char protocol_status);
+
+    // shares the record framing
+    friend class FastCGIClient;
+};
+
+
+// A server whose handlers are the member functions of App, resolved at
+// compile time.  App may define any of
+//
+//     int handle_request(FastCGIRequest&);
+//     int handle_data(FastCGIRequest&);
+//     int handle_chunk(FastCGIRequest&, std::string_view);
+//     int handle_part(FastCGIRequest&, const FastCGIMultipart::Headers&);
+//     int handle_part_data(FastCGIRequest&, std::string_view);
+//     int handle_complete(FastCGIRequest&);
+//     int handle_batch(const std::vector<FastCGIRequest*>&);
+//
+// with the meanings of the corresponding FastCGIServer handlers below;
+// those it leaves out cost nothing.  An App with handle_chunk() may also
+// define bool chunked() to choose between it and handle_data() at run time,
+// and one with handle_part() bool multipart() likewise, and one with
+// handle_batch() bool batched().
+template<class App>
+class BasicFastCGIServer : public FastCGIServerBase {
+public:
+    template<class... Args>
+    explicit BasicFastCGIServer(Args&&... args) : app(std::forward<Args>(args)...) {}
 
+    App& application() { return app; }
 
+protected:
+    App app;
+
+    void process_connection_read(Connection&) override;
+    void dispatch(RequestInfo& request) override { run_request(request); }
+    void dispatch_batch(const std::vector<RequestInfo*>&) override;
+    void run_request(RequestInfo&);
+    int feed_parts(RequestInfo&, std::string_view);
+    int complete(RequestInfo&);
+
+    // Each call_*() resolves to the App's handler when it has one, and to
+    // a constant otherwise.
+    template<class A>
+    static auto call_request(A& a, FastCGIRequest& r, int) -> decltype(a.handle_request(r)) {
+        return a.handle_request(r);
+    }
+    template<class A>
+    static int call_request(A&, FastCGIRequest&, long) { return 0; }
+
+    template<class A>
+    static auto call_data(A& a, FastCGIRequest& r, int) -> decltype(a.handle_data(r)) {
+        return a.handle_data(r);
+    }
+    template<class A>
+    static int call_data(A&, FastCGIRequest&, long) { return 0; }
+
+    template<class A>
+    static auto call_chunk(A& a, FastCGIRequest& r, std::string_view chunk, int) ->
+            decltype(a.handle_chunk(r, chunk)) {
+        return a.handle_chunk(r, chunk);
+    }
+    template<class A>
+    static int call_chunk(A&, FastCGIRequest&, std::string_view, long) { return 0; }
+
+    template<class A>
+    static auto call_data_stream(A& a, FastCGIRequest& r, std::string_view chunk, int) ->
+            decltype(a.handle_data_stream(r, chunk)) {
+        return a.handle_data_stream(r, chunk);
+    }
+    template<class A>
+    static int call_data_stream(A&, FastCGIRequest&, std::string_view, long) { return 0; }
+
+    template<class A>
+    static auto call_part(A& a, FastCGIRequest& r, const FastCGIMultipart::Headers& h, int) ->
+            decltype(a.handle_part(r, h)) {
+        return a.handle_part(r, h);
+    }
+    template<class A>
+    static int call_part(A&, FastCGIRequest&, const FastCGIMultipart::Headers&, long) { return 0; }
+
+    template<class A>
+    static auto call_part_data(A& a, FastCGIRequest& r, std::string_view data, int) ->
+            decltype(a.handle_part_data(r, data)) {
+        return a.handle_part_data(r, data);
+    }
+    template<class A>
+    static int call_part_data(A&, FastCGIRequest&, std::string_view, long) { return 0; }
+
+    template<class A>
+    static auto call_complete(A& a, FastCGIRequest& r, int) -> decltype(a.handle_complete(r)) {
+        return a.handle_complete(r);
+    }
+    template<class A>
+    static int call_complete(A&, FastCGIRequest&, long) { return 0; }
+
+    template<class A>
+    static auto call_batch(A& a, const std::vector<FastCGIRequest*>& r, int) -> decltype(a.handle_batch(r)) {
+        return a.handle_batch(r);
+    }
+    template<class A>
+    static int call_batch(A&, const std::vector<FastCGIRequest*>&, long) { return 0; }
+
+    template<class A>
+    static auto chunked(A& a, int) -> decltype(bool(a.chunked())) {
+        return a.chunked();
+    }
+    template<class A>
+    static auto chunked(A& a, long) -> decltype(a.handle_chunk(std::declval<FastCGIRequest&>(), std::string_view()),
+                                                bool()) {
+        return true;
+    }
+    template<class A>
+    static bool chunked(A&, ...) { return false; }
+
+    template<class A>
+    static auto multipart(A& a, int) -> decltype(bool(a.multipart())) {
+        return a.multipart();
+    }
+    template<class A>
+    static auto multipart(A& a, long) -> decltype(a.handle_part(std::declval<FastCGIRequest&>(),
+                                                                std::declval<const FastCGIMultipart::Headers&>()),
+                                                  bool()) {
+        return true;
+    }
+    template<class A>
+    static bool multipart(A&, ...) { return false; }
+
+    template<class A>
+    static auto batched(A& a, int) -> decltype(bool(a.batched())) {
+        return a.batched();
+    }
+    template<class A>
+    static auto batched(A& a, long) -> decltype(a.handle_batch(std::declval<const std::vector<FastCGIRequest*>&>()),
+                                                bool()) {
+        return true;
+    }
+    template<class A>
+    static bool batched(A&, ...) { return false; }
+};
+
+
+template<class App>
+void
+BasicFastCGIServer<App>::process_connection_read(Connection& connection)
+{
+    std::string::size_type n = 0;
+    Record record;
+    while (next_record(connection, n, record)) {
+        switch (record.kind)
+        {
+        case Record::params_record:
+            {
+                RequestInfo* request = read_params(connection, record);
+                if (request && !rate_limited(connection, *request) && !answer_from_cache(*request) &&
+                        !join_flight(connection, *request)) {
+                    if (batched(app, 0))
+                        hold(connection, *request);
+                    else
+                        run_request(*request);
+                }
+                break;
+            }
+
+        case Record::stdin_record:
+            {
+                RequestInfo* request = find_request(connection, record.request_id);
+                if (!request || request->in_closed)
+                    break;
+                request->bytes_in += record.length;
+
+                if (record.length != 0) {
+                    if (!request->params_closed || request->parked)
+                        request->in.append(record.content, record.length);
+                    else if (request->running()) {
+                        compact_output(*request);
+                        set_state(FastCGIScoreboard::in_handler);
+                        if (request->multipart)
+                            request->status = feed_parts(*request, std::string_view(record.content, record.length));
+                        else if (chunked(app, 0))
+                            request->status = call_chunk(app, *request,
+                                std::string_view(record.content, record.length), 0);
+                        else {
+                            request->in.append(record.content, record.length);
+                            request->status = call_data(app, *request, 0);
+                        }
+                    }
+                } else {
+                    request->in_closed = true;
+                    if (request->params_closed && request->data_closed && request->running()) {
+                        compact_output(*request);
+                        set_state(FastCGIScoreboard::in_handler);
+                        request->status = complete(*request);
+                    }
+                }
+                break;
+            }
+
+        case Record::data_record:
+            {
+                RequestInfo* request = find_request(connection, record.request_id);
+                if (!request || request->data_closed)
+                    break;
+
+                if (record.length != 0) {
+                    if (!request->params_closed || request->parked)
+                        request->data.append(record.content, record.length);
+                    else if (request->running()) {
+                        compact_output(*request);
+                        set_state(FastCGIScoreboard::in_handler);
+                        request->status = call_data_stream(app, *request,
+                            std::string_view(record.content, record.length), 0);
+                    }
+                } else {
+                    request->data_closed = true;
+                    if (request->params_closed && request->in_closed && request->running()) {
+                        compact_output(*request);
+                        set_state(FastCGIScoreboard::in_handler);
+                        request->status = complete(*request);
+                    }
+                }
+                break;
+            }
+
+        default:
+            process_record(connection, record);
+        }
+    }
+
+    connection.input_buffer.erase(0, n);
+    trim(connection.input_buffer);
+    process_connection_write(connection);
+}
+
+
+template<class App>
+void
+BasicFastCGIServer<App>::run_request(RequestInfo& request)
+{
+    set_state(FastCGIScoreboard::in_handler);
+    request.status = call_request(app, request, 0);
+    if (request.status == 0 && multipart(app, 0)) {
+        std::optional<std::string_view> type = request.param("CONTENT_TYPE");
+        std::string boundary = FastCGIMultipart::boundary(type.value_or(std::string_view()));
+        if (!boundary.empty())
+            request.multipart.reset(new FastCGIMultipart(boundary));
+    }
+    if (request.status == 0 && !request.in.empty()) {
+        if (request.multipart) {
+            std::string in;
+            in.swap(request.in);
+            request.status = feed_parts(request, in);
+        } else if (chunked(app, 0)) {
+            // stdin that arrived ahead of the params
+            std::string in;
+            in.swap(request.in);
+            request.status = call_chunk(app, request, in, 0);
+        } else
+            request.status = call_data(app, request, 0);
+    }
+    if (request.status == 0 && !request.data.empty()) {
+        std::string data;
+        data.swap(request.data);
+        request.status = call_data_stream(app, request, data, 0);
+    }
+    if (request.status == 0 && request.in_closed && request.data_closed)
+        request.status = complete(request);
+}
+
+
+// Runs the batch handler over the requests that became ready together, and
+// then each one's own handlers.  A non-zero status from the batch handler
+// ends all of them.
+template<class App>
+void
+BasicFastCGIServer<App>::dispatch_batch(const std::vector<RequestInfo*>& requests)
+{
+    std::vector<FastCGIRequest*> batch_requests(requests.begin(), requests.end());
+    set_state(FastCGIScoreboard::in_handler);
+    int status = call_batch(app, batch_requests, 0);
+    for (RequestInfo* request : requests) {
+        if (status != 0)
+            request->status = status;
+        else
+            run_request(*request);
+    }
+}
+
+
+// Runs the part handlers over the next piece of a multipart body; a
+// malformed body is answered with 400 instead of completing, or ends with
+// status 1 if the response has begun.
+template<class App>
+int
+BasicFastCGIServer<App>::feed_parts(RequestInfo& request, std::string_view input)
+{
+    FastCGIMultipart::Handlers handlers;
+    handlers.part = [this, &request](const FastCGIMultipart::Headers& headers) {
+        return call_part(app, request, headers, 0);
+    };
+    handlers.data = [this, &request](std::string_view data) {
+        return call_part_data(app, request, data, 0);
+    };
+    int status = request.multipart->feed(input, handlers);
+    if (status == 0 && request.multipart->failed() && !request.answered &&
+            !replace_output(request, "400 Bad Request"))
+        status = 1;
+    return status;
+}
+
+
+// Runs the complete handler once all input has arrived, unless a multipart
+// body ended before its closing delimiter, which is answered with 400 as
+// in feed_parts().
+template<class App>
+int
+BasicFastCGIServer<App>::complete(RequestInfo& request)
+{
+    if (request.multipart && !request.multipart->done())
+        return request.answered || replace_output(request, "400 Bad Request") ? 0 : 1;
+    return call_complete(app, request, 0);
+}
+
+
+// The handlers of a FastCGIServer, registered at run time.
+class FastCGIHandlers {
+public:
+    int handle_request(FastCGIRequest& r) { return request ? (*request)(r) : 0; }
+    int handle_data(FastCGIRequest& r) { return data ? (*data)(r) : 0; }
+    int handle_chunk(FastCGIRequest& r, std::string_view c) { return chunk ? (*chunk)(r, c) : 0; }
+    int handle_data_stream(FastCGIRequest& r, std::string_view c) { return data_stream ? (*data_stream)(r, c) : 0; }
+    int handle_part(FastCGIRequest& r, const FastCGIMultipart::Headers& h) { return part ? (*part)(r, h) : 0; }
+    int handle_part_data(FastCGIRequest& r, std::string_view c) { return part_data ? (*part_data)(r, c) : 0; }
+    int handle_complete(FastCGIRequest& r) { return complete ? (*complete)(r) : 0; }
+    bool chunked() const { return bool(chunk); }
+    int handle_batch(const std::vector<FastCGIRequest*>& r) { return batch ? (*batch)(r) : 0; }
+    bool multipart() const { return bool(part); }
+    bool batched() const { return bool(batch); }
+
+protected:
     struct HandlerBase {
         virtual ~HandlerBase() = default;
-        virtual int operator()(FastCGIRequest&);
+        virtual int operator()(FastCGIRequest&) = 0;
     };
 
     struct StaticHandler : public HandlerBase {
@@ -216,11 +1285,333 @@ protected:
         int (C::* function)(FastCGIRequest&);
     };
 
+    struct ChunkHandlerBase {
+        virtual ~ChunkHandlerBase() = default;
+        virtual int operator()(FastCGIRequest&, std::string_view) = 0;
+    };
+
+    struct StaticChunkHandler : public ChunkHandlerBase {
+        explicit StaticChunkHandler(int (* p_function)(FastCGIRequest&, std::string_view)) :
+            function(p_function) {}
+        int operator()(FastCGIRequest& request, std::string_view chunk) override {
+            return function(request, chunk);
+        }
+
+        int (* function)(FastCGIRequest&, std::string_view);
+    };
+
+    template<class C>
+    struct ChunkHandler : public ChunkHandlerBase {
+        explicit ChunkHandler(C& p_object, int (C::* p_function)(FastCGIRequest&, std::string_view)) :
+            object(p_object), function(p_function) {}
+        int operator()(FastCGIRequest& request, std::string_view chunk) override {
+            return (object.*function)(request, chunk);
+        }
+
+        C& object;
+        int (C::* function)(FastCGIRequest&, std::string_view);
+    };
+
+    struct PartHandlerBase {
+        virtual ~PartHandlerBase() = default;
+        virtual int operator()(FastCGIRequest&, const FastCGIMultipart::Headers&) = 0;
+    };
+
+    struct StaticPartHandler : public PartHandlerBase {
+        explicit StaticPartHandler(int (* p_function)(FastCGIRequest&, const FastCGIMultipart::Headers&)) :
+            function(p_function) {}
+        int operator()(FastCGIRequest& request, const FastCGIMultipart::Headers& headers) override {
+            return function(request, headers);
+        }
+
+        int (* function)(FastCGIRequest&, const FastCGIMultipart::Headers&);
+    };
+
+    template<class C>
+    struct PartHandler : public PartHandlerBase {
+        explicit PartHandler(C& p_object, int (C::* p_function)(FastCGIRequest&, const FastCGIMultipart::Headers&)) :
+            object(p_object), function(p_function) {}
+        int operator()(FastCGIRequest& request, const FastCGIMultipart::Headers& headers) override {
+            return (object.*function)(request, headers);
+        }
+
+        C& object;
+        int (C::* function)(FastCGIRequest&, const FastCGIMultipart::Headers&);
+    };
+
+    struct BatchHandlerBase {
+        virtual ~BatchHandlerBase() = default;
+        virtual int operator()(const std::vector<FastCGIRequest*>&) = 0;
+    };
+
+    struct StaticBatchHandler : public BatchHandlerBase {
+        explicit StaticBatchHandler(int (* p_function)(const std::vector<FastCGIRequest*>&)) :
+            function(p_function) {}
+        int operator()(const std::vector<FastCGIRequest*>& requests) override {
+            return function(requests);
+        }
+
+        int (* function)(const std::vector<FastCGIRequest*>&);
+    };
+
+    template<class C>
+    struct BatchHandler : public BatchHandlerBase {
+        explicit BatchHandler(C& p_object, int (C::* p_function)(const std::vector<FastCGIRequest*>&)) :
+            object(p_object), function(p_function) {}
+        int operator()(const std::vector<FastCGIRequest*>& requests) override {
+            return (object.*function)(requests);
+        }
+
+        C& object;
+        int (C::* function)(const std::vector<FastCGIRequest*>&);
+    };
+
+    // unset handlers are null and skipped
+    std::unique_ptr<HandlerBase> request;
+    std::unique_ptr<HandlerBase> data;
+    std::unique_ptr<HandlerBase> complete;
+    std::unique_ptr<ChunkHandlerBase> chunk;
+    std::unique_ptr<ChunkHandlerBase> data_stream;
+    std::unique_ptr<PartHandlerBase> part;
+    std::unique_ptr<ChunkHandlerBase> part_data;
+    std::unique_ptr<BatchHandlerBase> batch;
+
+    friend class FastCGIServer;
+};
+
+extern template class BasicFastCGIServer<FastCGIHandlers>;
+
+
+class FastCGIServer : public BasicFastCGIServer<FastCGIHandlers> {
+public:
+    FastCGIServer();
+
+    // called when the parameters and standard input have been receieved
+    void request_handler(int (* function)(FastCGIRequest&));
+    template<class C>
+    void request_handler(C& object, int (C::* function)(FastCGIRequest&)) {
+        set_handler(app.request, new FastCGIHandlers::Handler<C>(object, function));
+    }
+
+    // called when new data appears on stdin
+    void data_handler(int (* function)(FastCGIRequest&));
+    template<class C>
+    void data_handler(C& object, int (C::* function)(FastCGIRequest&)) {
+        set_handler(app.data, new FastCGIHandlers::Handler<C>(object, function));
+    }
+
+    // alternative to data_handler: called with each piece of stdin as it
+    // arrives, pointing into the receive buffer and valid only for the
+    // call; the data is not appended to request.in
+    void chunk_handler(int (* function)(FastCGIRequest&, std::string_view));
+    template<class C>
+    void chunk_handler(C& object, int (C::* function)(FastCGIRequest&, std::string_view)) {
+        app.chunk.reset(new FastCGIHandlers::ChunkHandler<C>(object, function));
+    }
+
+    // Filter role: called with each piece of the FCGI_DATA stream as it
+    // arrives, in the manner of chunk_handler
+    void data_stream_handler(int (* function)(FastCGIRequest&, std::string_view));
+    template<class C>
+    void data_stream_handler(C& object, int (C::* function)(FastCGIRequest&, std::string_view)) {
+        app.data_stream.reset(new FastCGIHandlers::ChunkHandler<C>(object, function));
+    }
+
+    // Multipart bodies: if a part handler is set, a request whose content
+    // type is multipart/form-data has its stdin parsed instead of appended
+    // to request.in.  The part handler is called with the headers of each
+    // part as it begins, and the part data handler with its contents as
+    // they arrive, in the manner of chunk_handler.  A body that is malformed
+    // or ends before its closing delimiter is answered with 400 Bad Request
+    // instead of reaching the complete handler.
+    void part_handler(int (* function)(FastCGIRequest&, const FastCGIMultipart::Headers&));
+    template<class C>
+    void part_handler(C& object, int (C::* function)(FastCGIRequest&, const FastCGIMultipart::Headers&)) {
+        app.part.reset(new FastCGIHandlers::PartHandler<C>(object, function));
+    }
+    void part_data_handler(int (* function)(FastCGIRequest&, std::string_view));
+    template<class C>
+    void part_data_handler(C& object, int (C::* function)(FastCGIRequest&, std::string_view)) {
+        app.part_data.reset(new FastCGIHandlers::ChunkHandler<C>(object, function));
+    }
+
+    // called when the complete request has been received
+    void complete_handler(int (* function)(FastCGIRequest&));
+    template<class C>
+    void complete_handler(C& object, int (C::* function)(FastCGIRequest&)) {
+        set_handler(app.complete, new FastCGIHandlers::Handler<C>(object, function));
+    }
+
+    // Batching: if a batch handler is set, the requests whose params
+    // complete during one process() call are held until its input has been
+    // read, and the batch handler is called with all of them together
+    // before their request handlers, e.g. to fetch what they need in one
+    // round trip.  Their output is queued before process() returns.
+    void batch_handler(int (* function)(const std::vector<FastCGIRequest*>&));
+    template<class C>
+    void batch_handler(C& object, int (C::* function)(const std::vector<FastCGIRequest*>&)) {
+        app.batch.reset(new FastCGIHandlers::BatchHandler<C>(object, function));
+    }
+
+protected:
+    typedef FastCGIHandlers::HandlerBase HandlerBase;
+
     void set_handler(std::unique_ptr<HandlerBase>&, HandlerBase*);
+};
+
+
+// Client for another FastCGI server.  Calls are multiplexed over a pool of
+// FCGI_KEEP_CONN connections to the backend, each taking as many as the
+// backend allows in its reply to FCGI_GET_VALUES, and queued beyond that.
+// process() does the I/O and passes each call's output to its handlers as
+// it arrives; prepare() and dispatch() let another event loop do so.
+class FastCGIClient {
+public:
+    typedef FastCGIRequest::Params Params;
+    typedef unsigned long CallID;
+
+    struct Handlers {
+        std::function<void(std::string_view)> out;  // stdout as it arrives
+        std::function<void(std::string_view)> err;
+        // if set, gets whole stdout and stderr records instead of out and err
+        std::function<void(std::string_view)> records;
+        // with the application and protocol status; the latter is -1 if
+        // the connection failed
+        std::function<void(int, int)> end;
+    };
+
+    // address is "host:port" or the path of a local socket
+    explicit FastCGIClient(const std::string& address, unsigned max_connections = 4);
+    ~FastCGIClient();
+
+    FastCGIClient(const FastCGIClient&) = delete;
+    FastCGIClient& operator=(const FastCGIClient&) = delete;
+
+    // Starts a call with the given stdin, which send_stdin() may add to
+    // until close_stdin() unless stdin_complete.
+    CallID call(const Params& params, Handlers handlers,
+                std::string_view in = std::string_view(), bool stdin_complete = true);
+    void send_stdin(CallID, std::string_view data);
+    void close_stdin(CallID);
+    // no handlers are called for the call after this, even if it is called
+    // from one of them
+    void abort(CallID);
+
+    // Passthrough for relaying: begin() starts a call in the given role
+    // whose params and streams are records already framed, with any request
+    // id, given to send_records().
+    CallID begin(Handlers handlers, unsigned role);
+    void send_records(CallID, std::string_view records);
+
+    // Flow control for relaying: the bytes of the call's connection not
+    // yet sent to the backend, and whether to stop reading from it.
+    std::size_t unsent(CallID) const;
+    void pause(CallID, bool paused);
+
+    std::size_t outstanding() const { return calls.size(); }
+
+    // adds the descriptors to wait for and returns the highest
+    int prepare(fd_set& read, fd_set& write) const;
+    void dispatch(const fd_set& read, const fd_set& write);
+    void process(int timeout_ms = -1);  // timeout_ms<0 blocks forever
+
+private:
+    struct Connection;
+
+    struct Call {
+        Handlers handlers;
+        std::string records;                // with request id 0, until assigned
+        bool in_closed;
+        bool aborted;                       // waiting for END_REQUEST
+        bool paused;
+        Connection* connection;             // null while queued
+        unsigned request_id;
+    };
+
+    struct Connection {
+        int fd;
+        bool connecting;
+        int error;                          // of a connect() that failed at once
+        std::vector<std::string> addresses; // sockaddrs left to try
+        std::string input;
+        std::string output;
+        std::map<unsigned, CallID> requests;
+        unsigned max_requests;              // 1 until the backend tells
+        unsigned paused;                    // calls that hold off reading
+    };
+
+    CallID start(Handlers, unsigned role, const std::string& records, bool in_closed);
+    void open_connection();
+    void connect_next(Connection&);
+    bool assign(CallID, Call&);
+    void assign_waiting();
+    void read_records(Connection&);
+    void fail(std::list<Connection>::iterator);
+
+    std::string address;
+    unsigned max_connections;
+    std::list<Connection> connections;
+    std::map<CallID, Call> calls;
+    std::list<CallID> waiting;
+    CallID next_call;
+};
+
+
+// A server that relays its requests to a pool of backend FastCGI servers.
+// Each request goes to the backend with the fewest outstanding requests,
+// over that backend's persistent, multiplexed connections, and its records
+// are passed through both ways with only the request id rewritten.
+//
+// Health is checked passively: a backend whose connections fail
+// max_failures times in a row is left out for retry_ms, after which a
+// single request tries it again.  Requests that get no response from a
+// backend are answered with 502 Bad Gateway, and those whose response is
+// cut short end with application status 1.
+//
+// Neither side is read from while too much of what it sent waits for the
+// other: a client's connection while its requests' backend connections
+// have a backlog, and a backend connection while a request on it waits
+// for its client to read the response.
+class FastCGIProxy : public FastCGIServerBase {
+public:
+    FastCGIProxy();
+
+    // address is "host:port" or the path of a local socket
+    void backend(const std::string& address, unsigned max_connections = 4);
+    void health_checks(unsigned max_failures, int retry_ms);
+
+protected:
+    struct Backend {
+        Backend(const std::string& address, unsigned max_connections);
+
+        FastCGIClient client;
+        unsigned failures;                  // in a row
+        Clock::time_point retry;            // once left out
+    };
+
+    struct Forward {
+        Connection* connection;
+        Backend* backend;
+        FastCGIClient::CallID call;
+        bool relayed;                       // whether output has arrived
+    };
+
+    void process_connection_read(Connection&) override;
+    void dispatch(RequestInfo&) override {}
+    void forget_request(RequestInfo&) override;
+    int add_descriptors(fd_set&, fd_set&) override;
+    void process_descriptors(const fd_set&, const fd_set&) override;
+
+    Backend* pick_backend();
+    void forward(Connection&, RequestInfo&);
+    void relay(RequestInfo&, std::string_view record);
+    void finish(RequestInfo&, int status, int protocol_status);
+    void failed(Backend&);
 
-    std::unique_ptr<HandlerBase> handle_request;
-    std::unique_ptr<HandlerBase> handle_data;
-    std::unique_ptr<HandlerBase> handle_complete;
+    std::list<Backend> backends;
+    unsigned max_failures;
+    Clock::duration retry_after;
+    std::unordered_map<RequestInfo*, Forward> forwards;
 };
 
 #endif // !FCGICC_H
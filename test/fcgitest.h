@@ -0,0 +1,337 @@
+// vim: set expandtab ts=4 sw=4 :
+/*
+ * Copyright 2024 Chris Frey.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the names of the copyright holders nor the names of contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * This file is part of the FastCGI C++ Class library (fcgicc) version 0.1,
+ * available at http://althenia.net/fcgicc
+ */
+
+/*
+
+Helpers for the tests run by ctest.  Each test runs a server's event loop in
+a thread of its own, talks to it over a local socket in raw FastCGI records,
+and prints "Success!" and exits with 0 if all went as expected.
+
+*/
+
+#ifndef FCGITEST_H
+#define FCGITEST_H
+
+#include <fcgicc.h>
+
+#include <atomic>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <errno.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include <fastcgi.h>
+
+
+namespace fcgitest {
+
+typedef std::vector<std::pair<std::string, std::string>> Pairs;
+
+struct Record {
+    unsigned char type;
+    unsigned id;
+    std::string content;
+};
+
+struct Response {
+    Response() : app_status(0), protocol_status(-1) {}
+
+    std::string out;
+    std::string err;
+    int app_status;
+    int protocol_status;                    // -1 until FCGI_END_REQUEST
+};
+
+
+inline void
+check(bool condition, const std::string& what)
+{
+    if (!condition)
+        throw std::runtime_error(what);
+}
+
+
+// a local socket path of this process
+inline std::string
+socket_path(const std::string& name)
+{
+    return "/tmp/fcgicc_" + name + "_" + std::to_string(getpid()) + ".sock";
+}
+
+
+// Runs a server's event loop until stopped.
+class Loop {
+public:
+    explicit Loop(FastCGIServerBase& server) :
+        stopping(false),
+        thread([this, &server] {
+            while (!stopping)
+                server.process(10);
+        })
+    {
+    }
+    ~Loop() { stop(); }
+
+    void stop() {
+        if (thread.joinable()) {
+            stopping = true;
+            thread.join();
+        }
+    }
+
+private:
+    std::atomic<bool> stopping;
+    std::thread thread;
+};
+
+
+inline std::string
+record(unsigned char type, unsigned id, const std::string& content)
+{
+    check(content.size() <= FCGI_MAX_LENGTH, "record too long");
+    FCGI_Header header;
+    bzero(&header, sizeof(header));
+    header.version = FCGI_VERSION_1;
+    header.type = type;
+    header.requestIdB1 = static_cast<unsigned char>((id >> 8) & 0xff);
+    header.requestIdB0 = static_cast<unsigned char>(id & 0xff);
+    header.contentLengthB1 = static_cast<unsigned char>((content.size() >> 8) & 0xff);
+    header.contentLengthB0 = static_cast<unsigned char>(content.size() & 0xff);
+    header.paddingLength = static_cast<unsigned char>((8 - content.size() % 8) % 8);
+    return std::string(reinterpret_cast<const char*>(&header), sizeof(header)) + content +
+        std::string(header.paddingLength, '\0');
+}
+
+
+inline std::string
+begin(unsigned id, unsigned role = FCGI_RESPONDER, bool keep_conn = true)
+{
+    FCGI_BeginRequestBody body;
+    bzero(&body, sizeof(body));
+    body.roleB1 = static_cast<unsigned char>((role >> 8) & 0xff);
+    body.roleB0 = static_cast<unsigned char>(role & 0xff);
+    body.flags = keep_conn ? FCGI_KEEP_CONN : 0;
+    return record(FCGI_BEGIN_REQUEST, id, std::string(reinterpret_cast<const char*>(&body), sizeof(body)));
+}
+
+
+inline void
+append_length(std::string& s, std::string::size_type length)
+{
+    if (length > 0x7f) {
+        s.push_back(static_cast<char>(0x80 | ((length >> 24) & 0x7f)));
+        s.push_back(static_cast<char>((length >> 16) & 0xff));
+        s.push_back(static_cast<char>((length >> 8) & 0xff));
+        s.push_back(static_cast<char>(length & 0xff));
+    } else
+        s.push_back(static_cast<char>(length));
+}
+
+
+inline std::string
+pairs(const Pairs& list)
+{
+    std::string s;
+    for (auto &[name, value] : list) {
+        append_length(s, name.size());
+        append_length(s, value.size());
+        s.append(name).append(value);
+    }
+    return s;
+}
+
+
+// a stream of the given type, split into records, and its end
+inline std::string
+stream(unsigned char type, unsigned id, const std::string& data)
+{
+    std::string s;
+    for (std::string::size_type n = 0; n < data.size(); n += FCGI_MAX_LENGTH)
+        s.append(record(type, id, data.substr(n, FCGI_MAX_LENGTH)));
+    return s.append(record(type, id, std::string()));
+}
+
+
+// a whole responder request
+inline std::string
+request(unsigned id, const Pairs& params, const std::string& in = std::string())
+{
+    return begin(id) + stream(FCGI_PARAMS, id, pairs(params)) + stream(FCGI_STDIN, id, in);
+}
+
+
+// A connection to the server under test, as a web server would make.
+class Client {
+public:
+    explicit Client(const std::string& path) :
+        fd(socket(PF_UNIX, SOCK_STREAM, 0))
+    {
+        check(fd != -1, "socket() failed");
+        struct sockaddr_un sa;
+        bzero(&sa, sizeof(sa));
+        sa.sun_family = AF_LOCAL;
+        std::strncpy(sa.sun_path, path.c_str(), sizeof(sa.sun_path) - 1);
+        if (connect(fd, (struct sockaddr*)&sa, sizeof(sa)) == -1) {
+            ::close(fd);
+            throw std::runtime_error("connect() failed");
+        }
+
+        // a test that hangs fails instead
+        struct timeval tv = { 5, 0 };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    }
+    ~Client() { close(); }
+
+    Client(const Client&) = delete;
+    Client& operator=(const Client&) = delete;
+
+    void send(const std::string& data) {
+        for (std::string::size_type n = 0; n < data.size(); ) {
+            ssize_t result = write(fd, data.data() + n, data.size() - n);
+            check(result > 0, "write() failed");
+            n += static_cast<std::string::size_type>(result);
+        }
+    }
+
+    // Reads records until count records of the given type have arrived or
+    // the server closes the connection.
+    std::vector<Record> read(unsigned count, unsigned char type = FCGI_END_REQUEST) {
+        std::vector<Record> records;
+        while (count > 0) {
+            std::string::size_type n = 0;
+            while (count > 0 && input.size() - n >= FCGI_HEADER_LEN) {
+                const FCGI_Header& header = *reinterpret_cast<const FCGI_Header*>(input.data() + n);
+                std::string::size_type length =
+                    (static_cast<std::string::size_type>(header.contentLengthB1) << 8) + header.contentLengthB0;
+                if (input.size() - n < FCGI_HEADER_LEN + length + header.paddingLength)
+                    break;
+                records.push_back(Record{header.type,
+                    (static_cast<unsigned>(header.requestIdB1) << 8) + header.requestIdB0,
+                    input.substr(n + FCGI_HEADER_LEN, length)});
+                n += FCGI_HEADER_LEN + length + header.paddingLength;
+                if (header.type == type)
+                    count--;
+            }
+            input.erase(0, n);
+            if (count == 0 || closed())
+                break;
+        }
+        return records;
+    }
+
+    // Whether the server has closed the connection, waiting for it to do
+    // so if nothing else arrives.
+    bool closed() {
+        char buffer[16384];
+        ssize_t result = ::read(fd, buffer, sizeof(buffer));
+        if (result == 0)
+            return true;
+        if (result < 0 && errno == ECONNRESET)
+            return true;
+        check(result > 0, errno == EAGAIN ? "timed out waiting for the server" : "read() failed");
+        input.append(buffer, static_cast<std::string::size_type>(result));
+        return false;
+    }
+
+    void close() {
+        if (fd != -1)
+            ::close(fd);
+        fd = -1;
+    }
+
+    int fd;
+    std::string input;                      // not yet read as records
+};
+
+
+inline std::map<unsigned, Response>
+responses(const std::vector<Record>& records)
+{
+    std::map<unsigned, Response> found;
+    for (const Record& r : records) {
+        Response& response = found[r.id];
+        if (r.type == FCGI_STDOUT)
+            response.out.append(r.content);
+        else if (r.type == FCGI_STDERR)
+            response.err.append(r.content);
+        else if (r.type == FCGI_END_REQUEST && r.content.size() >= sizeof(FCGI_EndRequestBody)) {
+            const FCGI_EndRequestBody& body = *reinterpret_cast<const FCGI_EndRequestBody*>(r.content.data());
+            response.app_status = static_cast<int>((static_cast<unsigned>(body.appStatusB3) << 24) +
+                (static_cast<unsigned>(body.appStatusB2) << 16) +
+                (static_cast<unsigned>(body.appStatusB1) << 8) + body.appStatusB0);
+            response.protocol_status = body.protocolStatus;
+        }
+    }
+    return found;
+}
+
+
+// sends one request on a new connection and returns its response
+inline Response
+fetch(const std::string& path, const Pairs& params, const std::string& in = std::string())
+{
+    Client client(path);
+    client.send(request(1, params, in));
+    return responses(client.read(1))[1];
+}
+
+
+// runs a test, as main() of each test program
+inline int
+run(void (* test)())
+{
+    try {
+        test();
+    } catch (const std::exception& e) {
+        std::cerr << "Failed: " << e.what() << std::endl;
+        return 1;
+    }
+    std::cout << "Success!" << std::endl;
+    return 0;
+}
+
+} // namespace fcgitest
+
+#endif // !FCGITEST_H
@@ -0,0 +1,121 @@
+// vim: set expandtab ts=4 sw=4 :
+/*
+ * Copyright 2024 Chris Frey.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the names of the copyright holders nor the names of contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * This file is part of the FastCGI C++ Class library (fcgicc) version 0.1,
+ * available at http://althenia.net/fcgicc
+ */
+
+
+/*
+
+$ ./test_authorizer
+
+Checks the FCGI_AUTHORIZER role: a request completes with its params, as
+it has no stdin, and the decision cache answers a repeated request that
+was granted, with the same Variable- headers, until its time is up, while
+a denial is always asked again.
+
+*/
+
+
+#include "fcgitest.h"
+
+#include <chrono>
+#include <map>
+#include <string>
+#include <thread>
+
+#include <fastcgi.h>
+
+using namespace fcgitest;
+
+
+static unsigned calls = 0;
+
+
+static int
+handle_complete(FastCGIRequest& request)
+{
+    calls++;
+    if (request.param("DENY"))
+        request.out.append("Status: 403 Forbidden\r\n\r\n");
+    else
+        request.out.append("Status: 200 OK\r\nVariable-USER: ").append(request.param("A").value_or(""))
+            .append("\r\n\r\n");
+    return 0;
+}
+
+
+// asks the authorizer, expecting the given number of calls of the handler
+static void
+authorize(const std::string& path, const Pairs& params, unsigned expected, const std::string& what)
+{
+    Client client(path);
+    client.send(begin(1, FCGI_AUTHORIZER) + stream(FCGI_PARAMS, 1, pairs(params)));
+    std::map<unsigned, Response> found = responses(client.read(1));
+    check(found[1].protocol_status == FCGI_REQUEST_COMPLETE, "authorizer did not complete without stdin");
+    check(calls == expected, what);
+    if (found[1].out.find("403") == std::string::npos)
+        check(found[1].out == "Status: 200 OK\r\nVariable-USER: " + params[0].second + "\r\n\r\n",
+              "wrong decision:\n" + found[1].out);
+}
+
+
+static void
+test()
+{
+    std::string path = socket_path("authorizer");
+    FastCGIServer server;
+    server.complete_handler(&handle_complete);
+    server.authorizer_cache({"A"}, 1, 4096);
+    server.listen(path);
+    Loop loop(server);
+
+    authorize(path, { {"A", "1"} }, 1, "authorizer not asked");
+    authorize(path, { {"A", "1"} }, 1, "grant not cached");
+    authorize(path, { {"A", "2"} }, 2, "grant for another key answered");
+    authorize(path, { {"A", "3"}, {"DENY", "1"} }, 3, "authorizer not asked");
+    authorize(path, { {"A", "3"}, {"DENY", "1"} }, 4, "denial cached");
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(1100));
+    authorize(path, { {"A", "1"} }, 5, "grant kept past its time");
+
+    loop.stop();
+    check(server.stats().authorizations == 5 && server.stats().authorizations_cached == 1,
+          "authorizations miscounted");
+    check(server.stats().requests_active == 0, "requests left active");
+}
+
+
+int
+main()
+{
+    return run(&test);
+}
@@ -0,0 +1,192 @@
+// vim: set expandtab ts=4 sw=4 :
+/*
+ * Copyright 2024 Chris Frey.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the names of the copyright holders nor the names of contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * This file is part of the FastCGI C++ Class library (fcgicc) version 0.1,
+ * available at http://althenia.net/fcgicc
+ */
+
+
+/*
+
+$ ./test_basic
+
+Checks BasicFastCGIServer with Apps of its own rather than through
+FastCGIServer: an App with only handle_request(), one with handle_chunk()
+and handle_complete(), and one whose chunked(), multipart() and batched()
+turn its chunk, part and batch handlers on or off at run time.
+
+*/
+
+
+#include "fcgitest.h"
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <fastcgi.h>
+
+using namespace fcgitest;
+
+
+struct RequestApp {
+    int handle_request(FastCGIRequest& request) {
+        request.out.append("request");
+        return 0;
+    }
+};
+
+
+struct ChunkApp {
+    int handle_chunk(FastCGIRequest& request, std::string_view chunk) {
+        request.out.append("[").append(chunk).append("]");
+        return 0;
+    }
+    int handle_complete(FastCGIRequest& request) {
+        request.out.append("complete in=" + std::to_string(request.in.size()));
+        return 0;
+    }
+};
+
+
+// handles everything, in whichever way on selects
+struct SwitchApp {
+    explicit SwitchApp(bool p_on) : on(p_on) {}
+
+    bool chunked() const { return on; }
+    bool multipart() const { return on; }
+    bool batched() const { return on; }
+
+    int handle_data(FastCGIRequest& request) {
+        request.out.append("data;");
+        return 0;
+    }
+    int handle_chunk(FastCGIRequest& request, std::string_view) {
+        request.out.append("chunk;");
+        return 0;
+    }
+    int handle_part(FastCGIRequest& request, const FastCGIMultipart::Headers&) {
+        request.out.append("part;");
+        return 0;
+    }
+    int handle_part_data(FastCGIRequest& request, std::string_view) {
+        request.out.append("part_data;");
+        return 0;
+    }
+    int handle_batch(const std::vector<FastCGIRequest*>& requests) {
+        for (FastCGIRequest* request : requests)
+            request->out.append("batch;");
+        return 0;
+    }
+    int handle_complete(FastCGIRequest& request) {
+        request.out.append("complete in=" + std::to_string(request.in.size()));
+        return 0;
+    }
+
+    bool on;
+};
+
+
+static const std::string multipart_body =
+    "--x\r\nContent-Disposition: form-data; name=\"a\"\r\n\r\nvalue\r\n--x--\r\n";
+
+
+static Response
+fetch_multipart(const std::string& path)
+{
+    return fetch(path, { {"CONTENT_TYPE", "multipart/form-data; boundary=x"} }, multipart_body);
+}
+
+
+static void
+test_switch(bool on)
+{
+    std::string path = socket_path(on ? "basic_on" : "basic_off");
+    BasicFastCGIServer<SwitchApp> server(on);
+    check(server.application().on == on, "App not constructed from the server's arguments");
+    server.listen(path);
+    Loop loop(server);
+
+    Response response = fetch(path, {}, "abc");
+    if (on)
+        check(response.out == "batch;chunk;complete in=0", "handlers not selected:\n" + response.out);
+    else
+        check(response.out == "data;complete in=3", "handlers not deselected:\n" + response.out);
+
+    response = fetch_multipart(path);
+    if (on)
+        check(response.out.compare(0, 11, "batch;part;") == 0 &&
+              response.out.find("part_data;") != std::string::npos &&
+              response.out.find("chunk;") == std::string::npos &&
+              response.out.find("complete in=0") != std::string::npos,
+              "multipart body not parsed:\n" + response.out);
+    else
+        check(response.out == "data;complete in=" + std::to_string(multipart_body.size()),
+              "multipart body parsed:\n" + response.out);
+}
+
+
+static void
+test()
+{
+    {
+        std::string path = socket_path("basic_request");
+        BasicFastCGIServer<RequestApp> server;
+        server.listen(path);
+        Loop loop(server);
+
+        Response response = fetch(path, {}, "abc");
+        check(response.protocol_status == FCGI_REQUEST_COMPLETE && response.out == "request",
+              "request handler App failed:\n" + response.out);
+    }
+
+    {
+        std::string path = socket_path("basic_chunk");
+        BasicFastCGIServer<ChunkApp> server;
+        server.listen(path);
+        Loop loop(server);
+
+        Client client(path);
+        client.send(begin(1) + stream(FCGI_PARAMS, 1, pairs({})) + record(FCGI_STDIN, 1, "ab") +
+                    record(FCGI_STDIN, 1, "cd") + record(FCGI_STDIN, 1, ""));
+        Response response = responses(client.read(1))[1];
+        check(response.out == "[ab][cd]complete in=0", "chunk App failed:\n" + response.out);
+    }
+
+    test_switch(false);
+    test_switch(true);
+}
+
+
+int
+main()
+{
+    return run(&test);
+}
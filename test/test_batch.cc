@@ -0,0 +1,211 @@
+// vim: set expandtab ts=4 sw=4 :
+/*
+ * Copyright 2024 Chris Frey.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the names of the copyright holders nor the names of contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * This file is part of the FastCGI C++ Class library (fcgicc) version 0.1,
+ * available at http://althenia.net/fcgicc
+ */
+
+
+/*
+
+$ ./test_batch
+
+Checks batch_handler(): requests whose params complete in the same
+iteration are batched together, whether on one connection or several, a
+non-zero status from the batch handler ends them all without their own
+handlers, and each request still gets its stdin and exactly one call of
+the complete handler, whether its stdin arrived with its params or later.
+With coalescing too, a flight leader aborted while held for the batch
+hands the flight on rather than leaving it without one.
+
+*/
+
+
+#include "fcgitest.h"
+
+#include <chrono>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fastcgi.h>
+
+using namespace fcgitest;
+
+
+static int
+handle_batch(const std::vector<FastCGIRequest*>& requests)
+{
+    for (FastCGIRequest* request : requests) {
+        if (request->param("FAIL"))
+            return 3;
+        request->out.append("Content-Type: text/plain\r\n\r\nbatch " + std::to_string(requests.size()) + "\n");
+    }
+    return 0;
+}
+
+
+static int
+handle_complete(FastCGIRequest& request)
+{
+    request.out.append("complete in=" + std::to_string(request.in.size()) + "\n");
+    return 0;
+}
+
+
+static std::string::size_type
+count(const std::string& s, const std::string& part)
+{
+    std::string::size_type found = 0;
+    for (std::string::size_type n = s.find(part); n != std::string::npos; n = s.find(part, n + 1))
+        found++;
+    return found;
+}
+
+
+static void
+test_batches()
+{
+    std::string path = socket_path("batch");
+    FastCGIServer server;
+    server.batch_handler(&handle_batch);
+    server.complete_handler(&handle_complete);
+    server.listen(path);
+
+    // on several connections, read in the same iteration once accepted
+    {
+        std::vector<std::unique_ptr<Client>> clients;
+        for (int i = 0; i < 3; i++)
+            clients.emplace_back(new Client(path));
+        for (int i = 0; i < 5; i++)
+            server.process(10);
+        for (std::unique_ptr<Client>& client : clients)
+            client->send(request(1, {}, "abc"));
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        server.process(100);
+
+        Loop loop(server);
+        for (std::unique_ptr<Client>& client : clients) {
+            Response response = responses(client->read(1))[1];
+            check(response.out == "Content-Type: text/plain\r\n\r\nbatch 3\ncomplete in=3\n",
+                  "requests on several connections not batched:\n" + response.out);
+        }
+    }
+
+    Loop loop(server);
+
+    {
+        Client client(path);
+        client.send(request(1, {}, "abc") + request(2, {}, "") + request(3, {}, "abcdef"));
+        std::map<unsigned, Response> found = responses(client.read(3));
+        check(found[1].out == "Content-Type: text/plain\r\n\r\nbatch 3\ncomplete in=3\n" &&
+              found[2].out == "Content-Type: text/plain\r\n\r\nbatch 3\ncomplete in=0\n" &&
+              found[3].out == "Content-Type: text/plain\r\n\r\nbatch 3\ncomplete in=6\n",
+              "requests on one connection not batched");
+    }
+
+    {
+        Client client(path);
+        client.send(request(1, { {"FAIL", "1"} }) + request(2, {}, "abc"));
+        std::map<unsigned, Response> found = responses(client.read(2));
+        for (unsigned id : {1u, 2u})
+            check(found[id].app_status == 3 && found[id].protocol_status == FCGI_REQUEST_COMPLETE &&
+                  found[id].out.find("complete") == std::string::npos,
+                  "request not ended by the batch status");
+    }
+
+    {
+        // stdin after the batch has run
+        Client client(path);
+        client.send(begin(1) + stream(FCGI_PARAMS, 1, pairs({})) + record(FCGI_STDIN, 1, "ab"));
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        client.send(record(FCGI_STDIN, 1, "c") + record(FCGI_STDIN, 1, ""));
+        Response response = responses(client.read(1))[1];
+        check(count(response.out, "complete") == 1 && response.out.find("complete in=3\n") != std::string::npos,
+              "complete handler not called once with all of stdin:\n" + response.out);
+    }
+}
+
+
+static void
+test_coalesced()
+{
+    std::string path = socket_path("batch_coalesce");
+    FastCGIServer server;
+    server.batch_handler(&handle_batch);
+    server.complete_handler(&handle_complete);
+    server.coalesce_requests({"KEY"});
+    server.listen(path);
+    Loop loop(server);
+
+    {
+        // the leader is held for the batch when its abort arrives
+        Client client(path);
+        client.send(request(1, { {"KEY", "x"} }) + record(FCGI_ABORT_REQUEST, 1, std::string()));
+        check(responses(client.read(1))[1].app_status == 1, "aborted leader not ended");
+
+        Client next(path);
+        next.send(request(1, { {"KEY", "x"} }));
+        Response response = responses(next.read(1))[1];
+        check(response.protocol_status == FCGI_REQUEST_COMPLETE && response.out.find("complete") != std::string::npos,
+              "request after an aborted leader not handled:\n" + response.out);
+    }
+
+    {
+        // and its follower takes over
+        Client client(path);
+        client.send(request(1, { {"KEY", "y"} }) + request(2, { {"KEY", "y"} }) +
+                    record(FCGI_ABORT_REQUEST, 1, std::string()));
+        std::map<unsigned, Response> found = responses(client.read(2));
+        check(found[1].app_status == 1, "aborted leader not ended");
+        check(found[2].protocol_status == FCGI_REQUEST_COMPLETE && found[2].out.find("complete") != std::string::npos,
+              "follower of an aborted leader not handled:\n" + found[2].out);
+    }
+
+    loop.stop();
+    check(server.stats().requests_active == 0, "requests left active");
+}
+
+
+static void
+test()
+{
+    test_batches();
+    test_coalesced();
+}
+
+
+int
+main()
+{
+    return run(&test);
+}
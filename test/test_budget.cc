@@ -0,0 +1,133 @@
+// vim: set expandtab ts=4 sw=4 :
+/*
+ * Copyright 2024 Chris Frey.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the names of the copyright holders nor the names of contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * This file is part of the FastCGI C++ Class library (fcgicc) version 0.1,
+ * available at http://althenia.net/fcgicc
+ */
+
+
+/*
+
+$ ./test_budget
+
+Checks the memory budget: while a response waits for a client that does
+not read it, new requests are refused, and a request still waiting for
+stdin when its connection would be paused is answered with 503 instead.
+Also checks that trim() releases only the capacity of empty buffers.
+
+*/
+
+
+#include "fcgitest.h"
+
+#include <chrono>
+#include <string>
+#include <thread>
+
+#include <fastcgi.h>
+
+using namespace fcgitest;
+
+
+static int
+handle_complete(FastCGIRequest& request)
+{
+    request.out.append("Content-Type: text/plain\r\n\r\n");
+    if (request.param("BIG"))
+        request.out.append(1000000, 'x');
+    else
+        request.out.append(std::to_string(request.in.size()));
+    return 0;
+}
+
+
+class Server : public FastCGIServer {
+public:
+    using FastCGIServerBase::trim;
+};
+
+
+static void
+settle()
+{
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+}
+
+
+static void
+test()
+{
+    std::string s(1000000, 'x');
+    s.clear();
+    Server::trim(s);
+    check(s.capacity() < 1000000, "capacity of an empty buffer kept");
+    s.assign(1000000, 'x');
+    Server::trim(s);
+    check(s.size() == 1000000, "buffer in use trimmed");
+
+    std::string path = socket_path("budget");
+    Server server;
+    server.complete_handler(&handle_complete);
+    server.memory_budget(100000);
+    server.listen(path);
+    Loop loop(server);
+
+    {
+        Client big(path);
+        big.send(request(1, { {"BIG", "1"} }));
+        settle();
+        check(fetch(path, {}).protocol_status == FCGI_OVERLOADED, "request accepted over the budget");
+
+        Response response = responses(big.read(1))[1];
+        check(response.out.size() == 1000000 + 28, "large response cut short");
+        settle();
+        check(fetch(path, {}).protocol_status == FCGI_REQUEST_COMPLETE, "request refused under the budget");
+    }
+
+    // more stdin than the budget, and no end to it
+    Client client(path);
+    client.send(begin(1) + stream(FCGI_PARAMS, 1, pairs({})));
+    for (int i = 0; i < 4; i++)
+        client.send(record(FCGI_STDIN, 1, std::string(50000, 'x')));
+    Response response = responses(client.read(1))[1];
+    check(response.out.find("Status: 503") == 0, "request waiting for stdin not answered with 503");
+
+    client.send(record(FCGI_STDIN, 1, std::string(50000, 'x')) + stream(FCGI_STDIN, 1, ""));
+    client.send(request(2, {}, "abc"));
+    response = responses(client.read(1))[2];
+    check(response.out == "Content-Type: text/plain\r\n\r\n3", "connection not usable after 503");
+}
+
+
+int
+main()
+{
+    return run(&test);
+}
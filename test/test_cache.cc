@@ -0,0 +1,124 @@
+// vim: set expandtab ts=4 sw=4 :
+/*
+ * Copyright 2024 Chris Frey.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the names of the copyright holders nor the names of contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * This file is part of the FastCGI C++ Class library (fcgicc) version 0.1,
+ * available at http://althenia.net/fcgicc
+ */
+
+
+/*
+
+$ ./test_cache
+
+Checks the response cache: a repeated request is answered from the cache,
+keys made of several params do not collide, and the least recently used
+response is evicted to stay within the memory limit.  Also checks that a
+malformed key param is refused.
+
+*/
+
+
+#include "fcgitest.h"
+
+#include <stdexcept>
+#include <string>
+
+#include <fastcgi.h>
+
+using namespace fcgitest;
+
+
+static unsigned calls = 0;
+
+
+static int
+handle_complete(FastCGIRequest& request)
+{
+    calls++;
+    request.cache_for(60);
+    request.out.append("Content-Type: text/plain\r\n\r\n");
+    request.out.append(std::to_string(calls));
+    return 0;
+}
+
+
+static std::string
+body(const std::string& path, const Pairs& params)
+{
+    Response response = fetch(path, params);
+    check(response.protocol_status == FCGI_REQUEST_COMPLETE, "request not completed");
+    return response.out.substr(response.out.find("\r\n\r\n") + 4);
+}
+
+
+static void
+test()
+{
+    std::string path = socket_path("cache");
+    FastCGIServer server;
+    server.complete_handler(&handle_complete);
+    // room for two of the responses below but not three
+    server.response_cache({"A", "B"}, 300);
+    server.listen(path);
+    Loop loop(server);
+
+    check(body(path, { {"A", "1"} }) == "1", "first request not handled");
+    check(body(path, { {"A", "1"} }) == "1", "repeated request not answered from the cache");
+    check(server.stats().cache_hits == 1 && server.stats().cache_misses == 1, "hits and misses miscounted");
+
+    // the same bytes split differently between the key params
+    check(body(path, { {"A", std::string("x\0", 2)}, {"B", "y"} }) == "2", "split key not handled");
+    check(body(path, { {"A", "x"}, {"B", std::string("\0y", 2)} }) == "3", "keys collide");
+
+    // A=1 made room for the second split; using the first leaves the second
+    // as the least recently used
+    std::string x = body(path, { {"A", std::string("x\0", 2)}, {"B", "y"} });
+    check(x == "2", "recently stored evicted");
+    check(body(path, { {"A", "1"} }) == "4", "evicted response answered");
+    check(body(path, { {"A", "x"}, {"B", std::string("\0y", 2)} }) == "5", "least recently used not evicted");
+    check(body(path, { {"A", "1"} }) == "4", "recently stored evicted");
+    check(server.stats().cache_hits == 3 && server.stats().cache_misses == 5, "hits and misses miscounted");
+
+    bool refused = false;
+    try {
+        FastCGIServer other;
+        other.response_cache({"A:1x"}, 4096);
+    } catch (const std::invalid_argument&) {
+        refused = true;
+    }
+    check(refused, "malformed key param accepted");
+}
+
+
+int
+main()
+{
+    return run(&test);
+}
@@ -0,0 +1,166 @@
+// vim: set expandtab ts=4 sw=4 :
+/*
+ * Copyright 2024 Chris Frey.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the names of the copyright holders nor the names of contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * This file is part of the FastCGI C++ Class library (fcgicc) version 0.1,
+ * available at http://althenia.net/fcgicc
+ */
+
+
+/*
+
+$ ./test_capture
+
+Checks capture(): the file has one header and then each connection's input
+in order, ending with an empty chunk also when the client resets the
+connection, and tools/fcgicc_replay replays it against a server.
+
+*/
+
+
+#include "fcgitest.h"
+
+#include <chrono>
+#include <cstdio>
+#include <map>
+#include <string>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <fastcgi.h>
+
+using namespace fcgitest;
+
+
+static int
+handle_complete(FastCGIRequest& request)
+{
+    request.out.append("Content-Type: text/plain\r\n\r\n");
+    request.out.append(std::to_string(request.in.size()));
+    return 0;
+}
+
+
+static std::string
+read_file(const std::string& path)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    check(fd != -1, "capture not written");
+    std::string data;
+    char buffer[4096];
+    ssize_t result;
+    while ((result = ::read(fd, buffer, sizeof(buffer))) > 0)
+        data.append(buffer, static_cast<std::string::size_type>(result));
+    ::close(fd);
+    return data;
+}
+
+
+static void
+test()
+{
+    std::string path = socket_path("capture");
+    std::string file = "/tmp/fcgicc_capture_" + std::to_string(getpid()) + ".cap";
+    std::string first = request(1, { {"A", "1"} }, "abc");
+    std::string second = request(2, {}, std::string(10000, 'x'));
+    std::string reset = request(1, {}) + record(FCGI_GET_VALUES, 0, pairs({ {FCGI_MAX_REQS, ""} }));
+    {
+        FastCGIServer server;
+        server.complete_handler(&handle_complete);
+        server.capture(file);
+        server.listen(path);
+        Loop loop(server);
+
+        Client client(path);
+        client.send(first);
+        client.read(1);
+        client.send(second);
+        client.read(1);
+        client.close();
+
+        // unread responses make the close a reset
+        Client resetting(path);
+        resetting.send(reset);
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        resetting.close();
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        loop.stop();
+        check(server.stats().capture_dropped == 0, "capture dropped input");
+    }
+
+    std::string data = read_file(file);
+    check(data.size() >= sizeof(FastCGICapture), "capture too short");
+    const FastCGICapture& header = *reinterpret_cast<const FastCGICapture*>(data.data());
+    check(std::memcmp(header.magic, "FCGICCCP", 8) == 0 && header.version == 1, "capture header wrong");
+
+    std::map<unsigned, std::string> input;
+    std::map<unsigned, bool> ended;
+    std::string::size_type n = sizeof(FastCGICapture);
+    while (data.size() - n >= sizeof(FastCGICapture::Chunk)) {
+        FastCGICapture::Chunk chunk;
+        std::memcpy(&chunk, data.data() + n, sizeof(chunk));
+        n += sizeof(chunk);
+        check(data.size() - n >= chunk.length, "chunk cut short");
+        check(!ended[chunk.connection], "input after the end of a connection");
+        if (chunk.length == 0)
+            ended[chunk.connection] = true;
+        input[chunk.connection].append(data, n, chunk.length);
+        n += chunk.length;
+    }
+    check(n == data.size(), "capture has trailing bytes");
+    check(input.size() == 2 && input[1] == first + second && input[2] == reset, "captured input wrong");
+    check(ended[1] && ended[2], "end of connection not captured");
+
+    std::string replay_path = socket_path("capture_replay");
+    FastCGIServer server;
+    server.complete_handler(&handle_complete);
+    server.listen(replay_path);
+    Loop loop(server);
+
+    std::string command = std::string(FCGICC_REPLAY) + " -f " + file + " " + replay_path;
+    FILE* pipe = popen(command.c_str(), "r");
+    check(pipe != nullptr, "popen() failed");
+    std::string output;
+    char buffer[256];
+    while (std::fgets(buffer, sizeof(buffer), pipe))
+        output.append(buffer);
+    int status = pclose(pipe);
+    unlink(file.c_str());
+    check(status == 0, "replay failed:\n" + output);
+    check(output.find("requests       3 (0 failed)") != std::string::npos, "replay wrong:\n" + output);
+}
+
+
+int
+main()
+{
+    return run(&test);
+}
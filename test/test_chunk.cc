@@ -0,0 +1,148 @@
+// vim: set expandtab ts=4 sw=4 :
+/*
+ * Copyright 2024 Chris Frey.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the names of the copyright holders nor the names of contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * This file is part of the FastCGI C++ Class library (fcgicc) version 0.1,
+ * available at http://althenia.net/fcgicc
+ */
+
+
+/*
+
+$ ./test_chunk
+
+Checks chunk_handler(): each stdin record reaches it in order and in one
+call, stdin that arrived ahead of the params in one call when they end,
+request.in stays empty, and a non-zero status ends the request at once,
+before the rest of its stdin and without the complete handler.
+
+*/
+
+
+#include "fcgitest.h"
+
+#include <chrono>
+#include <map>
+#include <string>
+#include <string_view>
+#include <thread>
+
+#include <fastcgi.h>
+
+using namespace fcgitest;
+
+
+static int
+handle_request(FastCGIRequest& request)
+{
+    request.out.append("Content-Type: text/plain\r\n\r\n");
+    return 0;
+}
+
+
+static int
+handle_chunk(FastCGIRequest& request, std::string_view chunk)
+{
+    if (chunk == "stop")
+        return 5;
+    request.out.append("[").append(chunk).append("]");
+    if (!request.in.empty())
+        request.out.append(" in not empty ");
+    return 0;
+}
+
+
+static int
+handle_complete(FastCGIRequest& request)
+{
+    request.out.append(" complete in=" + std::to_string(request.in.size()));
+    return 0;
+}
+
+
+static void
+test()
+{
+    std::string path = socket_path("chunk");
+    FastCGIServer server;
+    server.request_handler(&handle_request);
+    server.chunk_handler(&handle_chunk);
+    server.complete_handler(&handle_complete);
+    server.listen(path);
+    Loop loop(server);
+
+    {
+        Client client(path);
+        client.send(begin(1) + stream(FCGI_PARAMS, 1, pairs({})) + record(FCGI_STDIN, 1, "one"));
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        client.send(record(FCGI_STDIN, 1, "two") + record(FCGI_STDIN, 1, "three"));
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        client.send(record(FCGI_STDIN, 1, "four") + record(FCGI_STDIN, 1, ""));
+        Response response = responses(client.read(1))[1];
+        check(response.out == "Content-Type: text/plain\r\n\r\n[one][two][three][four] complete in=0",
+              "chunks not delivered in order:\n" + response.out);
+    }
+
+    {
+        // stdin ahead of the params
+        Client client(path);
+        client.send(begin(1) + record(FCGI_STDIN, 1, "early") + stream(FCGI_PARAMS, 1, pairs({})) +
+                    record(FCGI_STDIN, 1, "late") + record(FCGI_STDIN, 1, ""));
+        Response response = responses(client.read(1))[1];
+        check(response.out == "Content-Type: text/plain\r\n\r\n[early][late] complete in=0",
+              "early stdin not delivered as a chunk:\n" + response.out);
+    }
+
+    {
+        // the request ends without the end of its stdin
+        Client client(path);
+        client.send(begin(1) + stream(FCGI_PARAMS, 1, pairs({})) + record(FCGI_STDIN, 1, "a") +
+                    record(FCGI_STDIN, 1, "stop"));
+        std::map<unsigned, Response> found = responses(client.read(1));
+        check(found[1].protocol_status == FCGI_REQUEST_COMPLETE && found[1].app_status == 5,
+              "request not ended by the chunk handler's status");
+        check(found[1].out.find("complete") == std::string::npos, "complete handler called after a failed chunk");
+
+        // its remaining stdin is ignored
+        client.send(record(FCGI_STDIN, 1, "b") + stream(FCGI_STDIN, 1, "") + request(2, {}, "c"));
+        found = responses(client.read(1));
+        check(found.count(1) == 0 && found[2].out == "Content-Type: text/plain\r\n\r\n[c] complete in=0",
+              "stdin after a failed chunk not ignored:\n" + found[2].out);
+    }
+
+    loop.stop();
+    check(server.stats().requests_active == 0, "requests left active");
+}
+
+
+int
+main()
+{
+    return run(&test);
+}
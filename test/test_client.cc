@@ -0,0 +1,182 @@
+// vim: set expandtab ts=4 sw=4 :
+/*
+ * Copyright 2024 Chris Frey.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the names of the copyright holders nor the names of contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * This file is part of the FastCGI C++ Class library (fcgicc) version 0.1,
+ * available at http://althenia.net/fcgicc
+ */
+
+
+/*
+
+$ ./test_client
+
+Checks FastCGIClient against the server: calls are multiplexed on one
+connection once FCGI_GET_VALUES says they may be, FCGI_MAX_CONNS caps the
+connections opened, a connect() that fails at once ends the call instead of
+throwing, and a call aborted from its own handler gets no more of them.
+
+*/
+
+
+#include "fcgitest.h"
+
+#include <chrono>
+#include <functional>
+#include <string>
+
+#include <fastcgi.h>
+
+using namespace fcgitest;
+
+
+static int
+handle_complete(FastCGIRequest& request)
+{
+    request.out.append("Content-Type: text/plain\r\n\r\n");
+    if (request.param("BIG"))
+        request.out.append(100000, 'x');
+    else
+        request.out.append(std::to_string(request.in.size()));
+    return 0;
+}
+
+
+struct Result {
+    Result() : app_status(0), protocol_status(-2), outs(0) {}
+
+    std::string out;
+    int app_status;
+    int protocol_status;                    // -2 until ended
+    unsigned outs;                          // calls of the out handler
+};
+
+
+static FastCGIClient::Handlers
+handlers(Result& result)
+{
+    FastCGIClient::Handlers h;
+    h.out = [&result](std::string_view data) { result.out.append(data); result.outs++; };
+    h.end = [&result](int app_status, int protocol_status) {
+        result.app_status = app_status;
+        result.protocol_status = protocol_status;
+    };
+    return h;
+}
+
+
+// runs the client until done() or for the given time
+static void
+run_until(FastCGIClient& client, const std::function<bool()>& done, int ms = 5000)
+{
+    auto until = std::chrono::steady_clock::now() + std::chrono::milliseconds(ms);
+    while (!done() && std::chrono::steady_clock::now() < until)
+        client.process(10);
+}
+
+
+static void
+test()
+{
+    std::string path = socket_path("client");
+    FastCGIServer server;
+    server.complete_handler(&handle_complete);
+    server.listen(path);
+    Loop loop(server);
+
+    {
+        // the second call can only end first if it shares the connection
+        FastCGIClient client(path, 1);
+        Result first, second;
+        FastCGIClient::CallID id = client.call({}, handlers(first), "ab", false);
+        client.call({}, handlers(second), "abcd");
+        run_until(client, [&] { return second.protocol_status != -2; });
+        check(second.protocol_status == FCGI_REQUEST_COMPLETE, "multiplexed call not completed");
+        check(second.out == "Content-Type: text/plain\r\n\r\n4", "multiplexed call has wrong output");
+        check(first.protocol_status == -2, "call ended before its stdin");
+
+        client.send_stdin(id, "c");
+        client.close_stdin(id);
+        run_until(client, [&] { return client.outstanding() == 0; });
+        check(first.out == "Content-Type: text/plain\r\n\r\n3", "call has wrong output");
+    }
+
+    {
+        // aborted by its own out handler
+        FastCGIClient client(path);
+        Result result;
+        FastCGIClient::CallID id = 0;
+        FastCGIClient::Handlers h = handlers(result);
+        h.out = [&](std::string_view) { result.outs++; client.abort(id); };
+        id = client.call({ {"BIG", "1"} }, h);
+        run_until(client, [&] { return client.outstanding() == 0; });
+        check(client.outstanding() == 0, "aborted call not ended");
+        check(result.outs == 1, "handler called after abort()");
+        check(result.protocol_status == -2, "end handler called after abort()");
+    }
+
+    {
+        Result result;
+        FastCGIClient client(socket_path("client_missing"));
+        client.call({}, handlers(result));
+        run_until(client, [&] { return result.protocol_status != -2; });
+        check(result.protocol_status == -1 && result.app_status == 0, "failed connect() not reported");
+    }
+
+    loop.stop();
+
+    // one request per connection, and two connections in all
+    std::string limited_path = socket_path("client_limited");
+    FastCGIServer limited;
+    limited.complete_handler(&handle_complete);
+    limited.overload_limits(2);
+    limited.listen(limited_path);
+    Loop limited_loop(limited);
+
+    FastCGIClient client(limited_path);
+    Result first, second, third;
+    FastCGIClient::CallID id = client.call({}, handlers(first), std::string_view(), false);
+    run_until(client, [] { return false; }, 200);
+    client.call({}, handlers(second), std::string_view(), false);
+    client.call({}, handlers(third));
+    run_until(client, [] { return false; }, 200);
+    check(third.protocol_status == -2, "call not held back by FCGI_MAX_CONNS");
+
+    client.close_stdin(id);
+    run_until(client, [&] { return third.protocol_status != -2; });
+    check(first.protocol_status == FCGI_REQUEST_COMPLETE, "first call not completed");
+    check(third.protocol_status == FCGI_REQUEST_COMPLETE, "held back call not completed");
+}
+
+
+int
+main()
+{
+    return run(&test);
+}
@@ -0,0 +1,135 @@
+// vim: set expandtab ts=4 sw=4 :
+/*
+ * Copyright 2024 Chris Frey.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the names of the copyright holders nor the names of contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * This file is part of the FastCGI C++ Class library (fcgicc) version 0.1,
+ * available at http://althenia.net/fcgicc
+ */
+
+
+/*
+
+$ ./test_coalesce
+
+Checks single-flight coalescing: requests parked behind one in flight,
+on its connection or on others, receive its output, errors and status, and
+a request parked behind one whose connection is reset by the web server is
+dispatched in its place.
+
+*/
+
+
+#include "fcgitest.h"
+
+#include <chrono>
+#include <map>
+#include <string>
+#include <thread>
+
+#include <sys/socket.h>
+
+#include <fastcgi.h>
+
+using namespace fcgitest;
+
+
+static unsigned calls = 0;
+
+
+static int
+handle_complete(FastCGIRequest& request)
+{
+    calls++;
+    request.out.append("Content-Type: text/plain\r\n\r\ncall ").append(std::to_string(calls));
+    if (request.param("STATUS")) {
+        request.err.append("failed");
+        return 7;
+    }
+    return 0;
+}
+
+
+static void
+test()
+{
+    std::string path = socket_path("coalesce");
+    FastCGIServer server;
+    server.complete_handler(&handle_complete);
+    server.coalesce_requests({"KEY"});
+    server.listen(path);
+    Loop loop(server);
+
+    {
+        Client leader(path);
+        leader.send(begin(1) + stream(FCGI_PARAMS, 1, pairs({ {"KEY", "s"}, {"STATUS", "1"} })));
+        leader.send(request(2, { {"KEY", "s"} }));
+        Client other(path);
+        other.send(request(5, { {"KEY", "s"} }));
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        leader.send(stream(FCGI_STDIN, 1, ""));
+
+        std::map<unsigned, Response> found = responses(leader.read(2));
+        found.merge(responses(other.read(1)));
+        for (unsigned id : {1u, 2u, 5u}) {
+            check(found[id].protocol_status == FCGI_REQUEST_COMPLETE,
+                  "request " + std::to_string(id) + " not completed");
+            check(found[id].out == "Content-Type: text/plain\r\n\r\ncall 1", "wrong output: " + found[id].out);
+            check(found[id].err == "failed", "wrong errors: " + found[id].err);
+            check(found[id].app_status == 7, "wrong status");
+        }
+        check(server.stats().requests_coalesced == 2, "coalesced requests miscounted");
+    }
+
+    // the leader's stdin never ends, so it is still in flight when the
+    // follower arrives
+    Client leader(path);
+    leader.send(begin(1) + stream(FCGI_PARAMS, 1, pairs({ {"KEY", "a"} })));
+    Client follower(path);
+    follower.send(request(1, { {"KEY", "a"} }));
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    // closing with a reply left unread resets the connection
+    leader.send(record(FCGI_GET_VALUES, 0, pairs({ {FCGI_MAX_CONNS, ""} })));
+    char c;
+    check(recv(leader.fd, &c, 1, MSG_PEEK) == 1, "no reply to FCGI_GET_VALUES");
+    leader.close();
+
+    Response response = responses(follower.read(1))[1];
+    check(response.protocol_status == FCGI_REQUEST_COMPLETE, "follower not completed");
+    check(response.out == "Content-Type: text/plain\r\n\r\ncall 2", "follower not dispatched: " + response.out);
+
+    check(fetch(path, { {"KEY", "a"} }).out == "Content-Type: text/plain\r\n\r\ncall 3", "flight not ended");
+}
+
+
+int
+main()
+{
+    return run(&test);
+}
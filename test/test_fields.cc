@@ -0,0 +1,141 @@
+// vim: set expandtab ts=4 sw=4 :
+/*
+ * Copyright 2024 Chris Frey.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the names of the copyright holders nor the names of contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * This file is part of the FastCGI C++ Class library (fcgicc) version 0.1,
+ * available at http://althenia.net/fcgicc
+ */
+
+
+/*
+
+$ ./test_fields
+
+Checks FastCGIRequest::query(), cookie() and form(): %XX and '+' are decoded
+in query and form fields but a malformed escape is kept as it is, the first
+of a repeated field wins, cookies are not decoded but lose their quotes,
+and a body is parsed as a form whatever the charset or case of its type.
+
+*/
+
+
+#include "fcgitest.h"
+
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <fastcgi.h>
+
+using namespace fcgitest;
+
+
+static const std::vector<std::string> names = {
+    "a", "b", "c", "d", "e", "f", "g", "name", "", "x", "y", "missing" };
+
+
+static void
+append_field(std::string& out, const char* kind, const std::string& name, std::optional<std::string_view> value)
+{
+    out.append(kind).append(" ").append(name);
+    out.append(value ? "=[" + std::string(*value) + "]\n" : " missing\n");
+}
+
+
+static int
+handle_complete(FastCGIRequest& request)
+{
+    request.out.append("Content-Type: text/plain\r\n\r\n\n");
+    for (const std::string& name : names) {
+        append_field(request.out, "query", name, request.query(name));
+        append_field(request.out, "cookie", name, request.cookie(name));
+        append_field(request.out, "form", name, request.form(name));
+    }
+    return 0;
+}
+
+
+static void
+expect(const Response& response, const std::string& line)
+{
+    check(response.out.find("\n" + line + "\n") != std::string::npos, "no \"" + line + "\" in:\n" + response.out);
+}
+
+
+static void
+test()
+{
+    std::string path = socket_path("fields");
+    FastCGIServer server;
+    server.complete_handler(&handle_complete);
+    server.listen(path);
+    Loop loop(server);
+
+    Response response = fetch(path, {
+        {"QUERY_STRING", "a=1&b=x%20y&c=p+q&d=%zz&e=%4&f=%41%42%3d&&g&=h&n%61me=v&a=2"},
+        {"HTTP_COOKIE", "a=1; b=\"quoted value\"; c = spaced ; d=\"; e; f=x%20y+z; a=2"} });
+    expect(response, "query a=[1]");
+    expect(response, "query b=[x y]");
+    expect(response, "query c=[p q]");
+    expect(response, "query d=[%zz]");
+    expect(response, "query e=[%4]");
+    expect(response, "query f=[AB=]");
+    expect(response, "query g=[]");
+    expect(response, "query =[h]");
+    expect(response, "query name=[v]");
+    expect(response, "query missing missing");
+    expect(response, "cookie a=[1]");
+    expect(response, "cookie b=[quoted value]");
+    expect(response, "cookie c=[spaced]");
+    expect(response, "cookie d=[\"]");
+    expect(response, "cookie e missing");
+    expect(response, "cookie f=[x%20y+z]");
+    expect(response, "form a missing");
+
+    std::string body = "x=1+2&y=%3D%&x=3";
+    for (const char* type : { "application/x-www-form-urlencoded", "application/x-www-form-urlencoded; charset=UTF-8",
+                              "Application/X-WWW-Form-URLEncoded;charset=utf-8" }) {
+        response = fetch(path, { {"CONTENT_TYPE", type} }, body);
+        expect(response, "form x=[1 2]");
+        expect(response, "form y=[=%]");
+        expect(response, "query x missing");
+    }
+    for (const char* type : { "text/plain", "application/x-www-form-urlencodedx", "" }) {
+        response = fetch(path, { {"CONTENT_TYPE", type} }, body);
+        expect(response, "form x missing");
+    }
+}
+
+
+int
+main()
+{
+    return run(&test);
+}
@@ -0,0 +1,170 @@
+// vim: set expandtab ts=4 sw=4 :
+/*
+ * Copyright 2024 Chris Frey.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the names of the copyright holders nor the names of contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * This file is part of the FastCGI C++ Class library (fcgicc) version 0.1,
+ * available at http://althenia.net/fcgicc
+ */
+
+
+/*
+
+$ ./test_filter
+
+Checks the FCGI_FILTER role: the data stream handler gets FCGI_DATA in
+order, including data that arrived ahead of the params, the complete
+handler waits for the end of both stdin and FCGI_DATA, and a filter that
+ends before its data stream is drained has the rest of it ignored.
+
+*/
+
+
+#include "fcgitest.h"
+
+#include <chrono>
+#include <map>
+#include <string>
+#include <string_view>
+#include <thread>
+
+#include <fastcgi.h>
+
+using namespace fcgitest;
+
+
+static int
+handle_request(FastCGIRequest& request)
+{
+    if (request.param("FAIL"))
+        return 6;
+    request.out.append("Content-Type: text/plain\r\n\r\n");
+    return 0;
+}
+
+
+static int
+handle_data_stream(FastCGIRequest& request, std::string_view data)
+{
+    if (data == "stop")
+        return 4;
+    request.out.append("<").append(data).append(">");
+    return 0;
+}
+
+
+static int
+handle_complete(FastCGIRequest& request)
+{
+    request.out.append("complete role=" + std::to_string(request.role) + " in=" + request.in);
+    return 0;
+}
+
+
+static std::string
+filter(unsigned id, const Pairs& params = Pairs())
+{
+    return begin(id, FCGI_FILTER) + stream(FCGI_PARAMS, id, pairs(params));
+}
+
+
+static void
+test()
+{
+    std::string path = socket_path("filter");
+    FastCGIServer server;
+    server.request_handler(&handle_request);
+    server.data_stream_handler(&handle_data_stream);
+    server.complete_handler(&handle_complete);
+    server.listen(path);
+    Loop loop(server);
+
+    {
+        // the end of stdin does not complete a filter
+        Client client(path);
+        client.send(filter(1) + stream(FCGI_STDIN, 1, "in") + record(FCGI_DATA, 1, "one"));
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        client.send(record(FCGI_DATA, 1, "two") + record(FCGI_DATA, 1, "three"));
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        client.send(stream(FCGI_DATA, 1, "four"));
+        Response response = responses(client.read(1))[1];
+        check(response.out == "Content-Type: text/plain\r\n\r\n<one><two><three><four>complete role=3 in=in",
+              "data not delivered in order before completing:\n" + response.out);
+    }
+
+    {
+        // data ahead of the params, and the data stream ending before stdin
+        Client client(path);
+        client.send(begin(1, FCGI_FILTER) + record(FCGI_DATA, 1, "early") + stream(FCGI_PARAMS, 1, pairs({})) +
+                    stream(FCGI_DATA, 1, "late"));
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        client.send(stream(FCGI_STDIN, 1, "in"));
+        Response response = responses(client.read(1))[1];
+        check(response.out == "Content-Type: text/plain\r\n\r\n<early><late>complete role=3 in=in",
+              "early data not delivered:\n" + response.out);
+    }
+
+    {
+        // the data stream handler ends the request part way
+        Client client(path);
+        client.send(filter(1) + stream(FCGI_STDIN, 1, "") + record(FCGI_DATA, 1, "a") +
+                    record(FCGI_DATA, 1, "stop"));
+        std::map<unsigned, Response> found = responses(client.read(1));
+        check(found[1].app_status == 4 && found[1].out.find("complete") == std::string::npos,
+              "filter not ended by the data stream handler");
+
+        client.send(stream(FCGI_DATA, 1, "rest") + request(2, {}, "x"));
+        found = responses(client.read(1));
+        check(found.count(1) == 0 && found[2].out.find("complete role=1 in=x") != std::string::npos,
+              "data after the end of a filter not ignored");
+    }
+
+    {
+        // the request handler ends it before any data
+        Client client(path);
+        client.send(filter(1, { {"FAIL", "1"} }));
+        std::map<unsigned, Response> found = responses(client.read(1));
+        check(found[1].app_status == 6 && found[1].out.empty(), "filter not ended by the request handler");
+
+        client.send(stream(FCGI_STDIN, 1, "") + stream(FCGI_DATA, 1, "rest") + filter(2) +
+                    stream(FCGI_STDIN, 2, "") + stream(FCGI_DATA, 2, "d"));
+        found = responses(client.read(1));
+        check(found.count(1) == 0 && found[2].out.find("<d>complete role=3") != std::string::npos,
+              "data of an ended filter not ignored");
+    }
+
+    loop.stop();
+    check(server.stats().requests_active == 0, "requests left active");
+}
+
+
+int
+main()
+{
+    return run(&test);
+}
@@ -0,0 +1,148 @@
+// vim: set expandtab ts=4 sw=4 :
+/*
+ * Copyright 2024 Chris Frey.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the names of the copyright holders nor the names of contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * This file is part of the FastCGI C++ Class library (fcgicc) version 0.1,
+ * available at http://althenia.net/fcgicc
+ */
+
+
+/*
+
+$ ./test_group
+
+Checks a group of two event loops in threads of their own: an idle loop
+takes an idle connection from the busier one, but not once it has become
+busy itself.
+
+*/
+
+
+#include "fcgitest.h"
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fastcgi.h>
+
+using namespace fcgitest;
+
+
+static int
+handle_first(FastCGIRequest& request)
+{
+    request.out.append("Content-Type: text/plain\r\n\r\nfirst");
+    return 0;
+}
+
+
+static int
+handle_second(FastCGIRequest& request)
+{
+    request.out.append("Content-Type: text/plain\r\n\r\nsecond");
+    return 0;
+}
+
+
+static void
+settle()
+{
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+}
+
+
+// sends a request on each connection and counts those the second loop answers
+static unsigned
+answered_by_second(std::vector<std::unique_ptr<Client>>& clients)
+{
+    unsigned second = 0;
+    for (std::unique_ptr<Client>& client : clients) {
+        client->send(request(1, {}));
+        Response response = responses(client->read(1))[1];
+        check(response.protocol_status == FCGI_REQUEST_COMPLETE, "request not completed");
+        if (response.out == "Content-Type: text/plain\r\n\r\nsecond")
+            second++;
+    }
+    return second;
+}
+
+
+static void
+test()
+{
+    std::string path = socket_path("group");
+    std::string second_path = socket_path("group_second");
+    FastCGILoopGroup group;
+    FastCGIServer first;
+    FastCGIServer second;
+    first.complete_handler(&handle_first);
+    second.complete_handler(&handle_second);
+    first.listen(path);
+    second.listen(second_path);
+    first.join_group(group);
+    second.join_group(group);
+    Loop first_loop(first);
+
+    // none of these is idle, so the second loop's request stays pending
+    std::vector<std::unique_ptr<Client>> clients;
+    for (int i = 0; i < 3; i++) {
+        clients.emplace_back(new Client(path));
+        clients.back()->send(begin(1) + stream(FCGI_PARAMS, 1, pairs({})));
+    }
+    settle();
+    Loop second_loop(second);
+    settle();
+
+    // the second loop becomes busy, and withdraws its request
+    Client busy(second_path);
+    busy.send(begin(1) + stream(FCGI_PARAMS, 1, pairs({})));
+    settle();
+    for (std::unique_ptr<Client>& client : clients) {
+        client->send(stream(FCGI_STDIN, 1, ""));
+        client->read(1);
+    }
+    settle();
+    check(answered_by_second(clients) == 0, "connection given to a busy loop");
+
+    // idle again, it takes one
+    busy.send(stream(FCGI_STDIN, 1, ""));
+    busy.read(1);
+    settle();
+    check(answered_by_second(clients) == 1, "connection not given to the idle loop");
+}
+
+
+int
+main()
+{
+    return run(&test);
+}
@@ -0,0 +1,284 @@
+// vim: set expandtab ts=4 sw=4 :
+/*
+ * Copyright 2024 Chris Frey.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the names of the copyright holders nor the names of contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * This file is part of the FastCGI C++ Class library (fcgicc) version 0.1,
+ * available at http://althenia.net/fcgicc
+ */
+
+
+/*
+
+$ ./test_handoff
+
+Checks the zero-downtime restart: a successor that calls take_over()
+receives the listening socket and answers new connections, while the old
+server finishes the request in flight, closes its connection and is then
+drained.  Also checks that adopt() refuses a socket that is not listening,
+that take_over() refuses a handoff message that is cut short or too long
+from a predecessor, and that listen_inherited() adopts the listening sockets
+passed by socket activation.
+
+*/
+
+
+#include "fcgitest.h"
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#include <fcntl.h>
+#include <strings.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <fastcgi.h>
+
+using namespace fcgitest;
+
+
+static int
+handle_old(FastCGIRequest& request)
+{
+    request.out.append("Content-Type: text/plain\r\n\r\nold");
+    return 0;
+}
+
+
+static int
+handle_new(FastCGIRequest& request)
+{
+    request.out.append("Content-Type: text/plain\r\n\r\nnew");
+    return 0;
+}
+
+
+// a local socket listening at path
+static int
+listening(const std::string& path)
+{
+    int fd = socket(PF_UNIX, SOCK_STREAM, 0);
+    check(fd != -1, "socket() failed");
+    struct sockaddr_un sa;
+    bzero(&sa, sizeof(sa));
+    sa.sun_family = AF_LOCAL;
+    std::strncpy(sa.sun_path, path.c_str(), sizeof(sa.sun_path) - 1);
+    unlink(path.c_str());
+    check(bind(fd, (struct sockaddr*)&sa, sizeof(sa)) == 0 && ::listen(fd, 4) == 0, "bind() failed");
+    return fd;
+}
+
+
+// the length of the paths that follow, as a predecessor sends it
+static std::string
+length(uint32_t n)
+{
+    uint32_t value = htonl(n);
+    return std::string(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+
+// Plays the predecessor to server.take_over(): sends message with sock
+// attached, then hangs up.  Returns the error that take_over() threw, or an
+// empty string and the number of sockets it received.
+static std::string
+take_over(FastCGIServer& server, const std::string& message, int sock, unsigned& count)
+{
+    std::string handoff_path = socket_path("handoff_fake");
+    int offer = listening(handoff_path);
+    std::string error;
+    std::thread successor([&] {
+        try {
+            count = server.take_over(handoff_path);
+        } catch (const std::runtime_error& e) {
+            error = e.what();
+        }
+    });
+
+    int peer = accept(offer, NULL, NULL);
+    std::string data = message;
+    struct iovec iov = { &data[0], data.size() };
+    struct msghdr msg;
+    bzero(&msg, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    char control[CMSG_SPACE(sizeof(int))];
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    std::memcpy(CMSG_DATA(cmsg), &sock, sizeof(int));
+    bool sent = peer != -1 && sendmsg(peer, &msg, 0) == static_cast<ssize_t>(data.size());
+    if (peer != -1)
+        close(peer);
+    successor.join();
+    close(offer);
+    unlink(handoff_path.c_str());
+    check(sent, "handoff message not sent");
+    return error;
+}
+
+
+static void
+test_messages()
+{
+    std::string path = socket_path("handoff_taken");
+    int sock = listening(path);
+    unsigned count = 0;
+
+    {
+        FastCGIServer server;
+        server.complete_handler(&handle_new);
+        std::string error = take_over(server, length(static_cast<uint32_t>(path.size() + 1)) + path + '\0',
+                                      sock, count);
+        check(error.empty() && count == 1, "handoff not taken over: " + error);
+        Loop loop(server);
+        check(fetch(path, {}).out == "Content-Type: text/plain\r\n\r\nnew", "adopted socket not answering");
+    }
+    check(access(path.c_str(), F_OK) == -1, "socket file from the message not unlinked");
+
+    FastCGIServer server;
+    check(take_over(server, length(0).substr(0, 2), sock, count) == "handoff message cut short",
+          "short length accepted");
+    check(take_over(server, length(100) + "abc", sock, count) == "handoff message cut short",
+          "short paths accepted");
+    check(take_over(server, length(0xffffffff), sock, count) == "handoff message too long",
+          "long paths accepted");
+    close(sock);
+}
+
+
+static void
+test_inherited()
+{
+    // the descriptors socket activation passes, from 3 on
+    std::string path = socket_path("handoff_inherited");
+    int sock = listening(path);
+    int pair[2];
+    check(socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == 0, "socketpair() failed");
+    int listener = fcntl(sock, F_DUPFD, 10);
+    int other = fcntl(pair[0], F_DUPFD, 10);
+    close(sock);
+    close(pair[0]);
+    check(dup2(listener, 3) == 3 && dup2(other, 4) == 4, "dup2() failed");
+    close(listener);
+    close(other);
+
+    {
+        setenv("LISTEN_PID", std::to_string(getpid() + 1).c_str(), 1);
+        setenv("LISTEN_FDS", "2", 1);
+        FastCGIServer server;
+        check(server.listen_inherited() == 0, "sockets for another process adopted");
+    }
+
+    {
+        setenv("LISTEN_PID", std::to_string(getpid()).c_str(), 1);
+        FastCGIServer server;
+        server.complete_handler(&handle_new);
+        check(server.listen_inherited() == 1, "inherited listening socket not adopted alone");
+        check(!getenv("LISTEN_PID") && !getenv("LISTEN_FDS"), "socket activation passed on");
+        check((fcntl(3, F_GETFD) & FD_CLOEXEC) != 0, "inherited socket not closed on exec");
+        Loop loop(server);
+        check(fetch(path, {}).out == "Content-Type: text/plain\r\n\r\nnew", "inherited socket not answering");
+    }
+    close(4);
+    close(pair[1]);
+    unlink(path.c_str());
+}
+
+
+static void
+test_handoff()
+{
+    std::string path = socket_path("handoff");
+    std::string handoff_path = socket_path("handoff_offer");
+    FastCGIServer old_server;
+    old_server.complete_handler(&handle_old);
+    old_server.listen(path);
+    old_server.offer_handoff(handoff_path);
+    Loop old_loop(old_server);
+
+    // in flight across the handoff
+    Client client(path);
+    client.send(begin(1) + stream(FCGI_PARAMS, 1, pairs({})));
+    check(fetch(path, {}).out == "Content-Type: text/plain\r\n\r\nold", "old server not answering");
+
+    {
+        FastCGIServer new_server;
+        new_server.complete_handler(&handle_new);
+        check(new_server.take_over(handoff_path) == 1, "listening socket not received");
+        Loop new_loop(new_server);
+        check(fetch(path, {}).out == "Content-Type: text/plain\r\n\r\nnew", "new server not answering");
+
+        client.send(stream(FCGI_STDIN, 1, ""));
+        Response response = responses(client.read(1))[1];
+        check(response.out == "Content-Type: text/plain\r\n\r\nold", "request in flight not finished");
+        check(client.closed(), "old connection not closed");
+        old_loop.stop();
+        check(old_server.drained(), "old server not drained");
+    }
+    check(access(path.c_str(), F_OK) == -1, "socket file not unlinked by the new server");
+
+    int fds[2];
+    check(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0, "socketpair() failed");
+    bool refused = false;
+    try {
+        FastCGIServer server;
+        server.adopt(fds[0]);
+    } catch (const std::runtime_error&) {
+        refused = true;
+    }
+    close(fds[0]);
+    close(fds[1]);
+    check(refused, "socket that is not listening adopted");
+}
+
+
+static void
+test()
+{
+    test_inherited();
+    test_handoff();
+    test_messages();
+}
+
+
+int
+main()
+{
+    return run(&test);
+}
@@ -0,0 +1,196 @@
+// vim: set expandtab ts=4 sw=4 :
+/*
+ * Copyright 2024 Chris Frey.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the names of the copyright holders nor the names of contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * This file is part of the FastCGI C++ Class library (fcgicc) version 0.1,
+ * available at http://althenia.net/fcgicc
+ */
+
+
+/*
+
+$ ./test_log
+
+Checks FastCGIAccessLog: the fields of a line, with only the content of
+records written in place counted as bytes_out, lines that do not fit in the
+ring being dropped and counted rather than waited for, and the lines still
+in the ring being written out when the log is closed.
+
+*/
+
+
+#include "fcgitest.h"
+
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include <fastcgi.h>
+
+using namespace fcgitest;
+
+
+static int
+handle_complete(FastCGIRequest& request)
+{
+    request.out.append("Content-Type: text/plain\r\n\r\n" + request.in);
+    request.err.append("e");
+    if (request.param("RESERVE"))
+        // 100000 bytes in place, more than a record holds
+        for (std::string::size_type n = 0; n < 100000; ) {
+            std::string::size_type size = 100000 - n;
+            char* p = request.out_reserve(size);
+            std::memset(p, 'x', size);
+            request.out_commit(size);
+            n += size;
+        }
+    return request.param("STATUS") ? 3 : 0;
+}
+
+
+static std::vector<std::string>
+read_lines(const std::string& path)
+{
+    std::ifstream file(path);
+    std::vector<std::string> lines;
+    for (std::string line; std::getline(file, line); )
+        lines.push_back(line);
+    unlink(path.c_str());
+    return lines;
+}
+
+
+static bool
+digits(const std::string& s)
+{
+    return !s.empty() && s.find_first_not_of("0123456789") == std::string::npos;
+}
+
+
+static void
+test_format()
+{
+    std::string path = socket_path("log");
+    std::string log_path = "/tmp/fcgicc_log_" + std::to_string(getpid()) + ".log";
+    std::unique_ptr<FastCGIAccessLog> log(
+        new FastCGIAccessLog(log_path, "$time|$status|$bytes_in|$bytes_out|$duration_us|$REMOTE_ADDR|$MISSING|$"));
+    {
+        FastCGIServer server;
+        server.complete_handler(&handle_complete);
+        server.access_log(*log);
+        server.listen(path);
+        Loop loop(server);
+        Response response = fetch(path, { {"REMOTE_ADDR", "10.0.0.1"}, {"STATUS", "3"} }, "abcd");
+        check(response.app_status == 3, "request not completed");
+        response = fetch(path, { {"RESERVE", "1"} });
+        check(response.out.size() == 28 + 100000, "request not completed");
+    }
+    log.reset();
+
+    std::vector<std::string> lines = read_lines(log_path);
+    check(lines.size() == 2, "not two lines logged");
+    check(lines[1].find("|0|0|100029|") == 24,
+          "bytes_out of records written in place: " + lines[1]);
+    std::vector<std::string> fields;
+    for (std::string::size_type n = 0; n != std::string::npos; ) {
+        std::string::size_type end = lines[0].find('|', n);
+        fields.push_back(lines[0].substr(n, end == std::string::npos ? end : end - n));
+        n = end == std::string::npos ? end : end + 1;
+    }
+    check(fields.size() == 8, "wrong number of fields: " + lines[0]);
+    // e.g. 2024-01-31T23:59:59+0100
+    check(fields[0].size() == 24 && fields[0][10] == 'T', "wrong time: " + fields[0]);
+    check(fields[1] == "3", "wrong status: " + fields[1]);
+    check(fields[2] == "4", "wrong bytes_in: " + fields[2]);
+    // "Content-Type: text/plain\r\n\r\n" and abcd on stdout, e on stderr
+    check(fields[3] == "33", "wrong bytes_out: " + fields[3]);
+    check(digits(fields[4]), "wrong duration: " + fields[4]);
+    check(fields[5] == "10.0.0.1" && fields[6] == "-", "wrong params: " + lines[0]);
+    check(fields[7] == "$", "wrong text: " + fields[7]);
+}
+
+
+static void
+test_overflow()
+{
+    std::string path = socket_path("log_overflow");
+    std::string log_path = "/tmp/fcgicc_log_overflow_" + std::to_string(getpid()) + ".log";
+    const unsigned count = 50;
+    // room for 10 lines of 26 bytes each
+    std::unique_ptr<FastCGIAccessLog> log(new FastCGIAccessLog(log_path, "$LINE", 256));
+    {
+        FastCGIServer server;
+        server.complete_handler(&handle_complete);
+        server.access_log(*log);
+        server.listen(path);
+
+        // all in one iteration, far quicker than the log thread drains
+        Client client(path);
+        server.process(100);
+        std::string requests;
+        for (unsigned id = 1; id <= count; id++) {
+            std::string line = "line " + std::to_string(id);
+            requests.append(request(id, { {"LINE", line + std::string(25 - line.size(), '.')} }));
+        }
+        client.send(requests);
+        server.process(1000);
+        server.process(100);
+        check(client.read(count).size() >= count, "requests not completed");
+    }
+    unsigned long dropped = log->dropped();
+    // what the thread has not drained yet is written as the log closes
+    log.reset();
+
+    std::vector<std::string> lines = read_lines(log_path);
+    check(dropped > 0, "no line dropped from a full ring");
+    check(lines.size() > 0, "no line kept");
+    check(lines.size() + dropped == count, "lines lost without being counted");
+    for (unsigned i = 0; i < lines.size(); i++)
+        check(lines[i] == "line " + std::to_string(i + 1) + std::string(25 - 5 - std::to_string(i + 1).size(), '.'),
+              "lines kept out of order: " + lines[i]);
+}
+
+
+static void
+test()
+{
+    test_format();
+    test_overflow();
+}
+
+
+int
+main()
+{
+    return run(&test);
+}
@@ -0,0 +1,156 @@
+// vim: set expandtab ts=4 sw=4 :
+/*
+ * Copyright 2024 Chris Frey.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the names of the copyright holders nor the names of contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * This file is part of the FastCGI C++ Class library (fcgicc) version 0.1,
+ * available at http://althenia.net/fcgicc
+ */
+
+
+/*
+
+$ ./test_multipart
+
+Checks multipart/form-data bodies: parts read the same however the body is
+split into records, also within a delimiter, and when it has no preamble;
+a body cut short before its closing delimiter or with oversize part headers
+is answered with 400 and does not reach the complete handler.
+
+*/
+
+
+#include "fcgitest.h"
+
+#include <string>
+#include <string_view>
+
+#include <fastcgi.h>
+
+using namespace fcgitest;
+
+
+static int
+handle_part(FastCGIRequest& request, const FastCGIMultipart::Headers& headers)
+{
+    FastCGIMultipart::Headers::const_iterator it = headers.find("content-disposition");
+    std::string_view name = it == headers.end() ? std::string_view() :
+        FastCGIMultipart::header_param(it->second, "name");
+    if (request.out.empty())
+        request.out.append("Content-Type: text/plain\r\n\r\n");
+    request.out.append("\n[").append(name).append("] ");
+    return 0;
+}
+
+
+static int
+handle_part_data(FastCGIRequest& request, std::string_view data)
+{
+    request.out.append(data);
+    return 0;
+}
+
+
+static int
+handle_complete(FastCGIRequest& request)
+{
+    request.out.append("\ncomplete");
+    return 0;
+}
+
+
+// the body in stdin records of at most size bytes
+static std::string
+split_request(unsigned id, const std::string& body, std::string::size_type size)
+{
+    std::string s = begin(id) + stream(FCGI_PARAMS, id,
+        pairs({ {"CONTENT_TYPE", "multipart/form-data; boundary=\"xyz\""} }));
+    for (std::string::size_type n = 0; n < body.size(); n += size)
+        s.append(record(FCGI_STDIN, id, body.substr(n, size)));
+    return s + record(FCGI_STDIN, id, "");
+}
+
+
+static void
+test()
+{
+    std::string path = socket_path("multipart");
+    FastCGIServer server;
+    server.part_handler(&handle_part);
+    server.part_data_handler(&handle_part_data);
+    server.complete_handler(&handle_complete);
+    server.listen(path);
+    Loop loop(server);
+
+    std::string parts =
+        "Content-Disposition: form-data; name=\"a\"\r\n\r\n"
+        "first\r\n-\r\n--xy\r\n"
+        "--xyz\r\n"
+        "Content-Disposition: form-data; name=\"b\"; filename=\"b.txt\"\r\n"
+        "Content-Type: text/plain\r\n\r\n"
+        "second\r\n"
+        "--xyz--\r\n"
+        "epilogue";
+    std::string expected = "Content-Type: text/plain\r\n\r\n\n[a] first\r\n-\r\n--xy\n[b] second\ncomplete";
+
+    for (const std::string& body : { "preamble\r\n--xyz\r\n" + parts, "--xyz\r\n" + parts }) {
+        for (std::string::size_type size = 1; size <= body.size(); size++) {
+            Client client(path);
+            client.send(split_request(1, body, size));
+            Response response = responses(client.read(1))[1];
+            check(response.out == expected, "parts read wrong from records of " + std::to_string(size) +
+                  " bytes:\n" + response.out);
+        }
+    }
+
+    // cut short, also within the closing delimiter
+    std::string whole = "--xyz\r\n" + parts;
+    std::string::size_type last = whole.find("--xyz--");
+    for (std::string::size_type cut : { std::string::size_type(10), whole.find("second"), last, last + 4, last + 5 }) {
+        Client client(path);
+        client.send(split_request(1, whole.substr(0, cut), 7));
+        Response response = responses(client.read(1))[1];
+        check(response.out.find("Status: 400") == 0 && response.out.find("complete") == std::string::npos,
+              "body cut short after " + std::to_string(cut) + " bytes not answered with 400:\n" + response.out);
+    }
+
+    {
+        Client client(path);
+        client.send(split_request(1, "--xyz\r\nX-Big: " + std::string(20000, 'h') + "\r\n\r\ndata\r\n--xyz--", 1000));
+        Response response = responses(client.read(1))[1];
+        check(response.out.find("Status: 400") == 0 && response.out.find("complete") == std::string::npos,
+              "oversize part headers not answered with 400");
+    }
+}
+
+
+int
+main()
+{
+    return run(&test);
+}
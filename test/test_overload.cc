@@ -0,0 +1,245 @@
+// vim: set expandtab ts=4 sw=4 :
+/*
+ * Copyright 2024 Chris Frey.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the names of the copyright holders nor the names of contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * This file is part of the FastCGI C++ Class library (fcgicc) version 0.1,
+ * available at http://althenia.net/fcgicc
+ */
+
+
+/*
+
+$ ./test_overload
+
+Checks load shedding: requests begun while max_requests are in flight, or
+right after an iteration busy for longer than max_busy_ms, are refused with
+FCGI_OVERLOADED, and the limits are advertised by FCGI_GET_VALUES.  Also
+checks that the adaptive limit refuses only once iterations have stayed busy
+for its interval, and accepts again as soon as one is quick.
+
+*/
+
+
+#include "fcgitest.h"
+
+#include <chrono>
+#include <map>
+#include <string>
+#include <thread>
+
+#include <fastcgi.h>
+
+using namespace fcgitest;
+
+
+static int
+handle_request(FastCGIRequest& request)
+{
+    if (request.param("SLOW"))
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    return 0;
+}
+
+
+static int
+handle_complete(FastCGIRequest& request)
+{
+    request.out.append("Content-Type: text/plain\r\n\r\ndone");
+    return 0;
+}
+
+
+static std::map<std::string, std::string>
+get_values(const std::string& path)
+{
+    Client client(path);
+    client.send(record(FCGI_GET_VALUES, 0, pairs({ {FCGI_MAX_CONNS, ""}, {FCGI_MAX_REQS, ""},
+                                                   {FCGI_MPXS_CONNS, ""} })));
+    std::vector<Record> records = client.read(1, FCGI_GET_VALUES_RESULT);
+    check(records.size() == 1, "no FCGI_GET_VALUES_RESULT");
+
+    std::map<std::string, std::string> values;
+    const std::string& s = records[0].content;
+    for (std::string::size_type n = 0; n + 2 <= s.size(); ) {
+        std::string::size_type name_length = static_cast<unsigned char>(s[n]);
+        std::string::size_type value_length = static_cast<unsigned char>(s[n + 1]);
+        values[s.substr(n + 2, name_length)] = s.substr(n + 2 + name_length, value_length);
+        n += 2 + name_length + value_length;
+    }
+    return values;
+}
+
+
+static void
+test_max_requests()
+{
+    std::string path = socket_path("overload");
+    FastCGIServer server;
+    server.complete_handler(&handle_complete);
+    server.overload_limits(1);
+    server.listen(path);
+    Loop loop(server);
+
+    Client client(path);
+    client.send(begin(1) + stream(FCGI_PARAMS, 1, pairs({ {"REQUEST_METHOD", "POST"} })));
+    client.send(request(2, {}));
+    std::map<unsigned, Response> found = responses(client.read(1));
+    check(found.count(2) && found[2].protocol_status == FCGI_OVERLOADED,
+          "second request in flight was not refused");
+
+    client.send(stream(FCGI_STDIN, 1, std::string()));
+    found = responses(client.read(1));
+    check(found[1].protocol_status == FCGI_REQUEST_COMPLETE, "first request not completed");
+
+    client.send(request(3, {}));
+    found = responses(client.read(1));
+    check(found[3].protocol_status == FCGI_REQUEST_COMPLETE, "request after the first was refused");
+
+    // a web server that multiplexes may open MAX_CONNS connections of
+    // MAX_REQS requests each
+    std::map<std::string, std::string> values = get_values(path);
+    check(values[FCGI_MAX_CONNS] == "1" && values[FCGI_MAX_REQS] == "1", "limit of 1 misadvertised");
+    check(values[FCGI_MPXS_CONNS] == "1", "FCGI_MPXS_CONNS misadvertised");
+
+    loop.stop();
+    check(server.stats().requests_shed == 1, "requests_shed is not 1");
+    check(server.stats().requests_active == 0, "requests_active is not 0");
+}
+
+
+static void
+test_advertised()
+{
+    std::string path = socket_path("overload_values");
+    FastCGIServer server;
+    server.overload_limits(250);
+    server.listen(path);
+    Loop loop(server);
+
+    std::map<std::string, std::string> values = get_values(path);
+    check(values[FCGI_MAX_CONNS] == "100" && values[FCGI_MAX_REQS] == "2", "limit of 250 misadvertised");
+}
+
+
+static void
+test_max_busy()
+{
+    std::string path = socket_path("overload_busy");
+    FastCGIServer server;
+    server.request_handler(&handle_request);
+    server.complete_handler(&handle_complete);
+    server.overload_limits(-1, 20);
+    server.listen(path);
+    Loop loop(server);
+
+    Client slow(path);
+    Client other(path);
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+    // the second request arrives while the first is being handled
+    slow.send(request(1, { {"SLOW", "1"} }));
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    other.send(request(1, {}));
+    std::map<unsigned, Response> found = responses(other.read(1));
+    check(found[1].protocol_status == FCGI_OVERLOADED, "request after a busy iteration was not refused");
+    found = responses(slow.read(1));
+    check(found[1].protocol_status == FCGI_REQUEST_COMPLETE && found[1].out.find("done") != std::string::npos,
+          "slow request not completed");
+
+    // the refusal was quick
+    other.send(request(2, {}));
+    found = responses(other.read(1));
+    check(found[2].protocol_status == FCGI_REQUEST_COMPLETE, "request after a quick iteration was refused");
+
+    loop.stop();
+    check(server.stats().requests_shed == 1, "requests_shed is not 1");
+}
+
+
+static void
+test_adaptive()
+{
+    std::string path = socket_path("overload_adaptive");
+    FastCGIServer server;
+    server.request_handler(&handle_request);
+    server.complete_handler(&handle_complete);
+    server.overload_adaptive(20, 150);
+    server.listen(path);
+
+    // one slow request per iteration, each busy for 100 ms
+    Client client(path);
+    server.process(100);
+    const unsigned count = 8;
+    for (unsigned id = 1; id <= count; id++) {
+        client.send(request(id, { {"SLOW", "1"} }));
+        server.process(1000);
+    }
+    for (int i = 0; i < 3; i++)
+        server.process(10);
+
+    std::map<unsigned, Response> found = responses(client.read(count));
+    check(found.size() == count, "not all requests ended");
+    check(found[1].protocol_status == FCGI_REQUEST_COMPLETE && found[2].protocol_status == FCGI_REQUEST_COMPLETE,
+          "request refused before the busy time stayed above target for an interval");
+
+    unsigned long refused = 0;
+    for (unsigned id = 1; id <= count; id++) {
+        if (found[id].protocol_status != FCGI_OVERLOADED)
+            continue;
+        refused++;
+        // the refusal left the iteration quick
+        check(id == count || found[id + 1].protocol_status == FCGI_REQUEST_COMPLETE,
+              "request after a quick iteration was refused");
+    }
+    check(refused > 0, "no request refused while every iteration was busy");
+    check(server.stats().requests_shed == refused, "requests_shed miscounted");
+
+    client.send(request(count + 1, {}));
+    server.process(1000);
+    server.process(1000);
+    found = responses(client.read(1));
+    check(found[count + 1].protocol_status == FCGI_REQUEST_COMPLETE, "request after the queue drained was refused");
+}
+
+
+static void
+test()
+{
+    test_max_requests();
+    test_advertised();
+    test_max_busy();
+    test_adaptive();
+}
+
+
+int
+main()
+{
+    return run(&test);
+}
@@ -0,0 +1,164 @@
+// vim: set expandtab ts=4 sw=4 :
+/*
+ * Copyright 2024 Chris Frey.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the names of the copyright holders nor the names of contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * This file is part of the FastCGI C++ Class library (fcgicc) version 0.1,
+ * available at http://althenia.net/fcgicc
+ */
+
+
+/*
+
+$ ./test_params
+
+Checks that FastCGIRequest::param() finds the same values with lazy params
+as with params decoded as they arrive: for duplicate names the first wins,
+and long names and values, empty values, names that prefix others and pairs
+split across records, also within a length, all read back alike.  Also
+checks that params over params_limit() are answered with 431 at once.
+
+*/
+
+
+#include "fcgitest.h"
+
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <fastcgi.h>
+
+using namespace fcgitest;
+
+
+static const std::vector<std::string> names = {
+    "A", "AB", "B", "EMPTY", "LONG", std::string(200, 'n'), "MISSING", "NUL", "" };
+
+
+static int
+handle_complete(FastCGIRequest& request)
+{
+    request.out.append("Content-Type: text/plain\r\n\r\n");
+    for (const std::string& name : names) {
+        std::optional<std::string_view> value = request.param(name);
+        request.out.append(name).append(value ? "=[" + std::string(*value) + "]\n" : " missing\n");
+    }
+    return 0;
+}
+
+
+// params split into records of at most size bytes
+static std::string
+split_request(unsigned id, const std::string& params, std::string::size_type size)
+{
+    std::string s = begin(id);
+    for (std::string::size_type n = 0; n < params.size(); n += size)
+        s.append(record(FCGI_PARAMS, id, params.substr(n, size)));
+    return s + record(FCGI_PARAMS, id, "") + stream(FCGI_STDIN, id, "");
+}
+
+
+static void
+test()
+{
+    std::string eager_path = socket_path("params_eager");
+    FastCGIServer eager;
+    eager.complete_handler(&handle_complete);
+    eager.listen(eager_path);
+    Loop eager_loop(eager);
+
+    std::string lazy_path = socket_path("params_lazy");
+    FastCGIServer lazy;
+    lazy.complete_handler(&handle_complete);
+    lazy.lazy_params();
+    lazy.listen(lazy_path);
+    Loop lazy_loop(lazy);
+
+    std::string limited_path = socket_path("params_limited");
+    FastCGIServer limited;
+    limited.complete_handler(&handle_complete);
+    limited.params_limit(100);
+    limited.listen(limited_path);
+    Loop limited_loop(limited);
+
+    std::string params = pairs({
+        {"AB", "second"}, {"A", "first"}, {"A", "duplicate"}, {"EMPTY", ""},
+        {"LONG", std::string(300, 'v')}, {std::string(200, 'n'), "long name"},
+        {"NUL", std::string("a\0b", 3)}, {"", "no name"}, {"AB", "again"} });
+    std::string expected = "Content-Type: text/plain\r\n\r\n"
+        "A=[first]\nAB=[second]\nB missing\nEMPTY=[]\nLONG=[" + std::string(300, 'v') + "]\n" +
+        std::string(200, 'n') + "=[long name]\nMISSING missing\nNUL=[" + std::string("a\0b", 3) + "]\n"
+        "=[no name]\n";
+
+    for (std::string::size_type size : {1u, 3u, 7u, 100u, 65535u}) {
+        for (const std::string& path : {eager_path, lazy_path}) {
+            Client client(path);
+            client.send(split_request(1, params, size));
+            Response response = responses(client.read(1))[1];
+            check(response.out == expected, "params read wrong from records of " + std::to_string(size) +
+                  " bytes by " + (path == lazy_path ? "lazy" : "eager") + " params");
+        }
+    }
+
+    // a record ends within each byte of the four-byte name length
+    std::string long_pair = pairs({ {std::string(200, 'n'), "long name"} });
+    for (std::string::size_type cut : {1u, 2u, 3u}) {
+        for (const std::string& path : {eager_path, lazy_path}) {
+            Client client(path);
+            client.send(begin(1) + record(FCGI_PARAMS, 1, long_pair.substr(0, cut)) +
+                        record(FCGI_PARAMS, 1, long_pair.substr(cut)) + record(FCGI_PARAMS, 1, "") +
+                        stream(FCGI_STDIN, 1, ""));
+            Response response = responses(client.read(1))[1];
+            check(response.out.find("\n" + std::string(200, 'n') + "=[long name]\n") != std::string::npos,
+                  "name length split after " + std::to_string(cut) + " bytes read wrong");
+        }
+    }
+
+    // answered as the limit is passed, before the params end
+    Client client(limited_path);
+    client.send(begin(1) + record(FCGI_PARAMS, 1, pairs({ {"A", std::string(150, 'a')} })));
+    Response response = responses(client.read(1))[1];
+    check(response.out.find("Status: 431") == 0, "params over the limit not answered with 431");
+    check(response.protocol_status == FCGI_REQUEST_COMPLETE, "431 not a complete response");
+
+    // the rest of its records are dropped, and the connection goes on
+    client.send(record(FCGI_PARAMS, 1, "xyz") + record(FCGI_PARAMS, 1, "") + stream(FCGI_STDIN, 1, "abc"));
+    client.send(request(2, { {"A", "1"} }));
+    response = responses(client.read(1))[2];
+    check(response.out.find("A=[1]\n") != std::string::npos, "connection not usable after 431");
+    check(fetch(limited_path, { {"A", std::string(90, 'a')} }).out.find("Status:") == std::string::npos,
+          "params under the limit answered with an error");
+}
+
+
+int
+main()
+{
+    return run(&test);
+}
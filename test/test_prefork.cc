@@ -0,0 +1,172 @@
+// vim: set expandtab ts=4 sw=4 :
+/*
+ * Copyright 2024 Chris Frey.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the names of the copyright holders nor the names of contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * This file is part of the FastCGI C++ Class library (fcgicc) version 0.1,
+ * available at http://althenia.net/fcgicc
+ */
+
+
+/*
+
+$ ./test_prefork
+
+Checks prefork(): the supervisor starts two workers, which serve requests
+from the shared listener, replaces one that is killed, and stops its
+workers and returns false on SIGTERM.
+
+*/
+
+
+#include "fcgitest.h"
+
+#include <chrono>
+#include <functional>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include <fastcgi.h>
+
+using namespace fcgitest;
+
+
+static int
+handle_complete(FastCGIRequest& request)
+{
+    request.out.append("Content-Type: text/plain\r\n\r\n" + std::to_string(getpid()));
+    return 0;
+}
+
+
+// runs the supervisor, and the workers it forks
+static void
+supervise(const std::string& path, const std::string& board_path)
+{
+    int status = 1;
+    try {
+        FastCGIServer server;
+        server.complete_handler(&handle_complete);
+        server.scoreboard(board_path, 2);
+        server.listen(path);
+        if (server.prefork(2, 2))
+            server.process_forever();
+        status = 0;
+    } catch (const std::exception& e) {
+        std::cerr << "Failed in " << getpid() << ": " << e.what() << std::endl;
+    }
+    _exit(status);
+}
+
+
+static void
+wait_for(const std::function<bool()>& condition, const std::string& what)
+{
+    for (int i = 0; i < 250; i++) {
+        if (condition())
+            return;
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+    throw std::runtime_error(what);
+}
+
+
+// the pid of the worker that answers a request
+static pid_t
+serving(const std::string& path)
+{
+    Response response = fetch(path, {});
+    check(response.protocol_status == FCGI_REQUEST_COMPLETE, "request not served");
+    return static_cast<pid_t>(std::stol(response.out.substr(response.out.find("\r\n\r\n") + 4)));
+}
+
+
+static void
+test()
+{
+    std::string path = socket_path("prefork");
+    std::string board_path = "/tmp/fcgicc_prefork_board_" + std::to_string(getpid());
+    pid_t supervisor = fork();
+    check(supervisor != -1, "fork() failed");
+    if (supervisor == 0)
+        supervise(path, board_path);
+
+    int fd = -1;
+    wait_for([&] { return (fd = open(board_path.c_str(), O_RDONLY)) != -1; }, "scoreboard not created");
+    void* shared = mmap(NULL, FastCGIScoreboard::bytes(2), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    unlink(board_path.c_str());
+    check(shared != MAP_FAILED, "scoreboard not mapped");
+    FastCGIScoreboard::Slot* slots = static_cast<FastCGIScoreboard*>(shared)->slots();
+    auto started = [slots] {
+        return slots[0].state != FastCGIScoreboard::unused && slots[1].state != FastCGIScoreboard::unused;
+    };
+
+    wait_for(started, "workers not started");
+    pid_t first = static_cast<pid_t>(slots[0].pid.load());
+    pid_t second = static_cast<pid_t>(slots[1].pid.load());
+    check(first != supervisor && second != supervisor && first != second, "not two workers");
+
+    std::set<pid_t> workers = {first, second};
+    wait_for([&] { return access(path.c_str(), F_OK) == 0; }, "listener not created");
+    for (int i = 0; i < 10; i++)
+        check(workers.count(serving(path)) == 1, "request served by another process");
+
+    // the supervisor sees the death within a tick
+    check(kill(first, SIGKILL) == 0, "kill() failed");
+    wait_for([&] { return static_cast<pid_t>(slots[0].pid.load()) != first && started(); },
+             "killed worker not replaced");
+    pid_t replacement = static_cast<pid_t>(slots[0].pid.load());
+    check(kill(replacement, 0) == 0 && replacement != second, "replacement not running");
+
+    workers = {replacement, second};
+    for (int i = 0; i < 10; i++)
+        check(workers.count(serving(path)) == 1, "request not served after the replacement");
+
+    check(kill(supervisor, SIGTERM) == 0, "kill() failed");
+    int status = -1;
+    wait_for([&] { return waitpid(supervisor, &status, WNOHANG) == supervisor; }, "supervisor did not stop");
+    check(WIFEXITED(status) && WEXITSTATUS(status) == 0, "supervisor failed");
+    check(kill(replacement, 0) == -1 && kill(second, 0) == -1, "workers left running");
+    munmap(shared, FastCGIScoreboard::bytes(2));
+}
+
+
+int
+main()
+{
+    return run(&test);
+}
@@ -0,0 +1,265 @@
+// vim: set expandtab ts=4 sw=4 :
+/*
+ * Copyright 2024 Chris Frey.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the names of the copyright holders nor the names of contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * This file is part of the FastCGI C++ Class library (fcgicc) version 0.1,
+ * available at http://althenia.net/fcgicc
+ */
+
+
+/*
+
+$ ./test_proxy
+
+Checks FastCGIProxy with real backends: responses are relayed, one cut short
+by its backend ends with a non-zero application status, and neither a client
+that does not read nor a backend that does not read makes the proxy buffer
+all that the other side sends.  Also checks the health checks: a backend
+that is down is left out after max_failures, tried again with a single
+request once retry_ms has passed, and used again once that succeeds.
+
+*/
+
+
+#include "fcgitest.h"
+
+#include <chrono>
+#include <string>
+#include <thread>
+
+#include <fcntl.h>
+#include <poll.h>
+
+#include <fastcgi.h>
+
+using namespace fcgitest;
+
+
+static int
+handle_complete(FastCGIRequest& request)
+{
+    request.out.append("Content-Type: text/plain\r\n\r\n");
+    if (request.param("BIG"))
+        request.out.append(10000000, 'x');
+    else
+        request.out.append(std::to_string(request.in.size()));
+    return 0;
+}
+
+
+static int
+handle_revived(FastCGIRequest& request)
+{
+    request.out.append("Content-Type: text/plain\r\n\r\nrevived");
+    return 0;
+}
+
+
+class Proxy : public FastCGIProxy {
+public:
+    // what the clients' connections hold, while the loop is stopped
+    std::string::size_type held() const {
+        std::string::size_type size = 0;
+        for (auto &[sock, connection] : read_sockets)
+            size += connection->buffered();
+        return size;
+    }
+};
+
+
+// a local socket that accepts connections but is never read
+static int
+listen_socket(const std::string& path)
+{
+    int fd = socket(PF_UNIX, SOCK_STREAM, 0);
+    check(fd != -1, "socket() failed");
+    struct sockaddr_un sa;
+    bzero(&sa, sizeof(sa));
+    sa.sun_family = AF_LOCAL;
+    std::strncpy(sa.sun_path, path.c_str(), sizeof(sa.sun_path) - 1);
+    unlink(path.c_str());
+    check(bind(fd, (struct sockaddr*)&sa, sizeof(sa)) == 0 && ::listen(fd, 8) == 0, "listen() failed");
+    return fd;
+}
+
+
+static void
+settle()
+{
+    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+}
+
+
+// the body of the response to a request through the proxy, or its status
+static std::string
+answer(const std::string& path)
+{
+    Response response = fetch(path, {});
+    check(response.protocol_status == FCGI_REQUEST_COMPLETE, "request not completed");
+    if (response.out.compare(0, 8, "Status: ") == 0)
+        return response.out.substr(8, 3);
+    return response.out.substr(response.out.find("\r\n\r\n") + 4);
+}
+
+
+static void
+test_health()
+{
+    std::string down_path = socket_path("proxy_down");
+    std::string up_path = socket_path("proxy_up");
+    unlink(down_path.c_str());
+    FastCGIServer up;
+    up.complete_handler(&handle_complete);
+    up.listen(up_path);
+    Loop up_loop(up);
+
+    // of two idle backends, the first is picked
+    std::string path = socket_path("proxy_health");
+    Proxy proxy;
+    proxy.backend(down_path);
+    proxy.backend(up_path);
+    proxy.health_checks(2, 300);
+    proxy.listen(path);
+    Loop loop(proxy);
+
+    check(answer(path) == "502" && answer(path) == "502", "backend that is down not tried");
+    for (int i = 0; i < 3; i++)
+        check(answer(path) == "0", "backend that is down not left out");
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(350));
+    check(answer(path) == "502", "backend that is down not tried again");
+    check(answer(path) == "0", "backend still down not left out again");
+
+    FastCGIServer revived;
+    revived.complete_handler(&handle_revived);
+    revived.listen(down_path);
+    Loop revived_loop(revived);
+    check(answer(path) == "0", "backend tried again before retry_ms");
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(350));
+    check(answer(path) == "revived", "revived backend not tried");
+    check(answer(path) == "revived", "revived backend not used again");
+}
+
+
+static void
+test()
+{
+    test_health();
+
+    std::string backend_path = socket_path("proxy_backend");
+    FastCGIServer backend;
+    backend.complete_handler(&handle_complete);
+    backend.listen(backend_path);
+    Loop backend_loop(backend);
+
+    std::string path = socket_path("proxy");
+    Proxy proxy;
+    proxy.backend(backend_path);
+    proxy.listen(path);
+
+    {
+        Loop loop(proxy);
+        Response response = fetch(path, {}, "abc");
+        check(response.protocol_status == FCGI_REQUEST_COMPLETE && response.app_status == 0,
+              "relayed request not completed");
+        check(response.out == "Content-Type: text/plain\r\n\r\n3", "relayed response wrong");
+    }
+
+    // a client that does not read a large response
+    Client client(path);
+    client.send(request(1, { {"BIG", "1"} }));
+    {
+        Loop loop(proxy);
+        settle();
+    }
+    check(proxy.held() < 1000000, "proxy buffered a response its client does not read");
+    {
+        Loop loop(proxy);
+        std::string::size_type size = 0;
+        for (const Record& r : client.read(1))
+            if (r.type == FCGI_STDOUT)
+                size += r.content.size();
+        check(size == 10000000 + 28, "held back response cut short");
+    }
+
+    // a backend that answers in part and then goes away
+    std::string partial_path = socket_path("proxy_partial");
+    int partial = listen_socket(partial_path);
+    std::thread partial_backend([partial] {
+        int fd = accept(partial, NULL, NULL);
+        char buffer[4096];
+        if (fd != -1 && ::read(fd, buffer, sizeof(buffer)) > 0) {
+            std::string out = record(FCGI_STDOUT, 1, "Content-Type: text/plain\r\n\r\npartial");
+            if (write(fd, out.data(), out.size()) != static_cast<ssize_t>(out.size()))
+                std::cerr << "write() failed" << std::endl;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        close(fd);
+    });
+    Proxy cut;
+    cut.backend(partial_path);
+    std::string cut_path = socket_path("proxy_cut");
+    cut.listen(cut_path);
+    {
+        Loop loop(cut);
+        Response response = fetch(cut_path, {});
+        partial_backend.join();
+        check(response.out == "Content-Type: text/plain\r\n\r\npartial", "partial response not relayed");
+        check(response.protocol_status == FCGI_REQUEST_COMPLETE && response.app_status != 0,
+              "response cut short ends with status 0");
+    }
+
+    // a backend that never reads: the client cannot send it all its stdin
+    Proxy stuck;
+    stuck.backend(partial_path);
+    std::string stuck_path = socket_path("proxy_stuck");
+    stuck.listen(stuck_path);
+    Loop loop(stuck);
+    Client sender(stuck_path);
+    sender.send(begin(1) + stream(FCGI_PARAMS, 1, pairs({})));
+    fcntl(sender.fd, F_SETFL, fcntl(sender.fd, F_GETFL) | O_NONBLOCK);
+    std::string chunk = record(FCGI_STDIN, 1, std::string(FCGI_MAX_LENGTH, 'x'));
+    std::string::size_type sent = 0;
+    struct pollfd p = { sender.fd, POLLOUT, 0 };
+    while (sent < 20000000 && poll(&p, 1, 300) == 1) {
+        ssize_t result = write(sender.fd, chunk.data(), chunk.size());
+        if (result > 0)
+            sent += static_cast<std::string::size_type>(result);
+    }
+    check(sent < 10000000, "proxy read all stdin for a backend that does not read");
+    close(partial);
+}
+
+
+int
+main()
+{
+    return run(&test);
+}
@@ -0,0 +1,118 @@
+// vim: set expandtab ts=4 sw=4 :
+/*
+ * Copyright 2024 Chris Frey.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the names of the copyright holders nor the names of contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * This file is part of the FastCGI C++ Class library (fcgicc) version 0.1,
+ * available at http://althenia.net/fcgicc
+ */
+
+
+/*
+
+$ ./test_quantum
+
+Checks the write scheduler: with an output quantum, a small response
+multiplexed behind a large one on the same connection ends before it,
+while without one the large response goes out first in one piece.
+
+*/
+
+
+#include "fcgitest.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <fastcgi.h>
+
+using namespace fcgitest;
+
+
+static const std::string::size_type big_size = 1 << 20;
+
+
+static int
+handle_complete(FastCGIRequest& request)
+{
+    request.out.append("Content-Type: text/plain\r\n\r\n");
+    if (request.param("BIG"))
+        for (std::string::size_type n = 0; n < big_size; n++)
+            request.out.push_back(static_cast<char>('a' + n % 26));
+    else
+        request.out.append("small");
+    return 0;
+}
+
+
+// Returns the request ids in the order their FCGI_END_REQUEST arrived.
+static std::vector<unsigned>
+end_order(std::string::size_type quantum, std::map<unsigned, Response>& found)
+{
+    std::string path = socket_path("quantum");
+    FastCGIServer server;
+    server.complete_handler(&handle_complete);
+    server.output_quantum(quantum);
+    server.listen(path);
+    Loop loop(server);
+
+    Client client(path);
+    client.send(request(1, { {"BIG", "1"} }) + request(2, {}));
+    std::vector<Record> records = client.read(2);
+    found = responses(records);
+
+    std::vector<unsigned> order;
+    for (const Record& r : records)
+        if (r.type == FCGI_END_REQUEST)
+            order.push_back(r.id);
+    return order;
+}
+
+
+static void
+test()
+{
+    std::map<unsigned, Response> found;
+    std::vector<unsigned> order = end_order(4096, found);
+    check(order == std::vector<unsigned>({2, 1}), "small response waited behind the large one");
+    check(found[2].out == "Content-Type: text/plain\r\n\r\nsmall", "small response garbled");
+    check(found[1].out.size() == 28 + big_size && found[1].out.compare(28, 3, "abc") == 0 &&
+          found[1].out[28 + big_size - 1] == 'a' + (big_size - 1) % 26, "large response garbled");
+
+    order = end_order(0, found);
+    check(order == std::vector<unsigned>({1, 2}), "without a quantum, the first response did not go first");
+    check(found[1].out.size() == 28 + big_size, "large response garbled without a quantum");
+}
+
+
+int
+main()
+{
+    return run(&test);
+}
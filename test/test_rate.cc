@@ -0,0 +1,146 @@
+// vim: set expandtab ts=4 sw=4 :
+/*
+ * Copyright 2024 Chris Frey.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the names of the copyright holders nor the names of contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * This file is part of the FastCGI C++ Class library (fcgicc) version 0.1,
+ * available at http://althenia.net/fcgicc
+ */
+
+
+/*
+
+$ ./test_rate
+
+Checks rate_limit(): a client may make a burst of requests at once and then
+gets 429, its bucket refills at the rate, a new client pushes the least
+recently limited one out of a full table, and a rate too low to keep in a
+duration is refused.
+
+*/
+
+
+#include "fcgitest.h"
+
+#include <chrono>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#include <fastcgi.h>
+
+using namespace fcgitest;
+
+
+static int
+handle_request(FastCGIRequest& request)
+{
+    request.out.append("Content-Type: text/plain\r\n\r\nok\n");
+    return 0;
+}
+
+
+static bool
+allowed(const std::string& path, const std::string& client)
+{
+    Response response = fetch(path, { {"REMOTE_ADDR", client} });
+    check(response.out == "Content-Type: text/plain\r\n\r\nok\n" ||
+          response.out.compare(0, 12, "Status: 429 ") == 0,
+          "neither allowed nor limited:\n" + response.out);
+    return response.out.compare(0, 12, "Status: 429 ") != 0;
+}
+
+
+static bool
+refused(FastCGIServer& server, double rate, double burst)
+{
+    try {
+        server.rate_limit("REMOTE_ADDR", rate, burst);
+    } catch (const std::invalid_argument&) {
+        return true;
+    }
+    return false;
+}
+
+
+static void
+test()
+{
+    {
+        // a token every 100 ms, three at once
+        std::string path = socket_path("rate");
+        FastCGIServer server;
+        server.request_handler(&handle_request);
+        server.rate_limit("REMOTE_ADDR", 10, 3);
+        server.listen(path);
+        Loop loop(server);
+
+        for (int i = 0; i < 3; i++)
+            check(allowed(path, "10.0.0.1"), "burst not allowed");
+        check(!allowed(path, "10.0.0.1"), "request over the burst allowed");
+        check(allowed(path, "10.0.0.2"), "another client limited");
+        check(fetch(path, {}).out == "Content-Type: text/plain\r\n\r\nok\n", "request without the key limited");
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(150));
+        check(allowed(path, "10.0.0.1"), "bucket not refilled");
+        check(!allowed(path, "10.0.0.1"), "bucket refilled too much");
+
+        loop.stop();
+        check(server.stats().requests_limited == 2, "limited requests not counted");
+    }
+
+    {
+        // one request a second, in a table of 8 that any key may use all of
+        std::string path = socket_path("rate_evict");
+        FastCGIServer server;
+        server.request_handler(&handle_request);
+        server.rate_limit("REMOTE_ADDR", 1, 1, 8);
+        server.listen(path);
+        Loop loop(server);
+
+        for (int i = 1; i <= 8; i++)
+            check(allowed(path, "10.0.1." + std::to_string(i)), "new client limited");
+        check(!allowed(path, "10.0.1.1"), "client in a full table not limited");
+        check(allowed(path, "10.0.1.9"), "client beyond the table limited");
+        check(!allowed(path, "10.0.1.2"), "client not pushed out forgotten");
+        check(allowed(path, "10.0.1.1"), "client pushed out still limited");
+    }
+
+    FastCGIServer server;
+    check(refused(server, 0, 1), "zero rate accepted");
+    check(refused(server, 1e-30, 1), "rate beyond a duration accepted");
+    check(refused(server, 1, 1e30), "burst beyond a duration accepted");
+    check(!refused(server, 1e-3, 10), "low rate refused");
+}
+
+
+int
+main()
+{
+    return run(&test);
+}
@@ -0,0 +1,136 @@
+// vim: set expandtab ts=4 sw=4 :
+/*
+ * Copyright 2024 Chris Frey.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the names of the copyright holders nor the names of contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * This file is part of the FastCGI C++ Class library (fcgicc) version 0.1,
+ * available at http://althenia.net/fcgicc
+ */
+
+
+/*
+
+$ ./test_reserve
+
+Checks FastCGIRequest::out_reserve() and out_commit(): output written in
+place keeps its order with output appended to out before and after it, is
+split into records of at most 65535 bytes, and a second reservation before
+a commit is refused.
+
+*/
+
+
+#include "fcgitest.h"
+
+#include <cstring>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <fastcgi.h>
+
+using namespace fcgitest;
+
+
+static const std::string headers("Content-Type: text/plain\r\n\r\n");
+
+
+static int
+handle_complete(FastCGIRequest& request)
+{
+    request.out.append(headers);
+
+    if (request.param("LARGE")) {
+        // 200000 bytes written in place in pieces of up to 30000
+        for (std::string::size_type n = 0; n < 200000; ) {
+            std::string::size_type size = std::min<std::string::size_type>(30000, 200000 - n);
+            char* p = request.out_reserve(size);
+            for (std::string::size_type i = 0; i < size; i++)
+                p[i] = static_cast<char>('a' + (n + i) % 26);
+            request.out_commit(size);
+            n += size;
+        }
+        return 0;
+    }
+
+    std::string::size_type size = 10;
+    char* p = request.out_reserve(size);
+    std::memcpy(p, "first", 5);
+    try {
+        std::string::size_type other = 10;
+        request.out_reserve(other);
+        request.out.append("|not refused|");
+    } catch (const std::logic_error&) {
+    }
+    request.out_commit(5);
+
+    request.out.append("|middle|");
+    size = 10;
+    p = request.out_reserve(size);
+    std::memcpy(p, "second", 6);
+    request.out_commit(6);
+    request.out.append("|last");
+    return 0;
+}
+
+
+static void
+test()
+{
+    std::string path = socket_path("reserve");
+    FastCGIServer server;
+    server.complete_handler(&handle_complete);
+    server.listen(path);
+    Loop loop(server);
+
+    Response response = fetch(path, {});
+    check(response.protocol_status == FCGI_REQUEST_COMPLETE, "request not completed");
+    check(response.out == headers + "first|middle|second|last", "output out of order: " + response.out);
+
+    Client client(path);
+    client.send(request(1, { {"LARGE", "1"} }));
+    std::vector<Record> records = client.read(1);
+    std::string out;
+    for (const Record& r : records)
+        if (r.type == FCGI_STDOUT) {
+            check(r.content.size() <= FCGI_MAX_LENGTH, "record too long");
+            out.append(r.content);
+        }
+    check(out.size() == headers.size() + 200000 && out.compare(0, headers.size(), headers) == 0,
+          "large output has the wrong size");
+    for (std::string::size_type n = 0; n < 200000; n++)
+        check(out[headers.size() + n] == static_cast<char>('a' + n % 26), "large output garbled");
+}
+
+
+int
+main()
+{
+    return run(&test);
+}
@@ -0,0 +1,121 @@
+// vim: set expandtab ts=4 sw=4 :
+/*
+ * Copyright 2024 Chris Frey.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the names of the copyright holders nor the names of contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * This file is part of the FastCGI C++ Class library (fcgicc) version 0.1,
+ * available at http://althenia.net/fcgicc
+ */
+
+
+/*
+
+$ ./test_roles
+
+Checks the handling of FCGI_BEGIN_REQUEST roles: an unknown role is
+refused with FCGI_UNKNOWN_ROLE and the connection stays usable, unless it
+was not to be kept.  Also checks the replies to unknown record types and
+FCGI_ABORT_REQUEST.
+
+*/
+
+
+#include "fcgitest.h"
+
+#include <map>
+#include <string>
+
+#include <fastcgi.h>
+
+using namespace fcgitest;
+
+
+static int
+handle_complete(FastCGIRequest& request)
+{
+    request.out.append("Content-Type: text/plain\r\n\r\nrole=").append(std::to_string(request.role))
+        .append(" in=").append(request.in);
+    return 0;
+}
+
+
+static void
+test()
+{
+    std::string path = socket_path("roles");
+    FastCGIServer server;
+    server.complete_handler(&handle_complete);
+    server.listen(path);
+    Loop loop(server);
+
+    {
+        Client client(path);
+        client.send(begin(1, 7));
+        std::map<unsigned, Response> found = responses(client.read(1));
+        check(found[1].protocol_status == FCGI_UNKNOWN_ROLE && found[1].app_status == 0,
+              "unknown role not refused with FCGI_UNKNOWN_ROLE");
+
+        // the connection is still good for others
+        client.send(request(2, {}, "x"));
+        found = responses(client.read(1));
+        check(found[2].out.find("role=1 in=x") != std::string::npos, "responder after an unknown role failed");
+    }
+
+    {
+        // without FCGI_KEEP_CONN, the refusal closes the connection
+        Client client(path);
+        client.send(begin(1, 0, false));
+        std::map<unsigned, Response> found = responses(client.read(1));
+        check(found[1].protocol_status == FCGI_UNKNOWN_ROLE, "role 0 not refused");
+        check(client.closed(), "connection not closed after refusing a role");
+    }
+
+    {
+        Client client(path);
+        client.send(record(99, 0, std::string()));
+        std::vector<Record> records = client.read(1, FCGI_UNKNOWN_TYPE);
+        check(records.size() == 1 && records[0].content.size() == sizeof(FCGI_UnknownTypeBody) &&
+              static_cast<unsigned char>(records[0].content[0]) == 99, "unknown record type not reported");
+
+        // an aborted request ends with application status 1
+        client.send(begin(1) + stream(FCGI_PARAMS, 1, pairs({})) + record(FCGI_ABORT_REQUEST, 1, std::string()));
+        std::map<unsigned, Response> found = responses(client.read(1));
+        check(found[1].protocol_status == FCGI_REQUEST_COMPLETE && found[1].app_status == 1,
+              "aborted request not ended");
+    }
+
+    loop.stop();
+    check(server.stats().requests_active == 0, "requests left active");
+}
+
+
+int
+main()
+{
+    return run(&test);
+}
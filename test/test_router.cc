@@ -0,0 +1,144 @@
+// vim: set expandtab ts=4 sw=4 :
+/*
+ * Copyright 2024 Chris Frey.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the names of the copyright holders nor the names of contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * This file is part of the FastCGI C++ Class library (fcgicc) version 0.1,
+ * available at http://althenia.net/fcgicc
+ */
+
+
+/*
+
+$ ./test_router
+
+Checks FastCGIRouter: exact, parameter and rest routes match with their
+captures, a route that matches the path but not the method is passed over
+for one that matches both, and a path with no route for the method gets 405
+with an Allow header, one with no route at all 404.
+
+*/
+
+
+#include "fcgitest.h"
+
+#include <stdexcept>
+#include <string>
+
+#include <fastcgi.h>
+
+using namespace fcgitest;
+
+
+static int
+handle_route(FastCGIRequest& request, const FastCGIRouter::Captures& captures)
+{
+    request.out.append("Content-Type: text/plain\r\n\r\n");
+    for (unsigned i = 0; i < captures.size(); i++)
+        request.out.append(std::string(captures.name(i)) + "=" + std::string(captures.value(i)) + "\n");
+    return 0;
+}
+
+
+static int
+handle_other(FastCGIRequest& request, const FastCGIRouter::Captures&)
+{
+    request.out.append("Content-Type: text/plain\r\n\r\nother\n");
+    return 0;
+}
+
+
+static Response
+fetch_route(const std::string& path, const std::string& method, const std::string& uri)
+{
+    return fetch(path, { {"REQUEST_METHOD", method}, {"REQUEST_URI", uri} });
+}
+
+
+static void
+test()
+{
+    FastCGIRouter router;
+    router.add("GET", "/a/b/:x", &handle_route);
+    router.add("POST", "/a/:y/c", &handle_route);
+    router.add("GET", "/a/b/d", &handle_other);
+    router.add("", "/files/*rest", &handle_route);
+
+    bool threw = false;
+    try {
+        router.add("GET", "/a/b/:x", &handle_other);
+    } catch (const std::invalid_argument&) {
+        threw = true;
+    }
+    check(threw, "route added twice");
+
+    FastCGIRouter::Captures captures;
+    bool path_found = false;
+    check(router.find("DELETE", "/a/b/c", captures, &path_found) == nullptr && path_found,
+          "path of other methods not found");
+    path_found = false;
+    check(router.find("GET", "/nowhere", captures, &path_found) == nullptr && !path_found,
+          "unknown path found");
+    check(router.allowed("/a/b/c") == "GET, POST", "wrong methods allowed: " + router.allowed("/a/b/c"));
+    check(router.allowed("/a/b/d") == "GET", "wrong methods allowed: " + router.allowed("/a/b/d"));
+
+    std::string path = socket_path("router");
+    FastCGIServer server;
+    server.request_handler(router, &FastCGIRouter::handle);
+    server.listen(path);
+    Loop loop(server);
+
+    Response response = fetch_route(path, "GET", "/a/b/c?q=1");
+    check(response.out == "Content-Type: text/plain\r\n\r\nx=c\n", "GET not routed:\n" + response.out);
+
+    // matches the GET route's path first, then backtracks
+    response = fetch_route(path, "POST", "/a/b/c");
+    check(response.out == "Content-Type: text/plain\r\n\r\ny=b\n", "POST not routed:\n" + response.out);
+
+    response = fetch_route(path, "GET", "/a/b/d");
+    check(response.out == "Content-Type: text/plain\r\n\r\nother\n", "exact route not preferred:\n" + response.out);
+
+    response = fetch_route(path, "PUT", "/files/x/y.txt");
+    check(response.out == "Content-Type: text/plain\r\n\r\nrest=x/y.txt\n", "rest not routed:\n" + response.out);
+
+    response = fetch_route(path, "PUT", "/a/b/c");
+    check(response.out.compare(0, 12, "Status: 405 ") == 0 &&
+          response.out.find("\r\nAllow: GET, POST\r\n") != std::string::npos,
+          "no 405 with Allow:\n" + response.out);
+
+    response = fetch_route(path, "GET", "/nowhere");
+    check(response.out.compare(0, 12, "Status: 404 ") == 0 && response.out.find("Allow:") == std::string::npos,
+          "no 404:\n" + response.out);
+}
+
+
+int
+main()
+{
+    return run(&test);
+}
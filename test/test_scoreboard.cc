@@ -0,0 +1,130 @@
+// vim: set expandtab ts=4 sw=4 :
+/*
+ * Copyright 2024 Chris Frey.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the names of the copyright holders nor the names of contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * This file is part of the FastCGI C++ Class library (fcgicc) version 0.1,
+ * available at http://althenia.net/fcgicc
+ */
+
+
+/*
+
+$ ./test_scoreboard
+
+Checks what a server publishes in its scoreboard slot between iterations:
+the state it is waiting in, and when the oldest of its requests began.
+
+*/
+
+
+#include "fcgitest.h"
+
+#include <chrono>
+#include <string>
+#include <thread>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <fastcgi.h>
+
+using namespace fcgitest;
+
+
+static int
+handle_complete(FastCGIRequest& request)
+{
+    request.out.append("Content-Type: text/plain\r\n\r\n");
+    return 0;
+}
+
+
+static void
+settle()
+{
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+}
+
+
+static void
+test()
+{
+    std::string path = socket_path("scoreboard");
+    std::string board_path = "/tmp/fcgicc_board_" + std::to_string(getpid());
+    FastCGIServer server;
+    server.complete_handler(&handle_complete);
+    server.scoreboard(board_path, 1);
+    server.listen(path);
+
+    int fd = open(board_path.c_str(), O_RDONLY);
+    check(fd != -1, "scoreboard not created");
+    void* shared = mmap(NULL, FastCGIScoreboard::bytes(1), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    unlink(board_path.c_str());
+    check(shared != MAP_FAILED, "scoreboard not mapped");
+    FastCGIScoreboard::Slot& slot = static_cast<FastCGIScoreboard*>(shared)->slots()[0];
+
+    Loop loop(server);
+    settle();
+    check(slot.state == FastCGIScoreboard::idle, "not idle at first");
+    check(slot.request_start_us == 0, "request start set while idle");
+
+    // both wait for stdin
+    Client first(path);
+    first.send(begin(1) + stream(FCGI_PARAMS, 1, pairs({})));
+    settle();
+    check(slot.state == FastCGIScoreboard::reading_request, "not reading a request");
+    long long first_start = slot.request_start_us;
+    check(first_start != 0, "request start not set");
+
+    Client second(path);
+    second.send(begin(1) + stream(FCGI_PARAMS, 1, pairs({})));
+    settle();
+    check(slot.request_start_us == first_start, "request start is not the oldest");
+
+    first.send(stream(FCGI_STDIN, 1, ""));
+    first.read(1);
+    settle();
+    check(slot.request_start_us > first_start, "request start not moved to the next oldest");
+
+    second.send(stream(FCGI_STDIN, 1, ""));
+    second.read(1);
+    settle();
+    check(slot.state == FastCGIScoreboard::idle, "not idle at last");
+    check(slot.request_start_us == 0, "request start set while idle");
+    munmap(shared, FastCGIScoreboard::bytes(1));
+}
+
+
+int
+main()
+{
+    return run(&test);
+}
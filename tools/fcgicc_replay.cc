@@ -0,0 +1,371 @@
+// vim: set expandtab ts=4 sw=4 :
+/*
+ * Copyright 2008, 2009 Andrey Zholos. All rights reserved.
+ * Copyright 2024 Chris Frey.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the names of the copyright holders nor the names of contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * This file is part of the FastCGI C++ Class library (fcgicc) version 0.1,
+ * available at http://althenia.net/fcgicc
+ */
+
+
+
+
+
+// Replays a capture written by FastCGIServerBase::capture() against a
+// server and reports throughput and latency.  Each captured connection gets
+// a connection of its own, to which its input is sent at the original times
+// (scaled by -s) or, with -f, as fast as possible; input that begins a
+// request is held back while a request with the same id is still running
+// on that connection, as the web server would have.  Latency runs from the
+// FCGI_BEGIN_REQUEST record being sent to the FCGI_END_REQUEST arriving.
+//
+//     fcgicc_replay [-f | -s SPEED] FILE ADDRESS
+//
+// ADDRESS is "host:port" or the path of a local socket.
+
+#include <fcgicc.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <fastcgi.h>
+
+
+typedef std::chrono::steady_clock Clock;
+
+struct Event {
+    unsigned long long time_us;
+    unsigned connection;
+    std::string::size_type offset;          // of the data in the capture
+    unsigned length;
+    std::vector<unsigned> begins;           // ids of the requests it begins
+};
+
+// Finds record boundaries in a byte stream.
+struct Scanner {
+    Scanner() : skip(0) {}
+
+    template<class F>
+    void feed(const char* data, std::string::size_type size, F record) {
+        while (size > 0) {
+            if (skip > 0) {
+                std::string::size_type n = std::min(skip, size);
+                skip -= n;
+                data += n;
+                size -= n;
+                continue;
+            }
+            std::string::size_type n = std::min(FCGI_HEADER_LEN - header.size(), size);
+            header.append(data, n);
+            data += n;
+            size -= n;
+            if (header.size() == FCGI_HEADER_LEN) {
+                const FCGI_Header& h = *reinterpret_cast<const FCGI_Header*>(header.data());
+                record(h.type, (static_cast<unsigned>(h.requestIdB1) << 8) + h.requestIdB0);
+                skip = (static_cast<std::string::size_type>(h.contentLengthB1) << 8) +
+                    h.contentLengthB0 + h.paddingLength;
+                header.clear();
+            }
+        }
+    }
+
+    std::string header;
+    std::string::size_type skip;
+};
+
+struct Replay {
+    Replay() : fd(-1), closing(false), finished(false) {}
+
+    int fd;
+    std::deque<std::size_t> queue;          // events still to send
+    std::string output;
+    bool closing;                           // input ended in the capture
+    bool finished;
+    Scanner sent;                           // used while loading
+    Scanner received;
+    std::map<unsigned, Clock::time_point> started;
+};
+
+
+static int
+connect_to(const std::string& address)
+{
+    int fd;
+    if (address.find('/') != std::string::npos) {
+        struct sockaddr_un sa;
+        if (address.size() >= sizeof(sa.sun_path)) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        std::memset(&sa, 0, sizeof(sa));
+        sa.sun_family = AF_UNIX;
+        std::memcpy(sa.sun_path, address.c_str(), address.size() + 1);
+        fd = socket(PF_UNIX, SOCK_STREAM, 0);
+        if (fd != -1 && connect(fd, reinterpret_cast<struct sockaddr*>(&sa), sizeof(sa)) == -1) {
+            close(fd);
+            return -1;
+        }
+    } else {
+        std::string::size_type colon = address.rfind(':');
+        struct addrinfo hints;
+        std::memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        struct addrinfo* found;
+        if (colon == std::string::npos ||
+                getaddrinfo(address.substr(0, colon).c_str(), address.c_str() + colon + 1, &hints, &found) != 0) {
+            errno = EINVAL;
+            return -1;
+        }
+        fd = socket(found->ai_family, found->ai_socktype, found->ai_protocol);
+        if (fd != -1 && connect(fd, found->ai_addr, found->ai_addrlen) == -1) {
+            close(fd);
+            fd = -1;
+        }
+        freeaddrinfo(found);
+    }
+    if (fd != -1)
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+
+int main(int argc, const char* argv[])
+{
+    bool fast = false;
+    double speed = 1;
+    int arg = 1;
+    for (; arg < argc && argv[arg][0] == '-'; arg++) {
+        if (std::strcmp(argv[arg], "-f") == 0)
+            fast = true;
+        else if (std::strcmp(argv[arg], "-s") == 0 && arg + 1 < argc && std::atof(argv[arg + 1]) > 0)
+            speed = std::atof(argv[++arg]);
+        else
+            break;
+    }
+    if (argc - arg != 2) {
+        std::fprintf(stderr, "usage: %s [-f | -s SPEED] FILE ADDRESS\n", argv[0]);
+        return 2;
+    }
+    const char* path = argv[arg];
+    std::string address = argv[arg + 1];
+
+    std::string capture;
+    {
+        int file = open(path, O_RDONLY);
+        struct stat st;
+        if (file == -1 || fstat(file, &st) == -1) {
+            std::perror(path);
+            return 1;
+        }
+        capture.resize(static_cast<std::size_t>(st.st_size));
+        std::size_t n = 0;
+        while (n < capture.size()) {
+            ssize_t result = read(file, &capture[n], capture.size() - n);
+            if (result <= 0) {
+                std::perror(path);
+                return 1;
+            }
+            n += static_cast<std::size_t>(result);
+        }
+        close(file);
+    }
+
+    const FastCGICapture* header = reinterpret_cast<const FastCGICapture*>(capture.data());
+    if (capture.size() < sizeof(FastCGICapture) || std::memcmp(header->magic, "FCGICCCP", 8) != 0 ||
+            header->version != 1) {
+        std::fprintf(stderr, "%s: not a capture\n", path);
+        return 1;
+    }
+
+    std::vector<Event> events;
+    std::map<unsigned, Replay> replays;
+    for (std::string::size_type n = sizeof(FastCGICapture); n + sizeof(FastCGICapture::Chunk) <= capture.size(); ) {
+        FastCGICapture::Chunk chunk;
+        std::memcpy(&chunk, capture.data() + n, sizeof(chunk));
+        n += sizeof(chunk);
+        if (capture.size() - n < chunk.length)
+            break;
+        Replay& replay = replays[chunk.connection];
+        replay.queue.push_back(events.size());
+        events.push_back(Event{chunk.time_us, chunk.connection, n, chunk.length, {}});
+        replay.sent.feed(capture.data() + n, chunk.length, [&](unsigned char type, unsigned id) {
+            if (type == FCGI_BEGIN_REQUEST)
+                events.back().begins.push_back(id);
+        });
+        n += chunk.length;
+    }
+
+    std::vector<double> latencies;
+    unsigned long failed = 0;
+    unsigned long long bytes_sent = 0;
+    unsigned long long bytes_received = 0;
+    Clock::time_point start = Clock::now();
+
+    for (;;) {
+        Clock::time_point now = Clock::now();
+        double elapsed_us = std::chrono::duration<double, std::micro>(now - start).count();
+        double wait_us = -1;
+        bool pending = false;
+
+        for (auto &[id, replay] : replays) {
+            while (!replay.queue.empty() && !replay.finished) {
+                const Event& event = events[replay.queue.front()];
+                double due_us = fast ? 0 : static_cast<double>(event.time_us) / speed;
+                if (due_us > elapsed_us) {
+                    if (wait_us < 0 || due_us - elapsed_us < wait_us)
+                        wait_us = due_us - elapsed_us;
+                    break;
+                }
+                if (std::any_of(event.begins.begin(), event.begins.end(),
+                                [&](unsigned begin) { return replay.started.count(begin) != 0; }))
+                    break;
+
+                replay.queue.pop_front();
+                if (replay.fd == -1) {
+                    replay.fd = connect_to(address);
+                    if (replay.fd == -1) {
+                        std::perror(address.c_str());
+                        return 1;
+                    }
+                }
+                if (event.length == 0)
+                    replay.closing = true;
+                replay.output.append(capture, event.offset, event.length);
+                for (unsigned begin : event.begins)
+                    replay.started[begin] = now;
+            }
+            if (!replay.queue.empty() && !replay.finished)
+                pending = true;
+        }
+
+        std::vector<struct pollfd> fds;
+        std::vector<unsigned> owners;
+        for (auto &[id, replay] : replays) {
+            if (replay.fd == -1 || replay.finished)
+                continue;
+            if (replay.output.empty() && replay.started.empty() && replay.queue.empty()) {
+                // nothing more to send or wait for
+                if (replay.closing)
+                    shutdown(replay.fd, SHUT_WR);
+                else {
+                    close(replay.fd);
+                    replay.finished = true;
+                    continue;
+                }
+            }
+            short events_wanted = POLLIN;
+            if (!replay.output.empty())
+                events_wanted |= POLLOUT;
+            fds.push_back(pollfd{replay.fd, events_wanted, 0});
+            owners.push_back(id);
+        }
+        if (fds.empty() && !pending)
+            break;
+
+        int timeout = wait_us < 0 ? -1 : static_cast<int>(wait_us / 1000);
+        if (poll(fds.data(), fds.size(), timeout) == -1) {
+            if (errno == EINTR)
+                continue;
+            std::perror("poll");
+            return 1;
+        }
+
+        now = Clock::now();
+        for (std::size_t i = 0; i < fds.size(); i++) {
+            Replay& replay = replays[owners[i]];
+            if (fds[i].revents & POLLOUT) {
+                ssize_t result = send(replay.fd, replay.output.data(), replay.output.size(), MSG_NOSIGNAL);
+                if (result > 0) {
+                    replay.output.erase(0, static_cast<std::string::size_type>(result));
+                    bytes_sent += static_cast<unsigned long long>(result);
+                }
+            }
+            if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+                char buffer[16384];
+                ssize_t result = read(replay.fd, buffer, sizeof(buffer));
+                if (result > 0) {
+                    bytes_received += static_cast<unsigned long long>(result);
+                    replay.received.feed(buffer, static_cast<std::string::size_type>(result),
+                                         [&](unsigned char type, unsigned id) {
+                        if (type != FCGI_END_REQUEST)
+                            return;
+                        std::map<unsigned, Clock::time_point>::iterator it = replay.started.find(id);
+                        if (it == replay.started.end())
+                            return;
+                        latencies.push_back(std::chrono::duration<double, std::milli>(now - it->second).count());
+                        replay.started.erase(it);
+                    });
+                } else if (result == 0 || (errno != EAGAIN && errno != EINTR)) {
+                    failed += replay.started.size();
+                    replay.started.clear();
+                    replay.queue.clear();
+                    close(replay.fd);
+                    replay.finished = true;
+                }
+            }
+        }
+    }
+
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    std::sort(latencies.begin(), latencies.end());
+    auto percentile = [&](double p) {
+        return latencies.empty() ? 0.0 :
+            latencies[std::min(latencies.size() - 1, static_cast<std::size_t>(p * static_cast<double>(latencies.size())))];
+    };
+    double total = 0;
+    for (double latency : latencies)
+        total += latency;
+
+    std::printf("connections    %zu\n", replays.size());
+    std::printf("requests       %zu (%lu failed)\n", latencies.size(), failed);
+    std::printf("elapsed        %.3f s\n", seconds);
+    std::printf("throughput     %.1f requests/s\n", seconds > 0 ? static_cast<double>(latencies.size()) / seconds : 0.0);
+    std::printf("bytes          %llu sent, %llu received\n", bytes_sent, bytes_received);
+    std::printf("latency ms     avg %.3f  p50 %.3f  p90 %.3f  p99 %.3f  max %.3f\n",
+                latencies.empty() ? 0.0 : total / static_cast<double>(latencies.size()),
+                percentile(0.5), percentile(0.9), percentile(0.99), latencies.empty() ? 0.0 : latencies.back());
+    return failed != 0;
+}
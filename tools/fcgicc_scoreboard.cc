@@ -0,0 +1,109 @@
+// vim: set expandtab ts=4 sw=4 :
+/*
+ * Copyright 2008, 2009 Andrey Zholos. All rights reserved.
+ * Copyright 2024 Chris Frey.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the names of the copyright holders nor the names of contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * This file is part of the FastCGI C++ Class library (fcgicc) version 0.1,
+ * available at http://althenia.net/fcgicc
+ */
+
+
+
+// Prints the scoreboard written by FastCGIServerBase::scoreboard().
+//
+//     fcgicc_scoreboard FILE
+
+#include <fcgicc.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+static const char* const state_names[] = { "unused", "idle", "reading", "handler", "writing" };
+
+
+int main(int argc, const char* argv[])
+{
+    if (argc != 2) {
+        std::fprintf(stderr, "usage: %s FILE\n", argv[0]);
+        return 2;
+    }
+
+    int file = open(argv[1], O_RDONLY);
+    struct stat st;
+    if (file == -1 || fstat(file, &st) == -1) {
+        std::perror(argv[1]);
+        return 1;
+    }
+    std::size_t size = static_cast<std::size_t>(st.st_size);
+    if (size < sizeof(FastCGIScoreboard)) {
+        std::fprintf(stderr, "%s: not a scoreboard\n", argv[1]);
+        return 1;
+    }
+    void* shared = mmap(NULL, size, PROT_READ, MAP_SHARED, file, 0);
+    close(file);
+    if (shared == MAP_FAILED) {
+        std::perror("mmap");
+        return 1;
+    }
+
+    FastCGIScoreboard* board = static_cast<FastCGIScoreboard*>(shared);
+    if (std::memcmp(board->magic, "FCGICCSB", 8) != 0 || board->version != 1 ||
+            FastCGIScoreboard::bytes(board->size) > size) {
+        std::fprintf(stderr, "%s: not a scoreboard\n", argv[1]);
+        return 1;
+    }
+
+    long long now = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+
+    std::printf("%4s %8s %-8s %10s %12s %14s %14s\n",
+                "slot", "pid", "state", "busy_ms", "requests", "bytes_in", "bytes_out");
+    for (unsigned i = 0; i < board->size; i++) {
+        const FastCGIScoreboard::Slot& slot = board->slots()[i];
+        unsigned state = slot.state.load(std::memory_order_relaxed);
+        if (state == FastCGIScoreboard::unused)
+            continue;
+        long long start = slot.request_start_us.load(std::memory_order_relaxed);
+        std::printf("%4u %8ld %-8s %10lld %12llu %14llu %14llu\n", i,
+                    slot.pid.load(std::memory_order_relaxed),
+                    state < sizeof(state_names) / sizeof(*state_names) ? state_names[state] : "?",
+                    start != 0 ? (now - start) / 1000 : 0LL,
+                    slot.requests.load(std::memory_order_relaxed),
+                    slot.bytes_in.load(std::memory_order_relaxed),
+                    slot.bytes_out.load(std::memory_order_relaxed));
+    }
+    return 0;
+}